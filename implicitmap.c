@@ -19,11 +19,19 @@
     #include "ext_obex.h"       // required for new style Max object
     #include "ext_dictionary.h"
     #include "jpatcher_api.h"
+    #include "ext_buffer.h"
+#elif defined(IMPMAPD)
+    #include "implicitmapd.h"   // Pd-style host API provided by the daemon
+    #define A_SYM A_SYMBOL
 #else
     #include "m_pd.h"
     #define A_SYM A_SYMBOL
 #endif
 #include "mapper/mapper.h"
+#include "impmap_log.h"
+#include "impmap_model.h"
+#include "impmap_follow.h"
+#include "impmap_pack.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +43,31 @@
 
 #define INTERVAL 1
 #define MAX_LIST 256
+#define REPLAY_CHUNK 1000   // records per tick when replaying at full speed
+
+// input frame completion policies
+#define FRAME_OFF       0   // sample-and-hold each update as it arrives
+#define FRAME_ALL       1   // wait for every input signal
+#define FRAME_QUORUM    2   // wait for a number or fraction of input signals
+#define FRAME_DEADLINE  3   // wait for every signal or a deadline after the first
+
+// formats for the input vector on outlet1
+#define INPUT_LIST      0   // the whole vector as one list
+#define INPUT_RANGE     1   // "offset v1 v2 ..." lists for changed segments
+#define INPUT_NAMED     2   // "<signal> v1 v2 ..." for each changed signal
+
+// vectors that can be bound to a Pd array or Max buffer~
+#define ARRAY_IN        0   // live input vector
+#define ARRAY_OUT       1   // live output vector
+#define ARRAY_SNAP_IN   2   // snapshot inputs, one row per snapshot
+#define ARRAY_SNAP_OUT  3   // snapshot outputs, one row per snapshot
+#define ARRAY_SWEEP     4   // results of the last sweep
+#define NUM_ARRAYS      5
+#define MAX_SWEEP       65536   // grid points in one sweep
+#define CONNECT_PERIOD  100     // polls between attempts to restore maps
+#define MAX_MAP_SOURCES 8       // sources libmapper allows in one map
+#define MAX_EXPRESSION  4096
+#define MAX_SCENES      16
 
 // *********************************************************
 // -(object struct)-----------------------------------------
@@ -42,25 +75,85 @@ typedef struct _signal_ref
 {
     void *x;
     int offset;
+    int length;
+    t_symbol *name;
+    int sent;                   // output has been sent since the layout changed
+    int offloaded;              // computed by a direct map instead
+    float deadband_abs;
+    float deadband_rel;
 } t_signal_ref;
 
+typedef struct _deadband
+{
+    char *name;                 // 0 for the default deadband
+    float abs;
+    float rel;
+    struct _deadband *next;
+} *t_deadband;
+
+typedef struct _pending_map
+{
+    char *name;                 // local signal
+    char *remote;               // <device>/<signal> of the remote signal
+    int output;                 // we are the source of the map
+    mapper_mode mode;
+    char *expression;
+    struct _pending_map *next;
+} *t_pending_map;
+
 typedef struct _snapshot
 {
     int id;
     float *inputs;
     float *outputs;
+    void *packed;               // inputs then outputs in the storage format,
+                                // replacing the float vectors when set
+    float weight;               // number of snapshots merged into this one
     struct _snapshot *next;
 } *t_snapshot;
 
+// A named snapshot set and the model trained from it.  The current scene's
+// set and model live in the object itself and are only stored here while
+// another scene is current.
+typedef struct _scene
+{
+    t_symbol *name;
+    t_snapshot snapshots;
+    int num_snapshots;
+    t_impmap_model *model;
+    float morph;                // blend weight, 0 if not contributing
+} t_scene;
+
+// The grid "admit" merges new snapshots on, kept from one snapshot to the
+// next so that admitting one is a hash lookup.  Snapshots are indexed by
+// their position in the list when the grid was built, then in the order
+// they were admitted.
+typedef struct _admit_grid
+{
+    int valid;                  // cleared when the snapshots change otherwise
+    int size_in;
+    int count;                  // snapshots with a cell
+    int capacity;
+    int size;                   // hash slots, a power of two
+    int *table;                 // snapshot kept for each cell, or -1
+    t_snapshot *snaps;
+    int *coords;                // size_in cell coordinates per snapshot
+    float low[MAX_LIST];        // bounds of the snapshot inputs
+    float high[MAX_LIST];
+    float cell[MAX_LIST];
+} t_admit_grid;
+
 typedef struct _impmap
 {
     t_object ob;
     void *outlet1;
     void *outlet2;
     void *outlet3;
+    void *outlet4;              // output variance from engines that estimate it
     void *clock;          // pointer to clock object
     void *timeout;
     char *name;
+    mapper_network network;
     mapper_device device;
     mapper_signal dummy_input;
     mapper_signal dummy_output;
@@ -68,16 +161,98 @@ typedef struct _impmap
     int ready;
     int mute;
     int new_in;
+    int monitor;                // output the input vector even with a native model
+    int variance;               // output the model's variance on outlet4
+    int learn;                  // fold each new snapshot into the model
+    float admit;                // grid resolution for merging new snapshots
+                                // into existing ones, 0 to keep them all
+    int admit_max;              // compact beyond this many snapshots, or 0
+    t_admit_grid admit_grid;
+    int storage;                // t_impmap_pack_format of stored snapshots
+    int pack_columns;           // columns with a range, 0 until one is set
+    float pack_low[MAX_LIST * 2];   // range of each input then output column
+    float pack_step[MAX_LIST * 2];  // for the integer formats
+    int queue_open;
+    int out_valid;              // values_out holds what was last sent
+    long sends_skipped;
+    int delta;                  // only send output signals that have changed
+    double refresh;             // ms between forced full updates in delta mode
+    double last_refresh;
+    long updates_sent;
+    long updates_suppressed;
+    t_deadband deadbands;
+    float sent_out[MAX_LIST];
+    mapper_timetag_t frame_tt;  // timetag of the input frame being received
+    int frame_policy;
+    float frame_quorum;
+    double frame_deadline;      // ms
+    double frame_window;        // ms of timetag spread allowed within a frame
+    double frame_start;         // host time of the first update in the frame
+    int frame_count;            // signals received for the pending frame
+    int frame_signals[MAX_LIST];
+    char frame_arrived[MAX_LIST];
+    float frame_values[MAX_LIST];
+    long frame_updates;
+    long frames;
+    t_impmap_model *model;
     int num_snapshots;
     t_snapshot snapshots;
+    t_scene scenes[MAX_SCENES];
+    int num_scenes;
+    int scene;                  // index of the current scene
+    int morphing;               // some scene has a morph weight
     t_atom buffer_in[MAX_LIST];
+    float values_in[MAX_LIST];
+    int changed_in[MAX_LIST];   // offsets changed since the last evaluation
+    char changed_flag[MAX_LIST];
+    int num_changed;            // -1 if everything should be re-evaluated
+    int input_format;
+    int dirty_in[MAX_LIST];     // input signals changed since last output
+    char dirty_flag[MAX_LIST];
+    int num_dirty;              // -1 if every signal should be output
     int size_in;
+    int num_inputs;
+    int num_outputs;
+    float fill;                 // value for snapshot columns with no data
+    int offload;                // push affine models as convergent maps
+    float offload_threshold;    // relative weight below which terms are dropped
+    mapper_map offloaded[MAX_LIST];
+    int num_offloaded;
     t_atom buffer_out[MAX_LIST];
+    float values_out[MAX_LIST];
     int size_out;
     int query_count;
     t_atom msg_buffer;
     t_signal_ref signals_in[MAX_LIST];
     t_signal_ref signals_out[MAX_LIST];
+    t_impmap_log *record_log;
+    t_impmap_log *capture_log;
+    t_impmap_log *replay_log;
+    void *replay_clock;
+    double replay_speed;        // 0 replays as fast as possible
+    double replay_start;        // host time of the first replayed record (ms)
+    double replay_first;        // timetag of the first replayed record (s)
+    mapper_timetag_t replay_tt;
+    int replay_pending;
+    t_impmap_log_record replay_rec;
+    float replay_values[MAX_LIST];
+    int replay_map[MAX_LIST];   // input signal fed by each signal of the log
+    t_impmap_follower *follower;
+    int following;
+    float *follow_frames;       // input frames of the template being recorded
+    int follow_rows;
+    int follow_capacity;
+    int follow_recording;
+    t_symbol *arrays[NUM_ARRAYS];
+#ifdef MAXMSP
+    t_buffer_ref *array_refs[NUM_ARRAYS];
+#endif
+    char *topology;             // file the signal set is kept in, if any
+    int restoring;              // topology is being restored
+    t_pending_map pending_maps; // restored signals waiting for their maps
+    int pending_count;          // polls until the next attempt
+    t_symbol *subscribed[MAX_LIST]; // remote devices of the pending maps
+    int num_subscribed;             // whose signals were requested
 } impmap;
 
 static t_symbol *ps_list;
@@ -103,10 +278,118 @@ static void impmap_output_snapshot(impmap *x);
 static void impmap_clear_snapshots(impmap *x);
 static void impmap_mute_output(impmap *x, t_symbol *s, int argc, t_atom *argv);
 static void impmap_process(impmap *x);
-static void impmap_save(impmap *x);
-static void impmap_load(impmap *x);
+static void impmap_engine(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_param(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_monitor(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_variance(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_learn(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_output_variance(impmap *x);
+static void impmap_cache(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_pca(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_evaluate(impmap *x);
+static void impmap_update_outputs(impmap *x, const float *values);
+static void impmap_send_outputs(impmap *x, const float *values, int force);
+static void impmap_delta(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_deadband(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_refresh(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_apply_deadbands(impmap *x);
+static int impmap_snapshot_matrix(impmap *x, float **inputs, float **outputs);
+static void impmap_save(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_load(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static t_snapshot impmap_add_snapshot(impmap *x);
+static float *impmap_snapshot_weights(impmap *x);
+static void impmap_compact(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_admit(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static int impmap_compact_snapshots(impmap *x, float resolution, int max);
+static void impmap_input_grid(impmap *x, float resolution, float *low,
+                              float *cell);
+static void impmap_grid_cell(impmap *x, const float *inputs, const float *low,
+                             const float *cell, int *coords);
+static int impmap_grid_slot(impmap *x, const int *table, int size,
+                            const int *coords, const int *c);
+static t_snapshot impmap_admit_snapshot(impmap *x, t_snapshot snap);
+static void impmap_admit_rebuild(impmap *x, t_snapshot snap,
+                                 const float *inputs);
+static void impmap_merge_snapshot(impmap *x, t_snapshot into, t_snapshot from);
+static void impmap_renumber_snapshots(impmap *x);
+static void impmap_output_compression(impmap *x);
+static int impmap_train(impmap *x);
+static int impmap_column_map(const t_signal_ref *from, int num_from,
+                             int size_from, const t_signal_ref *to,
+                             int num_to, int size_to, int *map);
+static void impmap_remap_templates(impmap *x, const t_signal_ref *from,
+                                   int num_from, int size_from);
+static void impmap_remap_snapshots(impmap *x, const t_signal_ref *from,
+                                   int num_from, int size_from, int outputs);
+static void impmap_fill(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_offload(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_offload_push(impmap *x);
+static void impmap_offload_release(impmap *x);
+static mapper_signal impmap_remote_signal(mapper_signal local, int output);
+static void impmap_scene(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_list_scenes(impmap *x);
+static int impmap_find_scene(impmap *x, t_symbol *name);
+static void impmap_morph(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static int impmap_morph_ready(impmap *x);
+static void impmap_morph_evaluate(impmap *x, float *out);
+static void impmap_morph_batch(impmap *x, const float *inputs, float *outputs,
+                               int num_rows);
+static void impmap_free_snapshots(t_snapshot snapshots);
+static void impmap_free_snapshot(t_snapshot snap);
+static void impmap_storage(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_snapshot_values(impmap *x, t_snapshot snap, float *inputs,
+                                   float *outputs);
+static void impmap_pack_snapshot(impmap *x, t_snapshot snap);
+static void impmap_unpack_snapshot(impmap *x, t_snapshot snap, int size_in,
+                                   int size_out);
+static void impmap_pack_all(impmap *x);
+static void impmap_unpack_all(impmap *x, int size_in, int size_out);
+static void impmap_set_pack_columns(impmap *x, const float *low,
+                                    const float *high, int widen);
+static void impmap_record(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_capture(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_replay(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_replay_tick(impmap *x);
+static void impmap_stop_replay(impmap *x);
+static void impmap_follow(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_follow_input(impmap *x);
+static void impmap_receive_input(impmap *x, int index, int offset,
+                                 int length, const float *values,
+                                 mapper_timetag_t *tt);
+static void impmap_set_input(impmap *x, int index, int offset, int length,
+                             const float *values);
+static void impmap_output_input(impmap *x);
+static void impmap_input_format(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_frame(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_frame_window(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_frame_complete(impmap *x);
+static void impmap_process_input(impmap *x);
+static void impmap_clear_changed(impmap *x);
+static void impmap_clear_dirty(impmap *x);
+static void impmap_invalidate_changed(impmap *x);
+static void impmap_array(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static int impmap_write_array(impmap *x, int which, const float *values,
+                              int length);
+static void impmap_write_snapshot_arrays(impmap *x);
+static void impmap_output_outputs(impmap *x);
+static void impmap_topology(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_save_topology(impmap *x);
+static void impmap_restore_topology(impmap *x);
+static void impmap_restore_maps(impmap *x);
+static void impmap_free_pending_map(t_pending_map pending);
+static const char *impmap_mode_name(mapper_mode mode);
+static int compare_signal_names(const void *l, const void *r);
+static void impmap_sweep(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static void impmap_render(impmap *x, t_symbol *s, int argc, t_atom *argv);
+static int impmap_read_log_matrix(impmap *x, const char *path, float **inputs,
+                                  mapper_timetag_t **tts);
+static t_impmap_log *impmap_open_log(impmap *x, const char *path, int write);
+static int impmap_log_signal_map(impmap *x, t_impmap_log *log, int *map);
+static void impmap_close_logs(impmap *x);
 #ifdef MAXMSP
     void impmap_assist(impmap *x, void *b, long m, long a, char *s);
+    t_max_err impmap_notify(impmap *x, t_symbol *s, t_symbol *msg,
+                            void *sender, void *data);
 #endif
 static void impmap_update_input_vector_positions(impmap *x);
 static void impmap_update_output_vector_positions(impmap *x);
@@ -115,7 +398,13 @@ static void maxpd_atom_set_string(t_atom *a, const char *string);
 static void maxpd_atom_set_int(t_atom *a, int i);
 static double maxpd_atom_get_float(t_atom *a);
 static void maxpd_atom_set_float(t_atom *a, float d);
-void maxpd_atom_set_float_array(t_atom *a, float *d, int length);
+static int maxpd_atom_get_int_arg(int argc, t_atom *argv, int *value);
+void maxpd_atom_set_float_array(t_atom *a, const float *d, int length);
+static double maxpd_get_time(void);
+static double maxpd_get_real_time(void);
+static int maxpd_array_read(impmap *x, t_symbol *name, float **values);
+static int maxpd_array_write(impmap *x, t_symbol *name, void *ref,
+                             const float *values, int length);
 
 // *********************************************************
 // -(global class pointer variable)-------------------------
@@ -130,6 +419,7 @@ int main(void)
     c = class_new("implicitmap", (method)impmap_new, (method)impmap_free,
                   (long)sizeof(impmap), 0L, A_GIMME, 0);
     class_addmethod(c, (method)impmap_assist,           "assist",    A_CANT,  0);
+    class_addmethod(c, (method)impmap_notify,           "notify",    A_CANT,  0);
     class_addmethod(c, (method)impmap_snapshot,         "snapshot",  A_GIMME, 0);
     class_addmethod(c, (method)impmap_randomize,        "randomize", A_GIMME, 0);
     class_addmethod(c, (method)impmap_list,             "list",      A_GIMME, 0);
@@ -139,6 +429,35 @@ int main(void)
     class_addmethod(c, (method)impmap_process,          "process",   A_GIMME, 0);
     class_addmethod(c, (method)impmap_save,             "export",    A_GIMME, 0);
     class_addmethod(c, (method)impmap_load,             "import",    A_GIMME, 0);
+    class_addmethod(c, (method)impmap_record,           "record",    A_GIMME, 0);
+    class_addmethod(c, (method)impmap_compact,          "compact",   A_GIMME, 0);
+    class_addmethod(c, (method)impmap_admit,            "admit",     A_GIMME, 0);
+    class_addmethod(c, (method)impmap_storage,          "storage",   A_GIMME, 0);
+    class_addmethod(c, (method)impmap_follow,           "follow",    A_GIMME, 0);
+    class_addmethod(c, (method)impmap_capture,          "capture",   A_GIMME, 0);
+    class_addmethod(c, (method)impmap_replay,           "replay",    A_GIMME, 0);
+    class_addmethod(c, (method)impmap_engine,           "engine",    A_GIMME, 0);
+    class_addmethod(c, (method)impmap_param,            "param",     A_GIMME, 0);
+    class_addmethod(c, (method)impmap_monitor,          "monitor",   A_GIMME, 0);
+    class_addmethod(c, (method)impmap_variance,         "variance",  A_GIMME, 0);
+    class_addmethod(c, (method)impmap_learn,            "learn",     A_GIMME, 0);
+    class_addmethod(c, (method)impmap_scene,            "scene",     A_GIMME, 0);
+    class_addmethod(c, (method)impmap_list_scenes,      "scenes",    0);
+    class_addmethod(c, (method)impmap_morph,            "morph",     A_GIMME, 0);
+    class_addmethod(c, (method)impmap_cache,            "cache",     A_GIMME, 0);
+    class_addmethod(c, (method)impmap_pca,              "pca",       A_GIMME, 0);
+    class_addmethod(c, (method)impmap_delta,            "delta",     A_GIMME, 0);
+    class_addmethod(c, (method)impmap_deadband,         "deadband",  A_GIMME, 0);
+    class_addmethod(c, (method)impmap_refresh,          "refresh",   A_GIMME, 0);
+    class_addmethod(c, (method)impmap_input_format,     "inputformat", A_GIMME, 0);
+    class_addmethod(c, (method)impmap_array,            "array",     A_GIMME, 0);
+    class_addmethod(c, (method)impmap_sweep,            "sweep",     A_GIMME, 0);
+    class_addmethod(c, (method)impmap_render,           "render",    A_GIMME, 0);
+    class_addmethod(c, (method)impmap_topology,         "topology",  A_GIMME, 0);
+    class_addmethod(c, (method)impmap_fill,             "fill",      A_GIMME, 0);
+    class_addmethod(c, (method)impmap_offload,          "offload",   A_GIMME, 0);
+    class_addmethod(c, (method)impmap_frame,            "frame",     A_GIMME, 0);
+    class_addmethod(c, (method)impmap_frame_window,     "framewindow", A_GIMME, 0);
     class_register(CLASS_BOX, c); /* CLASS_NOBOX */
     mapper_class = c;
     ps_list = gensym("list");
@@ -159,6 +478,35 @@ int implicitmap_setup(void)
     class_addmethod(c, (t_method)impmap_process,          gensym("process"),   A_GIMME, 0);
     class_addmethod(c, (t_method)impmap_save,             gensym("export"),      A_GIMME, 0);
     class_addmethod(c, (t_method)impmap_load,             gensym("import"),      A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_record,           gensym("record"),    A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_compact,          gensym("compact"),   A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_admit,            gensym("admit"),     A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_storage,          gensym("storage"),   A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_follow,           gensym("follow"),    A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_capture,          gensym("capture"),   A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_replay,           gensym("replay"),    A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_engine,           gensym("engine"),    A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_param,            gensym("param"),     A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_monitor,          gensym("monitor"),   A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_variance,         gensym("variance"),  A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_learn,            gensym("learn"),     A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_scene,            gensym("scene"),     A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_list_scenes,      gensym("scenes"),    0);
+    class_addmethod(c, (t_method)impmap_morph,            gensym("morph"),     A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_cache,            gensym("cache"),     A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_pca,              gensym("pca"),       A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_delta,            gensym("delta"),     A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_deadband,         gensym("deadband"),  A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_refresh,          gensym("refresh"),   A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_input_format,     gensym("inputformat"), A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_array,            gensym("array"),     A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_sweep,            gensym("sweep"),     A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_render,           gensym("render"),    A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_topology,         gensym("topology"),  A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_fill,             gensym("fill"),      A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_offload,          gensym("offload"),   A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_frame,            gensym("frame"),     A_GIMME, 0);
+    class_addmethod(c, (t_method)impmap_frame_window,     gensym("framewindow"), A_GIMME, 0);
     mapper_class = c;
     ps_list = gensym("list");
     return 0;
@@ -173,9 +521,11 @@ void *impmap_new(t_symbol *s, int argc, t_atom *argv)
     long i;
     const char *alias = NULL;
     const char *iface = NULL;
+    const char *topology = NULL;
 
 #ifdef MAXMSP
     if ((x = object_alloc(mapper_class))) {
+        x->outlet4 = listout((t_object *)x);
         x->outlet3 = listout((t_object *)x);
         x->outlet2 = listout((t_object *)x);
         x->outlet1 = listout((t_object *)x);
@@ -184,6 +534,7 @@ void *impmap_new(t_symbol *s, int argc, t_atom *argv)
         x->outlet1 = outlet_new(&x->ob, gensym("list"));
         x->outlet2 = outlet_new(&x->ob, gensym("list"));
         x->outlet3 = outlet_new(&x->ob, gensym("list"));
+        x->outlet4 = outlet_new(&x->ob, gensym("list"));
 #endif
         x->name = strdup("implicitmap");
         for (i = 0; i < argc; i++) {
@@ -200,6 +551,12 @@ void *impmap_new(t_symbol *s, int argc, t_atom *argv)
                         i++;
                     }
                 }
+                else if(strcmp(maxpd_atom_get_string(argv+i), "@topology") == 0) {
+                    if ((argv+i+1)->a_type == A_SYM) {
+                        topology = maxpd_atom_get_string(argv+i+1);
+                        i++;
+                    }
+                }
             }
         }
 
@@ -215,6 +572,24 @@ void *impmap_new(t_symbol *s, int argc, t_atom *argv)
             x->ready = 0;
             x->mute = 0;
             x->new_in = 0;
+            x->monitor = 1;
+            x->queue_open = 0;
+            x->out_valid = 0;
+            x->sends_skipped = 0;
+            x->delta = 0;
+            x->refresh = 1000;
+            x->last_refresh = 0;
+            x->updates_sent = 0;
+            x->updates_suppressed = 0;
+            x->deadbands = 0;
+            x->model = 0;
+            x->frame_policy = FRAME_OFF;
+            x->frame_quorum = 1;
+            x->frame_deadline = 5;
+            x->frame_window = 1;
+            x->frame_count = 0;
+            x->frame_updates = 0;
+            x->frames = 0;
             x->query_count = 0;
             x->num_snapshots = 0;
             x->snapshots = 0;
@@ -222,17 +597,72 @@ void *impmap_new(t_symbol *s, int argc, t_atom *argv)
             for (i = 0; i < MAX_LIST; i++) {
                 maxpd_atom_set_float(x->buffer_in+i, 0);
                 maxpd_atom_set_float(x->buffer_out+i, 0);
+                x->values_in[i] = 0;
+                x->values_out[i] = 0;
+                x->frame_arrived[i] = 0;
+                x->changed_flag[i] = 0;
+                x->dirty_flag[i] = 0;
+                x->sent_out[i] = 0;
+                x->signals_out[i].sent = 0;
+                x->signals_out[i].offloaded = 0;
+                x->signals_out[i].deadband_abs = 0;
+                x->signals_out[i].deadband_rel = 0;
                 x->signals_in[i].x = x;
                 x->signals_out[i].x = x;
             }
             x->size_in = 0;
             x->size_out = 0;
+            x->num_inputs = 0;
+            x->num_outputs = 0;
+            x->fill = 0;
+            x->admit = 0;
+            x->admit_max = 0;
+            x->admit_grid.valid = 0;
+            x->admit_grid.table = 0;
+            x->admit_grid.snaps = 0;
+            x->admit_grid.coords = 0;
+            x->storage = IMPMAP_PACK_FLOAT;
+            x->pack_columns = 0;
+            x->offload = 0;
+            x->offload_threshold = 0.001;
+            x->num_offloaded = 0;
+            x->scenes[0].name = gensym("default");
+            x->scenes[0].model = 0;
+            x->scenes[0].morph = 0;
+            x->num_scenes = 1;
+            x->scene = 0;
+            x->morphing = 0;
+            x->num_changed = -1;
+            x->input_format = INPUT_LIST;
+            x->num_dirty = -1;
+            x->record_log = 0;
+            x->capture_log = 0;
+            x->replay_log = 0;
+            x->follower = impmap_follow_new();
+            x->following = 0;
+            x->follow_frames = 0;
+            x->follow_rows = 0;
+            x->follow_capacity = 0;
+            x->follow_recording = 0;
+            x->topology = topology ? strdup(topology) : 0;
+            x->restoring = 0;
+            x->pending_maps = 0;
+            x->pending_count = 0;
+            x->num_subscribed = 0;
+            for (i = 0; i < NUM_ARRAYS; i++) {
+                x->arrays[i] = 0;
+#ifdef MAXMSP
+                x->array_refs[i] = 0;
+#endif
+            }
 #ifdef MAXMSP
             x->clock = clock_new(x, (method)impmap_poll);    // Create the timing clock
             x->timeout = clock_new(x, (method)impmap_output_snapshot);
+            x->replay_clock = clock_new(x, (method)impmap_replay_tick);
 #else
             x->clock = clock_new(x, (t_method)impmap_poll);
             x->timeout = clock_new(x, (t_method)impmap_output_snapshot);
+            x->replay_clock = clock_new(x, (t_method)impmap_replay_tick);
 #endif
             clock_delay(x->clock, INTERVAL);  // Set clock to go off after delay
         }
@@ -244,17 +674,70 @@ void *impmap_new(t_symbol *s, int argc, t_atom *argv)
 // -(free)--------------------------------------------------
 void impmap_free(impmap *x)
 {
+    int i;
     if (x->clock) {
         clock_unset(x->clock);    // Remove clock routine from the scheduler
         clock_free(x->clock);     // Frees memory used by clock
     }
+    if (x->timeout) {
+        clock_unset(x->timeout);
+        clock_free(x->timeout);
+    }
+    if (x->replay_clock) {
+        clock_unset(x->replay_clock);
+        clock_free(x->replay_clock);
+    }
+    // direct maps run between remote devices and would outlive us, so
+    // their release is sent while everything is still in place
+    if (x->num_offloaded) {
+        impmap_offload_release(x);
+        mapper_device_poll(x->device, 0);
+    }
+    impmap_log_close(x->record_log);
+    impmap_log_close(x->capture_log);
+    impmap_log_close(x->replay_log);
+    impmap_follow_free(x->follower);
+    free(x->follow_frames);
+    free(x->admit_grid.table);
+    free(x->admit_grid.snaps);
+    free(x->admit_grid.coords);
+    impmap_model_free(x->model);
+    // the patch is not told about snapshots freed with the object
+    impmap_free_snapshots(x->snapshots);
+    for (i = 0; i < x->num_scenes; i++) {
+        if (i == x->scene)
+            continue;
+        impmap_free_snapshots(x->scenes[i].snapshots);
+        impmap_model_free(x->scenes[i].model);
+    }
+#ifdef MAXMSP
+    for (i = 0; i < NUM_ARRAYS; i++) {
+        if (x->array_refs[i])
+            object_free(x->array_refs[i]);
+    }
+#endif
+    while (x->pending_maps) {
+        t_pending_map temp = x->pending_maps->next;
+        impmap_free_pending_map(x->pending_maps);
+        x->pending_maps = temp;
+    }
+    if (x->topology)
+        free(x->topology);
+    while (x->deadbands) {
+        t_deadband temp = x->deadbands->next;
+        free(x->deadbands->name);
+        free(x->deadbands);
+        x->deadbands = temp;
+    }
     if (x->device) {
         mapper_device_free(x->device);
     }
+    if (x->network) {
+        mapper_network_free(x->network);
+    }
     if (x->name) {
         free(x->name);
     }
-    impmap_clear_snapshots(x);
 }
 
 // *********************************************************
@@ -289,6 +772,31 @@ void impmap_print_properties(impmap *x)
         //output numOutputs
         maxpd_atom_set_int(&x->msg_buffer, mapper_device_num_signals(x->device, MAPPER_DIR_OUTGOING) - 1);
         outlet_anything(x->outlet3, gensym("numOutputs"), 1, &x->msg_buffer);
+
+        //output engine
+        maxpd_atom_set_string(&x->msg_buffer,
+                              x->model ? x->model->engine->name : "none");
+        outlet_anything(x->outlet3, gensym("engine"), 1, &x->msg_buffer);
+
+        //output input updates received and frames assembled
+        t_atom stats[2];
+        maxpd_atom_set_int(stats, (int)x->frame_updates);
+        maxpd_atom_set_int(stats+1, (int)x->frames);
+        outlet_anything(x->outlet3, gensym("frames"), 2, stats);
+
+        //output evaluation cache hits and misses, and skipped sends
+        if (x->model) {
+            t_atom cache[3];
+            maxpd_atom_set_int(cache, (int)x->model->cache.hits);
+            maxpd_atom_set_int(cache+1, (int)x->model->cache.misses);
+            maxpd_atom_set_int(cache+2, (int)x->sends_skipped);
+            outlet_anything(x->outlet3, gensym("cache"), 3, cache);
+        }
+
+        //output signal updates sent and suppressed by the deadband
+        maxpd_atom_set_int(stats, (int)x->updates_sent);
+        maxpd_atom_set_int(stats+1, (int)x->updates_suppressed);
+        outlet_anything(x->outlet3, gensym("delta"), 2, stats);
     }
 }
 
@@ -307,9 +815,12 @@ void impmap_assist(impmap *x, void *b, long m, long a, char *s)
         else if (a == 1) {
             sprintf(s, "Snapshot data");
         }
-        else {
+        else if (a == 2) {
             sprintf(s, "Device information");
         }
+        else {
+            sprintf(s, "Output variance");
+        }
     }
 }
 #endif
@@ -328,14 +839,10 @@ void impmap_snapshot(impmap *x)
     x->query_count = 0;
 
     // allocate a new snapshot
-    if (x->ready) {
-        t_snapshot new_snapshot = (t_snapshot)malloc(sizeof(t_snapshot));
-        new_snapshot->id = x->num_snapshots++;
-        new_snapshot->next = x->snapshots;
-        new_snapshot->inputs = calloc(x->size_in, sizeof(float));
-        new_snapshot->outputs = calloc(x->size_out, sizeof(float));
-        x->snapshots = new_snapshot;
-    }
+    if (x->ready)
+        impmap_add_snapshot(x);
+    if (x->snapshots && x->snapshots->packed)
+        impmap_unpack_snapshot(x, x->snapshots, x->size_in, x->size_out);
 
     // iterate through input signals and store their current values
     psig = mapper_device_signals(x->device, MAPPER_DIR_INCOMING);
@@ -374,18 +881,55 @@ void impmap_snapshot(impmap *x)
 // -(snapshot)----------------------------------------------
 void impmap_output_snapshot(impmap *x)
 {
+    t_snapshot snap = x->snapshots, other;
+    float inputs[MAX_LIST], outputs[MAX_LIST];
+    int merged = 0;
+
     if (x->query_count) {
         post("query timeout! setting query count to 0 and outputting current values.");
         x->query_count = 0;
     }
-    maxpd_atom_set_int(x->buffer_in, x->snapshots->id+1);
+
+    // a snapshot falling in the grid cell of an earlier one is merged into
+    // it rather than kept
+    if (x->admit > 0 && x->num_snapshots > 1) {
+        other = impmap_admit_snapshot(x, snap);
+        if (other) {
+            impmap_merge_snapshot(x, other, snap);
+            x->snapshots = snap->next;
+            impmap_free_snapshot(snap);
+            x->num_snapshots--;
+            snap = other;
+            merged = 1;
+        }
+        if (x->admit_max && x->num_snapshots > x->admit_max
+            && impmap_compact_snapshots(x, x->admit, x->admit_max)) {
+            snap = x->snapshots;
+            merged = 1;
+        }
+        if (merged)
+            impmap_output_compression(x);
+    }
+
+    impmap_snapshot_values(x, snap, inputs, outputs);
+    maxpd_atom_set_int(x->buffer_in, x->num_snapshots);
     outlet_anything(x->outlet3, gensym("numSnapshots"), 1, x->buffer_in);
-    maxpd_atom_set_float_array(x->buffer_in, x->snapshots->inputs, x->size_in);
+    maxpd_atom_set_float_array(x->buffer_in, inputs, x->size_in);
     outlet_anything(x->outlet2, gensym("in"), x->size_in, x->buffer_in);
-    maxpd_atom_set_float_array(x->buffer_out, x->snapshots->outputs, x->size_out);
+    maxpd_atom_set_float_array(x->buffer_out, outputs, x->size_out);
     outlet_anything(x->outlet2, gensym("out"), x->size_out, x->buffer_out);
-    maxpd_atom_set_int(x->buffer_in, x->snapshots->id);
+    maxpd_atom_set_int(x->buffer_in, snap->id);
     outlet_anything(x->outlet2, gensym("snapshot"), 1, x->buffer_in);
+    impmap_write_snapshot_arrays(x);
+
+    // engines that cannot learn one sample at a time are retrained, which
+    // is itself incremental for some of them; a merged snapshot changes
+    // one the model has already learned, so it always retrains
+    if (x->learn && x->model
+        && (merged || !impmap_model_ready(x->model, x->size_in, x->size_out)
+            || impmap_model_learn(x->model, inputs, outputs)))
+        impmap_train(x);
+    impmap_pack_snapshot(x, x->snapshots);
 }
 
 // *********************************************************
@@ -406,379 +950,3364 @@ void impmap_mute_output(impmap *x, t_symbol *s, int argc, t_atom *argv)
 // -(process)-----------------------------------------------
 void impmap_process(impmap *x)
 {
-    outlet_anything(x->outlet2, gensym("process"), 0, 0);
+    // without a native engine training is left to the patch
+    if (!x->model) {
+        outlet_anything(x->outlet2, gensym("process"), 0, 0);
+        return;
+    }
+
+    if (!x->num_snapshots) {
+        post("implicitmap: no snapshots to train from");
+        return;
+    }
+    impmap_train(x);
 }
 
 // *********************************************************
-// -(save)--------------------------------------------------
-void impmap_save(impmap *x)
+// -(train the native model from the snapshots)-------------
+int impmap_train(impmap *x)
 {
-    outlet_anything(x->outlet2, gensym("export"), 0, 0);
+    float *inputs, *outputs, *weights;
+    int num_rows, result;
+
+    num_rows = impmap_snapshot_matrix(x, &inputs, &outputs);
+    weights = impmap_snapshot_weights(x);
+    impmap_invalidate_changed(x);
+    result = impmap_model_train(x->model, inputs, outputs, weights, num_rows,
+                                x->size_in, x->size_out);
+    if (result) {
+        // the direct maps would keep computing the old model
+        impmap_offload_release(x);
+        post("implicitmap: %s engine failed to train", x->model->engine->name);
+    }
+    else if (x->model->pca.size)
+        post("implicitmap: trained %s engine from %i snapshots on %i of %i "
+             "principal components", x->model->engine->name, num_rows,
+             x->model->pca.size, x->size_in);
+    else
+        post("implicitmap: trained %s engine from %i snapshots",
+             x->model->engine->name, num_rows);
+    if (!result && impmap_model_duplicates(x->model))
+        post("implicitmap: %i new snapshots share their input with an "
+             "earlier one, whose outputs they replace",
+             impmap_model_duplicates(x->model));
+    free(inputs);
+    free(outputs);
+    free(weights);
+
+    maxpd_atom_set_int(&x->msg_buffer, x->model->trained);
+    outlet_anything(x->outlet3, gensym("trained"), 1, &x->msg_buffer);
+    if (x->offload && !result)
+        impmap_offload_push(x);
+    return result;
 }
 
 // *********************************************************
-// -(load)--------------------------------------------------
-void impmap_load(impmap *x)
+// -(engine)------------------------------------------------
+// "engine <name>" evaluates the mapping natively, "engine none" hands the
+// input vector to the patch on outlet1 as before
+void impmap_engine(impmap *x, t_symbol *s, int argc, t_atom *argv)
 {
-    outlet_anything(x->outlet2, gensym("import"), 0, 0);
+    const char *name = "none";
+    if (argc && argv->a_type == A_SYM)
+        name = maxpd_atom_get_string(argv);
+
+    // the direct maps compute the old model
+    impmap_offload_release(x);
+    impmap_model_free(x->model);
+    x->model = 0;
+    if (strcmp(name, "none") != 0) {
+        x->model = impmap_model_new(name);
+        if (!x->model)
+            post("implicitmap: unknown engine '%s'", name);
+    }
+    maxpd_atom_set_string(&x->msg_buffer, x->model ? name : "none");
+    outlet_anything(x->outlet3, gensym("engine"), 1, &x->msg_buffer);
 }
 
 // *********************************************************
-// -(randomize)---------------------------------------------
-void impmap_randomize(impmap *x)
+// -(engine parameters)-------------------------------------
+void impmap_param(impmap *x, t_symbol *s, int argc, t_atom *argv)
 {
     int i;
-    float rand_val;
-
-    if (x->ready) {
-        mapper_timetag_now(&x->tt);
-        mapper_device_start_queue(x->device, x->tt);
-        mapper_signal *psig = mapper_device_signals(x->device, MAPPER_DIR_OUTGOING);
-        while (psig) {
-            if (*psig == x->dummy_output) {
-                psig = mapper_signal_query_next(psig);
-                continue;
-            }
-            t_signal_ref *ref = mapper_signal_user_data(*psig);
-            if (mapper_signal_type(*psig) != 'f')
-                continue;
-            int length = mapper_signal_length(*psig);
-            float v[length];
-            float *min = (float*)mapper_signal_minimum(*psig);
-            float *max = (float*)mapper_signal_maximum(*psig);
-            for (i = 0; i < length; i++) {
-                rand_val = (float)rand() / (float)RAND_MAX;
-                if (min && max) {
-                    v[i] = rand_val * (max[i] - min[i]) + min[i];
-                }
-                else {
-                    // if ranges have not been declared, assume normalized between 0 and 1
-                    v[i] = rand_val;
-                }
-                maxpd_atom_set_float(x->buffer_out + ref->offset + i, v[i]);
-            }
-            mapper_signal_update(*psig, v, 1, x->tt);
-            psig = mapper_signal_query_next(psig);
-        }
-        mapper_device_send_queue(x->device, x->tt);
-        outlet_anything(x->outlet2, gensym("out"), x->size_out, x->buffer_out);
+    if (!x->model) {
+        post("implicitmap: no engine selected");
+        return;
     }
+    if (argc < 1 || argv->a_type != A_SYM)
+        return;
+    float values[argc];
+    for (i = 1; i < argc; i++)
+        values[i-1] = atom_getfloat(argv + i);
+    if (impmap_model_set(x->model, maxpd_atom_get_string(argv), argc - 1,
+                         values))
+        post("implicitmap: %s engine has no parameter '%s'",
+             x->model->engine->name, maxpd_atom_get_string(argv));
 }
 
 // *********************************************************
-// -(anything)----------------------------------------------
-void impmap_list(impmap *x, t_symbol *s, int argc, t_atom *argv)
+// -(evaluation cache)--------------------------------------
+// "cache <entries> [epsilon]" memoises model evaluations on the input
+// vector quantised to epsilon; "cache 0" disables it
+void impmap_cache(impmap *x, t_symbol *s, int argc, t_atom *argv)
 {
-    if (x->mute)
+    int entries = 0;
+    float epsilon = 0;
+    if (!x->model) {
+        post("implicitmap: no engine selected");
         return;
+    }
+    maxpd_atom_get_int_arg(argc, argv, &entries);
+    if (argc > 1)
+        epsilon = atom_getfloat(argv+1);
+    impmap_model_set_cache(x->model, entries, epsilon);
+    x->sends_skipped = 0;
+}
 
-    if (argc != x->size_out) {
-        post("vector size mismatch");
+// *********************************************************
+// -(principal component stage)-----------------------------
+// "pca <variance>" feeds the engine the fewest principal components of the
+// input that explain that fraction of the snapshot variance; "pca 0"
+// gives it the raw input again
+void impmap_pca(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    int trained;
+    if (!x->model) {
+        post("implicitmap: no engine selected");
         return;
     }
+    if (argc < 1)
+        return;
+    trained = x->model->trained;
+    impmap_model_set_pca(x->model, atom_getfloat(argv));
+    // refit the projection rather than leave the model untrained
+    if (trained)
+        impmap_train(x);
+}
 
-    int i = 0;
+// *********************************************************
+// -(delta-only output)-------------------------------------
+void impmap_delta(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    int i;
+    maxpd_atom_get_int_arg(argc, argv, &x->delta);
+    // start from a full update
+    for (i = 0; i < MAX_LIST; i++)
+        x->signals_out[i].sent = 0;
+    x->updates_sent = x->updates_suppressed = 0;
+}
 
-    mapper_timetag_now(&x->tt);
-    mapper_device_start_queue(x->device, x->tt);
+// *********************************************************
+// -(output deadband)---------------------------------------
+// "deadband <abs> [rel]" sets the default, "deadband <signal> <abs> [rel]"
+// overrides it for one output signal.  An update is sent when any element
+// moves by more than abs + rel * |last sent value|.
+void impmap_deadband(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    const char *name = 0;
+    t_deadband db = x->deadbands;
+
+    if (argc && argv->a_type == A_SYM) {
+        name = maxpd_atom_get_string(argv);
+        if (*name == '/')
+            name++;
+        argc--;
+        argv++;
+    }
+    if (!argc)
+        return;
+
+    while (db) {
+        if ((!name && !db->name) || (name && db->name
+                                     && strcmp(name, db->name) == 0))
+            break;
+        db = db->next;
+    }
+    if (!db) {
+        db = (t_deadband)calloc(1, sizeof(struct _deadband));
+        db->name = name ? strdup(name) : 0;
+        db->next = x->deadbands;
+        x->deadbands = db;
+    }
+    db->abs = atom_getfloat(argv);
+    db->rel = argc > 1 ? atom_getfloat(argv+1) : 0;
+    impmap_apply_deadbands(x);
+}
 
+// *********************************************************
+// -(apply deadbands to output signals)---------------------
+void impmap_apply_deadbands(impmap *x)
+{
+    if (!x->ready)
+        return;
     mapper_signal *psig = mapper_device_signals(x->device, MAPPER_DIR_OUTGOING);
     while (psig) {
-        if (*psig == x->dummy_output) {
+        t_signal_ref *ref = mapper_signal_user_data(*psig);
+        if (*psig == x->dummy_output || !ref) {
             psig = mapper_signal_query_next(psig);
             continue;
         }
-        t_signal_ref *ref = mapper_signal_user_data(*psig);
-        int len = mapper_signal_length(*psig);
-        float v[len];
-        for (i = 0; i < len; i++) {
-            v[i] = atom_getfloat(argv + ref->offset + i);
+        const char *name = mapper_signal_name(*psig);
+        t_deadband db = x->deadbands, match = 0;
+        if (*name == '/')
+            name++;
+        while (db) {
+            if (db->name && strcmp(db->name, name) == 0) {
+                match = db;
+                break;
+            }
+            if (!db->name)
+                match = db;
+            db = db->next;
         }
-        mapper_signal_update(*psig, v, 1, x->tt);
-
+        ref->deadband_abs = match ? match->abs : 0;
+        ref->deadband_rel = match ? match->rel : 0;
         psig = mapper_signal_query_next(psig);
     }
-    mapper_device_send_queue(x->device, x->tt);
-    outlet_anything(x->outlet2, gensym("out"), argc, argv);
 }
 
 // *********************************************************
-// -(input handler)-----------------------------------------
-void impmap_on_input(mapper_signal sig, mapper_id instance, const void *value,
-                     int count, mapper_timetag_t *time)
+// -(forced refresh interval)-------------------------------
+void impmap_refresh(impmap *x, t_symbol *s, int argc, t_atom *argv)
 {
-    t_signal_ref *ref = mapper_signal_user_data(sig);
-    if (!ref) {
-        post("implicitmap: no user data for signal '%s' in on_input()",
-             mapper_signal_name(sig));
-    }
-    impmap *x = ref->x;
+    if (argc && (argv->a_type == A_FLOAT
+#ifdef MAXMSP
+                 || argv->a_type == A_LONG
+#endif
+                 ))
+        x->refresh = atom_getfloat(argv);
+}
 
-    int i, len = mapper_signal_length(sig);
-    float *valf = (float*)value;
-    for (i = 0; i < len; i++) {
-        if (ref->offset + i >= MAX_LIST) {
-            post("implicitmap: Maximum vector length exceeded!");
-            break;
-        }
-        maxpd_atom_set_float(x->buffer_in + ref->offset + i, valf ? valf[i] : 0);
+// *********************************************************
+// -(monitor input vector)----------------------------------
+void impmap_monitor(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    maxpd_atom_get_int_arg(argc, argv, &x->monitor);
+}
+
+// *********************************************************
+// -(online learning)---------------------------------------
+// "learn 1" updates the native model with each snapshot as it is taken,
+// without waiting for "process"
+void impmap_learn(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    maxpd_atom_get_int_arg(argc, argv, &x->learn);
+}
+
+// *********************************************************
+// -(variance output)---------------------------------------
+// "variance 1" outputs "variance v1 v2 ..." on outlet4 with each new output
+// vector, for engines that estimate their uncertainty
+void impmap_variance(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    maxpd_atom_get_int_arg(argc, argv, &x->variance);
+    if (x->variance && x->model && !x->model->engine->variance)
+        post("implicitmap: %s engine does not estimate variance",
+             x->model->engine->name);
+    else if (x->variance && x->morphing)
+        post("implicitmap: no variance output until the morph ends");
+}
+
+// *********************************************************
+// -(frame assembly policy)---------------------------------
+// "frame all", "frame quorum <count or fraction>", "frame deadline <ms>"
+// collect updates into coherent frames before the model sees them;
+// "frame off" writes each update straight into the input vector.
+void impmap_frame(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    const char *policy = "off";
+    if (argc && argv->a_type == A_SYM)
+        policy = maxpd_atom_get_string(argv);
+
+    // hand over anything already collected under the old policy
+    impmap_frame_complete(x);
+
+    if (strcmp(policy, "all") == 0)
+        x->frame_policy = FRAME_ALL;
+    else if (strcmp(policy, "quorum") == 0) {
+        x->frame_policy = FRAME_QUORUM;
+        if (argc > 1)
+            x->frame_quorum = atom_getfloat(argv+1);
+        if (x->frame_quorum <= 0)
+            x->frame_quorum = 1;
     }
-    x->new_in = 1;
+    else if (strcmp(policy, "deadline") == 0) {
+        x->frame_policy = FRAME_DEADLINE;
+        if (argc > 1)
+            x->frame_deadline = atom_getfloat(argv+1);
+        if (x->frame_deadline < 0)
+            x->frame_deadline = 0;
+    }
+    else if (strcmp(policy, "off") == 0)
+        x->frame_policy = FRAME_OFF;
+    else
+        post("implicitmap: unknown frame policy '%s'", policy);
 }
 
 // *********************************************************
-// -(query handler)-----------------------------------------
-void impmap_on_query(mapper_signal sig, mapper_id instance, const void *value,
-                     int count, mapper_timetag_t *time)
+// -(frame timetag window)----------------------------------
+// Updates whose timetags lie further than this from the first update of
+// the pending frame belong to the next frame.  Bundles from one device
+// share a timetag, so the window only needs to cover clock skew between
+// sources sampled on the same tick.
+void impmap_frame_window(impmap *x, t_symbol *s, int argc, t_atom *argv)
 {
-    t_signal_ref *ref = mapper_signal_user_data(sig);
-    if (!ref) {
-        post("implicitmap: no user data for signal '%s' in on_input()",
-             mapper_signal_name(sig));
+    if (argc && (argv->a_type == A_FLOAT
+#ifdef MAXMSP
+                 || argv->a_type == A_LONG
+#endif
+                 ))
+        x->frame_window = atom_getfloat(argv);
+}
+
+// *********************************************************
+// -(commit the pending frame)------------------------------
+void impmap_frame_complete(impmap *x)
+{
+    int i;
+    if (!x->frame_count)
+        return;
+    for (i = 0; i < x->frame_count; i++) {
+        t_signal_ref *ref = &x->signals_in[x->frame_signals[i]];
+        impmap_set_input(x, x->frame_signals[i], ref->offset, ref->length,
+                         x->frame_values + ref->offset);
+        x->frame_arrived[x->frame_signals[i]] = 0;
     }
-    impmap *x = ref->x;
+    x->frame_count = 0;
+    x->frames++;
+    if (x->replay_log)
+        impmap_process_input(x);
+}
 
-    int i, len = mapper_signal_length(sig);
-    float *valf = (float*)value;
-    for (i = 0; i < len; i++) {
-        if (ref->offset + i >= MAX_LIST) {
-            post("mapper: Maximum vector length exceeded!");
-            break;
-        }
-        if (valf)
-            x->snapshots->outputs[ref->offset + i] = valf[i];
+// *********************************************************
+// -(collect snapshots into matrices)-----------------------
+// Returns the number of rows; the caller frees both matrices.
+int impmap_snapshot_matrix(impmap *x, float **inputs, float **outputs)
+{
+    t_snapshot snap = x->snapshots;
+    int row = 0;
+
+    *inputs = malloc(x->num_snapshots * x->size_in * sizeof(float));
+    *outputs = malloc(x->num_snapshots * x->size_out * sizeof(float));
+    while (snap && row < x->num_snapshots) {
+        impmap_snapshot_values(x, snap, *inputs + row * x->size_in,
+                               *outputs + row * x->size_out);
+        snap = snap->next;
+        row++;
     }
+    return row;
+}
 
-    x->query_count --;
+// *********************************************************
+// -(add an empty snapshot)---------------------------------
+t_snapshot impmap_add_snapshot(impmap *x)
+{
+    t_snapshot new_snapshot = (t_snapshot)malloc(sizeof(struct _snapshot));
+    new_snapshot->id = x->num_snapshots++;
+    new_snapshot->next = x->snapshots;
+    new_snapshot->inputs = calloc(x->size_in, sizeof(float));
+    new_snapshot->outputs = calloc(x->size_out, sizeof(float));
+    new_snapshot->packed = 0;
+    new_snapshot->weight = 1;
+    x->snapshots = new_snapshot;
+    return new_snapshot;
+}
 
-    if (x->query_count == 0) {
-        clock_unset(x->timeout);
-        impmap_output_snapshot(x);
+// *********************************************************
+// -(collect snapshot weights)------------------------------
+// In the order of the snapshot matrices, or 0 if no snapshot has been
+// merged with another.
+float *impmap_snapshot_weights(impmap *x)
+{
+    t_snapshot snap;
+    float *weights;
+    int row = 0;
+
+    for (snap = x->snapshots; snap; snap = snap->next) {
+        if (snap->weight != 1)
+            break;
     }
+    if (!snap)
+        return 0;
+    weights = malloc(x->num_snapshots * sizeof(float));
+    for (snap = x->snapshots; snap && row < x->num_snapshots; snap = snap->next)
+        weights[row++] = snap->weight;
+    return weights;
 }
 
 // *********************************************************
-// -(connection handler)------------------------------------
-void impmap_on_map(mapper_device dev, mapper_map map, mapper_record_event e)
+// -(compact)-----------------------------------------------
+// "compact <resolution> [max]" merges snapshots whose inputs fall in the
+// same cell of a grid over the inputs, each cell spanning resolution times
+// the range of its input over the snapshots.  Merged snapshots keep the
+// weighted mean of their vectors and the sum of their weights.  With max,
+// the grid is made coarser until at most that many snapshots remain.
+void impmap_compact(impmap *x, t_symbol *s, int argc, t_atom *argv)
 {
-    // if connected involves current generic signal, create a new generic signal
-    impmap *x = (void*)mapper_device_user_data(dev);
-    if (!x) {
-        post("error in connect handler: user_data is NULL");
+    float resolution;
+    int max = 0, before = x->num_snapshots;
+
+    if (!argc || argv->a_type == A_SYM
+        || (resolution = maxpd_atom_get_float(argv)) <= 0) {
+        post("implicitmap: usage: compact <resolution> [max]");
         return;
     }
-    if (!x->ready) {
-        post("error in connect handler: device not ready");
+    if (x->query_count) {
+        post("implicitmap: cannot compact while a snapshot is in progress");
         return;
     }
+    maxpd_atom_get_int_arg(argc - 1, argv + 1, &max);
+    impmap_compact_snapshots(x, resolution, max > 0 ? max : 0);
+    post("implicitmap: compacted %i snapshots into %i", before,
+         x->num_snapshots);
+    impmap_output_compression(x);
+    maxpd_atom_set_int(&x->msg_buffer, x->num_snapshots);
+    outlet_anything(x->outlet3, gensym("numSnapshots"), 1, &x->msg_buffer);
+    impmap_write_snapshot_arrays(x);
+    if (before != x->num_snapshots && x->model && x->model->trained)
+        impmap_train(x);
+}
 
-    // retrieve devices and signals
-    mapper_slot slot = mapper_map_slot(map, MAPPER_LOC_SOURCE, 0);
-    mapper_signal src_sig = mapper_slot_signal(slot);
-    mapper_device src_dev = mapper_signal_device(src_sig);
-    slot = mapper_map_slot(map, MAPPER_LOC_DESTINATION, 0);
-    mapper_signal dst_sig = mapper_slot_signal(slot);
-    mapper_device dst_dev = mapper_signal_device(dst_sig);
-
-    // sanity check: don't allow self-connections
-    if (src_dev == dst_dev) {
-        mapper_map_release(map);
+// *********************************************************
+// -(admit)-------------------------------------------------
+// "admit <resolution> [max]" merges each new snapshot into an earlier one
+// in the same grid cell (see compact) and compacts the snapshots whenever
+// there are more than max; "admit 0" keeps every snapshot again.
+void impmap_admit(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    int max = 0;
+    if (!argc || argv->a_type == A_SYM)
         return;
-    }
+    x->admit = maxpd_atom_get_float(argv);
+    if (x->admit < 0)
+        x->admit = 0;
+    maxpd_atom_get_int_arg(argc - 1, argv + 1, &max);
+    x->admit_max = max > 0 ? max : 0;
+    x->admit_grid.valid = 0;
+}
 
-    char full_name[256];
+// *********************************************************
+// -(merge snapshots on a grid)-----------------------------
+// Snapshots are hashed by grid cell and merged into the oldest snapshot of
+// their cell, so compaction is linear in the number of snapshots.  Returns
+// the number of snapshots removed.
+int impmap_compact_snapshots(impmap *x, float resolution, int max)
+{
+    float low[MAX_LIST], cell[MAX_LIST], inputs[MAX_LIST];
+    int n = x->num_snapshots, size = 1, removed = 0, i, slot;
 
-    if (e == MAPPER_ADDED) {
-        if (src_dev == x->device) {
-            snprintf(full_name, 256, "%s/%s", mapper_device_name(dst_dev),
-                     mapper_signal_name(dst_sig));
-            if (strcmp(mapper_signal_name(src_sig), full_name) == 0) {
-                // <thisDev>:<dstDevName>/<dstSigName> -> <dstDev>:<dstSigName>
-                return;
-            }
-            if (mapper_device_num_signals(x->device, MAPPER_DIR_OUTGOING) >= MAX_LIST) {
+    if (n < 2 || x->size_in < 1)
+        return 0;
+    while (size < 2 * n)
+        size *= 2;
+
+    t_snapshot *snaps = malloc(n * sizeof(t_snapshot));
+    int *coords = malloc((long)n * x->size_in * sizeof(int));
+    int *table = malloc(size * sizeof(int));
+    t_snapshot snap = x->snapshots;
+    for (i = 0; i < n && snap; i++, snap = snap->next)
+        snaps[i] = snap;
+    n = i;
+
+    do {
+        impmap_input_grid(x, resolution, low, cell);
+        for (i = 0; i < size; i++)
+            table[i] = -1;
+        // oldest first, so each cell keeps its oldest snapshot
+        for (i = n - 1; i >= 0; i--) {
+            int *c = coords + (long)i * x->size_in;
+            if (!snaps[i])
+                continue;
+            impmap_snapshot_values(x, snaps[i], inputs, 0);
+            impmap_grid_cell(x, inputs, low, cell, c);
+            slot = impmap_grid_slot(x, table, size, coords, c);
+            if (table[slot] < 0) {
+                table[slot] = i;
+                continue;
+            }
+            impmap_merge_snapshot(x, snaps[table[slot]], snaps[i]);
+            impmap_free_snapshot(snaps[i]);
+            snaps[i] = 0;
+            removed++;
+        }
+        resolution *= 2;
+
+        // relink the survivors in their original order before the next
+        // pass takes the grid from the list
+        x->snapshots = 0;
+        for (i = n - 1; i >= 0; i--) {
+            if (!snaps[i])
+                continue;
+            snaps[i]->next = x->snapshots;
+            x->snapshots = snaps[i];
+        }
+    } while (max && n - removed > max);
+
+    x->num_snapshots -= removed;
+    impmap_renumber_snapshots(x);
+    x->admit_grid.valid = 0;
+    // new snapshots are admitted at the resolution the limit needed
+    if (max && x->admit > 0 && resolution / 2 > x->admit)
+        x->admit = resolution / 2;
+
+    free(snaps);
+    free(coords);
+    free(table);
+    return removed;
+}
+
+// *********************************************************
+// -(grid over the snapshot inputs)-------------------------
+void impmap_input_grid(impmap *x, float resolution, float *low, float *cell)
+{
+    float high[MAX_LIST], inputs[MAX_LIST];
+    t_snapshot snap;
+    int i;
+
+    impmap_snapshot_values(x, x->snapshots, low, 0);
+    memcpy(high, low, x->size_in * sizeof(float));
+    for (snap = x->snapshots->next; snap; snap = snap->next) {
+        impmap_snapshot_values(x, snap, inputs, 0);
+        for (i = 0; i < x->size_in; i++) {
+            if (inputs[i] < low[i])
+                low[i] = inputs[i];
+            else if (inputs[i] > high[i])
+                high[i] = inputs[i];
+        }
+    }
+    for (i = 0; i < x->size_in; i++)
+        cell[i] = resolution * (high[i] - low[i]);
+}
+
+void impmap_grid_cell(impmap *x, const float *inputs, const float *low,
+                      const float *cell, int *coords)
+{
+    int i;
+    for (i = 0; i < x->size_in; i++)
+        coords[i] = cell[i] > 0 ? (int)floorf((inputs[i] - low[i]) / cell[i])
+                                : 0;
+}
+
+// The slot of a hashed grid holding cell c, or the empty slot where it
+// belongs.  Slots hold the index of a row of coords.
+int impmap_grid_slot(impmap *x, const int *table, int size, const int *coords,
+                     const int *c)
+{
+    unsigned int hash = 2166136261u;
+    int i, slot;
+
+    for (i = 0; i < x->size_in; i++)
+        hash = (hash ^ (unsigned int)c[i]) * 16777619u;
+    for (slot = hash & (size - 1); table[slot] >= 0;
+         slot = (slot + 1) & (size - 1)) {
+        if (memcmp(coords + (long)table[slot] * x->size_in, c,
+                   x->size_in * sizeof(int)) == 0)
+            break;
+    }
+    return slot;
+}
+
+// *********************************************************
+// -(admit a new snapshot on the grid)----------------------
+// Returns the earlier snapshot whose cell the newest one falls in, or 0
+// once it has a cell of its own.  The bounds only grow as snapshots
+// arrive, even when a merge pulls an extreme snapshot inwards; the cells
+// are recomputed when a snapshot widens them, when the table is full or
+// after the snapshots were changed some other way, which becomes rare
+// once the snapshots cover the input space.
+t_snapshot impmap_admit_snapshot(impmap *x, t_snapshot snap)
+{
+    t_admit_grid *g = &x->admit_grid;
+    float inputs[MAX_LIST];
+    int i, slot, *c;
+    int rebuild = !g->valid || g->size_in != x->size_in
+                  || g->count == g->capacity;
+
+    impmap_snapshot_values(x, snap, inputs, 0);
+    for (i = 0; i < x->size_in && !rebuild; i++)
+        rebuild = inputs[i] < g->low[i] || inputs[i] > g->high[i];
+    if (rebuild)
+        impmap_admit_rebuild(x, snap, inputs);
+
+    c = g->coords + (long)g->count * x->size_in;
+    impmap_grid_cell(x, inputs, g->low, g->cell, c);
+    slot = impmap_grid_slot(x, g->table, g->size, g->coords, c);
+    if (g->table[slot] >= 0)
+        return g->snaps[g->table[slot]];
+    g->snaps[g->count] = snap;
+    g->table[slot] = g->count++;
+    return 0;
+}
+
+// Gives every snapshot after the newest, whose inputs are given, its cell
+// again, keeping the oldest snapshot of each cell as compact does.
+void impmap_admit_rebuild(impmap *x, t_snapshot snap, const float *inputs)
+{
+    t_admit_grid *g = &x->admit_grid;
+    float values[MAX_LIST];
+    t_snapshot other;
+    int i, slot, n = 0;
+
+    if (!g->valid || g->size_in != x->size_in) {
+        memcpy(g->low, inputs, x->size_in * sizeof(float));
+        memcpy(g->high, inputs, x->size_in * sizeof(float));
+        for (other = snap->next; other; other = other->next) {
+            impmap_snapshot_values(x, other, values, 0);
+            for (i = 0; i < x->size_in; i++) {
+                if (values[i] < g->low[i])
+                    g->low[i] = values[i];
+                else if (values[i] > g->high[i])
+                    g->high[i] = values[i];
+            }
+        }
+    }
+    for (i = 0; i < x->size_in; i++) {
+        if (inputs[i] < g->low[i])
+            g->low[i] = inputs[i];
+        else if (inputs[i] > g->high[i])
+            g->high[i] = inputs[i];
+        g->cell[i] = x->admit * (g->high[i] - g->low[i]);
+    }
+
+    // room for as many snapshots again before the table is rebuilt
+    for (other = snap->next; other; other = other->next)
+        n++;
+    g->capacity = 2 * (n + 1);
+    for (g->size = 1; g->size < 2 * g->capacity; g->size *= 2)
+        ;
+    free(g->table);
+    free(g->snaps);
+    free(g->coords);
+    g->table = malloc(g->size * sizeof(int));
+    g->snaps = malloc(g->capacity * sizeof(t_snapshot));
+    g->coords = malloc((long)g->capacity * x->size_in * sizeof(int));
+    for (i = 0; i < g->size; i++)
+        g->table[i] = -1;
+    for (i = 0, other = snap->next; other; other = other->next)
+        g->snaps[i++] = other;
+
+    // oldest first, so each cell keeps its oldest snapshot
+    for (i = n - 1; i >= 0; i--) {
+        int *c = g->coords + (long)i * x->size_in;
+        impmap_snapshot_values(x, g->snaps[i], values, 0);
+        impmap_grid_cell(x, values, g->low, g->cell, c);
+        slot = impmap_grid_slot(x, g->table, g->size, g->coords, c);
+        if (g->table[slot] < 0)
+            g->table[slot] = i;
+    }
+    g->count = n;
+    g->size_in = x->size_in;
+    g->valid = 1;
+}
+
+void impmap_merge_snapshot(impmap *x, t_snapshot into, t_snapshot from)
+{
+    float total = into->weight + from->weight;
+    float a = into->weight / total, b = from->weight / total;
+    float inputs[MAX_LIST], outputs[MAX_LIST];
+    int i, packed = into->packed != 0;
+
+    impmap_snapshot_values(x, from, inputs, outputs);
+    if (packed)
+        impmap_unpack_snapshot(x, into, x->size_in, x->size_out);
+    for (i = 0; i < x->size_in; i++)
+        into->inputs[i] = a * into->inputs[i] + b * inputs[i];
+    for (i = 0; i < x->size_out; i++)
+        into->outputs[i] = a * into->outputs[i] + b * outputs[i];
+    into->weight = total;
+    if (packed)
+        impmap_pack_snapshot(x, into);
+}
+
+// ids count up from the oldest snapshot
+void impmap_renumber_snapshots(impmap *x)
+{
+    t_snapshot snap;
+    int id = x->num_snapshots;
+    for (snap = x->snapshots; snap; snap = snap->next)
+        snap->id = --id;
+}
+
+// *********************************************************
+// -(output the compression ratio)--------------------------
+// Snapshots taken per snapshot kept.
+void impmap_output_compression(impmap *x)
+{
+    t_snapshot snap;
+    float taken = 0;
+    for (snap = x->snapshots; snap; snap = snap->next)
+        taken += snap->weight;
+    maxpd_atom_set_float(&x->msg_buffer,
+                         x->num_snapshots ? taken / x->num_snapshots : 1);
+    outlet_anything(x->outlet3, gensym("compression"), 1, &x->msg_buffer);
+}
+
+// *********************************************************
+// -(storage)-----------------------------------------------
+// "storage float|half|int16|int8" keeps the snapshots of every scene in
+// that format, "storage" alone reports the current one.  The integer
+// formats spread their levels over the range of each column, which is
+// widened (and the snapshots repacked) when a value falls outside it.
+// Snapshots are unpacked row by row for training, export and the arrays.
+void impmap_storage(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    t_atom atoms[2];
+    t_snapshot snap;
+    long bytes = 0;
+    int k, format = x->storage;
+
+    if (argc && argv->a_type == A_SYM) {
+        format = impmap_pack_find(maxpd_atom_get_string(argv));
+        if (format < 0) {
+            post("implicitmap: unknown storage format '%s'",
+                 maxpd_atom_get_string(argv));
+            return;
+        }
+    }
+    if (x->query_count) {
+        post("implicitmap: cannot change storage while a snapshot is in "
+             "progress");
+        return;
+    }
+    if (format != x->storage) {
+        impmap_unpack_all(x, x->size_in, x->size_out);
+        x->storage = format;
+        impmap_pack_all(x);
+        x->admit_grid.valid = 0;
+    }
+
+    for (k = 0; k < x->num_scenes; k++) {
+        snap = k == x->scene ? x->snapshots : x->scenes[k].snapshots;
+        for (; snap; snap = snap->next)
+            bytes += (long)(x->size_in + x->size_out)
+                     * impmap_pack_bytes(snap->packed ? x->storage
+                                                      : IMPMAP_PACK_FLOAT);
+    }
+    post("implicitmap: snapshots stored as %s in %li bytes",
+         impmap_pack_name(x->storage), bytes);
+    maxpd_atom_set_string(atoms, impmap_pack_name(x->storage));
+    maxpd_atom_set_int(atoms + 1, (int)bytes);
+    outlet_anything(x->outlet3, gensym("storage"), 2, atoms);
+}
+
+// *********************************************************
+// -(read a snapshot's vectors)-----------------------------
+// Either destination may be null.
+void impmap_snapshot_values(impmap *x, t_snapshot snap, float *inputs,
+                            float *outputs)
+{
+    float row[MAX_LIST * 2];
+    if (!snap->packed) {
+        if (inputs)
+            memcpy(inputs, snap->inputs, x->size_in * sizeof(float));
+        if (outputs)
+            memcpy(outputs, snap->outputs, x->size_out * sizeof(float));
+        return;
+    }
+    impmap_unpack(x->storage, snap->packed, row, x->size_in + x->size_out,
+                  x->pack_low, x->pack_step);
+    if (inputs)
+        memcpy(inputs, row, x->size_in * sizeof(float));
+    if (outputs)
+        memcpy(outputs, row + x->size_in, x->size_out * sizeof(float));
+}
+
+// *********************************************************
+// -(pack a snapshot in the storage format)-----------------
+void impmap_pack_snapshot(impmap *x, t_snapshot snap)
+{
+    float row[MAX_LIST * 2];
+    int n = x->size_in + x->size_out;
+
+    if (!snap || snap->packed || x->storage == IMPMAP_PACK_FLOAT || !n)
+        return;
+    memcpy(row, snap->inputs, x->size_in * sizeof(float));
+    memcpy(row + x->size_in, snap->outputs, x->size_out * sizeof(float));
+    if (impmap_pack_levels(x->storage))
+        impmap_set_pack_columns(x, row, row, 1);
+    snap->packed = malloc(n * impmap_pack_bytes(x->storage));
+    impmap_pack(x->storage, row, snap->packed, n, x->pack_low, x->pack_step);
+    free(snap->inputs);
+    free(snap->outputs);
+    snap->inputs = snap->outputs = 0;
+}
+
+// *********************************************************
+// -(unpack a snapshot to floats)---------------------------
+// The sizes are those the snapshot was packed with.
+void impmap_unpack_snapshot(impmap *x, t_snapshot snap, int size_in,
+                            int size_out)
+{
+    float row[MAX_LIST * 2];
+    if (!snap->packed)
+        return;
+    impmap_unpack(x->storage, snap->packed, row, size_in + size_out,
+                  x->pack_low, x->pack_step);
+    snap->inputs = malloc((size_in + 1) * sizeof(float));
+    snap->outputs = malloc((size_out + 1) * sizeof(float));
+    memcpy(snap->inputs, row, size_in * sizeof(float));
+    memcpy(snap->outputs, row + size_in, size_out * sizeof(float));
+    free(snap->packed);
+    snap->packed = 0;
+}
+
+// *********************************************************
+// -(pack every scene)--------------------------------------
+// The snapshots must all hold floats.  Column ranges are set from all of
+// them first, so that nothing has to be repacked.
+void impmap_pack_all(impmap *x)
+{
+    float low[MAX_LIST * 2], high[MAX_LIST * 2];
+    t_snapshot snap;
+    int i, k, n = x->size_in + x->size_out, found = 0;
+
+    x->pack_columns = 0;
+    if (x->storage == IMPMAP_PACK_FLOAT)
+        return;
+    if (impmap_pack_levels(x->storage)) {
+        for (k = 0; k < x->num_scenes; k++) {
+            snap = k == x->scene ? x->snapshots : x->scenes[k].snapshots;
+            for (; snap; snap = snap->next) {
+                for (i = 0; i < n; i++) {
+                    float v = i < x->size_in ? snap->inputs[i]
+                              : snap->outputs[i - x->size_in];
+                    if (!found || v < low[i])
+                        low[i] = v;
+                    if (!found || v > high[i])
+                        high[i] = v;
+                }
+                found = 1;
+            }
+        }
+        if (found)
+            impmap_set_pack_columns(x, low, high, 0);
+    }
+    for (k = 0; k < x->num_scenes; k++) {
+        snap = k == x->scene ? x->snapshots : x->scenes[k].snapshots;
+        for (; snap; snap = snap->next)
+            impmap_pack_snapshot(x, snap);
+    }
+}
+
+// *********************************************************
+// -(unpack every scene)------------------------------------
+void impmap_unpack_all(impmap *x, int size_in, int size_out)
+{
+    t_snapshot snap;
+    int k;
+    for (k = 0; k < x->num_scenes; k++) {
+        snap = k == x->scene ? x->snapshots : x->scenes[k].snapshots;
+        for (; snap; snap = snap->next)
+            impmap_unpack_snapshot(x, snap, size_in, size_out);
+    }
+    x->pack_columns = 0;
+}
+
+// *********************************************************
+// -(make the column ranges cover some values)--------------
+// Ranges that have to grow get an eighth of their span as margin on both
+// sides so that they rarely grow again.  With widen, packed snapshots are
+// repacked on the new ranges if any changed; otherwise the ranges are
+// replaced.
+void impmap_set_pack_columns(impmap *x, const float *low, const float *high,
+                             int widen)
+{
+    float new_low[MAX_LIST * 2], new_step[MAX_LIST * 2];
+    float row[MAX_LIST * 2];
+    t_snapshot snap;
+    int i, k, n = x->size_in + x->size_out, changed = 0;
+    int levels = impmap_pack_levels(x->storage);
+
+    if (!widen || x->pack_columns != n) {
+        widen = 0;
+        changed = 1;
+    }
+    for (i = 0; i < n; i++) {
+        float lo = low[i], hi = high[i], margin;
+        if (widen) {
+            float top = x->pack_low[i] + x->pack_step[i] * levels;
+            if (lo >= x->pack_low[i] && hi <= top) {
+                new_low[i] = x->pack_low[i];
+                new_step[i] = x->pack_step[i];
+                continue;
+            }
+            if (x->pack_low[i] < lo)
+                lo = x->pack_low[i];
+            if (top > hi)
+                hi = top;
+            changed = 1;
+        }
+        margin = hi > lo ? (hi - lo) / 8 : 0;
+        new_low[i] = lo - margin;
+        new_step[i] = (hi - lo + 2 * margin) / levels;
+    }
+    if (!changed)
+        return;
+
+    if (widen) {
+        for (k = 0; k < x->num_scenes; k++) {
+            snap = k == x->scene ? x->snapshots : x->scenes[k].snapshots;
+            for (; snap; snap = snap->next) {
+                if (!snap->packed)
+                    continue;
+                impmap_unpack(x->storage, snap->packed, row, n, x->pack_low,
+                              x->pack_step);
+                impmap_pack(x->storage, row, snap->packed, n, new_low,
+                            new_step);
+            }
+        }
+    }
+    memcpy(x->pack_low, new_low, n * sizeof(float));
+    memcpy(x->pack_step, new_step, n * sizeof(float));
+    x->pack_columns = n;
+}
+
+// *********************************************************
+// -(save)--------------------------------------------------
+// Without a file name the patch is asked to export the snapshots; with
+// one they are written as text: the signal columns ("input <name>
+// <length>", "output <name> <length>") followed by one "snapshot <inputs>
+// <outputs>" line each in the order they were taken.  Merged snapshots are
+// followed by a "weight <count>" line.
+void impmap_save(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    float *inputs, *outputs, *weights = 0;
+    int i, j, num_rows;
+    FILE *file;
+
+    if (!argc || argv->a_type != A_SYM) {
+        outlet_anything(x->outlet2, gensym("export"), 0, 0);
+        return;
+    }
+    if (!(file = fopen(maxpd_atom_get_string(argv), "w"))) {
+        post("implicitmap: could not open '%s' for writing",
+             maxpd_atom_get_string(argv));
+        return;
+    }
+    num_rows = x->num_snapshots ? impmap_snapshot_matrix(x, &inputs, &outputs)
+                                : 0;
+    if (num_rows)
+        weights = impmap_snapshot_weights(x);
+    fprintf(file, "implicitmap snapshots 3\nsize %i %i\n", x->size_in,
+            x->size_out);
+    for (i = 0; i < x->num_inputs; i++)
+        fprintf(file, "input %s %i\n", x->signals_in[i].name->s_name,
+                x->signals_in[i].length);
+    for (i = 0; i < x->num_outputs; i++)
+        fprintf(file, "output %s %i\n", x->signals_out[i].name->s_name,
+                x->signals_out[i].length);
+    // the matrices hold the newest snapshot first
+    for (i = num_rows - 1; i >= 0; i--) {
+        fprintf(file, "snapshot");
+        for (j = 0; j < x->size_in; j++)
+            fprintf(file, " %.9g", inputs[i * x->size_in + j]);
+        for (j = 0; j < x->size_out; j++)
+            fprintf(file, " %.9g", outputs[i * x->size_out + j]);
+        fprintf(file, "\n");
+        if (weights && weights[i] != 1)
+            fprintf(file, "weight %.9g\n", weights[i]);
+    }
+    if (num_rows) {
+        free(inputs);
+        free(outputs);
+        free(weights);
+    }
+    fclose(file);
+    post("implicitmap: exported %i snapshots", num_rows);
+}
+
+// *********************************************************
+// -(load)--------------------------------------------------
+// Snapshots read from a file are added to the current ones.  Columns are
+// matched to the current signals by name, as when the layout changes;
+// files without column names must match the current vector sizes.
+void impmap_load(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    int i, version, size_in, size_out, count = 0, filled = 0;
+    int num_from[2] = {0, 0}, size_from[2] = {0, 0};
+    int map_in[MAX_LIST], map_out[MAX_LIST], mapped = 0;
+    float row_in[MAX_LIST], row_out[MAX_LIST];
+    t_signal_ref from_in[MAX_LIST], from_out[MAX_LIST];
+    char word[256];
+    FILE *file;
+
+    if (!argc || argv->a_type != A_SYM) {
+        outlet_anything(x->outlet2, gensym("import"), 0, 0);
+        return;
+    }
+    if (!(file = fopen(maxpd_atom_get_string(argv), "r"))) {
+        post("implicitmap: could not open '%s'", maxpd_atom_get_string(argv));
+        return;
+    }
+    if (fscanf(file, "implicitmap snapshots %i size %i %i", &version,
+               &size_in, &size_out) != 3 || version < 1 || version > 3
+        || size_in < 0 || size_in > MAX_LIST || size_out < 0
+        || size_out > MAX_LIST) {
+        post("implicitmap: '%s' is not a snapshot file",
+             maxpd_atom_get_string(argv));
+        fclose(file);
+        return;
+    }
+    if (version == 1 && (size_in != x->size_in || size_out != x->size_out)) {
+        post("implicitmap: snapshot file has %i inputs and %i outputs, "
+             "expected %i and %i", size_in, size_out, x->size_in, x->size_out);
+        fclose(file);
+        return;
+    }
+    while (fscanf(file, "%255s", word) == 1) {
+        int output = strcmp(word, "output") == 0;
+        if (output || strcmp(word, "input") == 0) {
+            t_signal_ref *ref = output ? &from_out[num_from[1]]
+                                       : &from_in[num_from[0]];
+            if (num_from[output] >= MAX_LIST
+                || fscanf(file, "%255s %i", word, &ref->length) != 2)
+                break;
+            ref->name = gensym(word);
+            ref->offset = size_from[output];
+            size_from[output] += ref->length;
+            num_from[output]++;
+            continue;
+        }
+        if (strcmp(word, "weight") == 0) {
+            float weight;
+            if (fscanf(file, "%f", &weight) != 1)
+                break;
+            if (count && weight > 0)
+                x->snapshots->weight = weight;
+            continue;
+        }
+        if (strcmp(word, "snapshot") != 0)
+            break;
+        if (!mapped) {
+            if (version == 1) {
+                for (i = 0; i < size_in; i++)
+                    map_in[i] = i;
+                for (i = 0; i < size_out; i++)
+                    map_out[i] = i;
+            }
+            else {
+                filled = impmap_column_map(from_in, num_from[0], size_in,
+                                           x->signals_in, x->num_inputs,
+                                           x->size_in, map_in)
+                         + impmap_column_map(from_out, num_from[1], size_out,
+                                             x->signals_out, x->num_outputs,
+                                             x->size_out, map_out);
+            }
+            mapped = 1;
+        }
+        for (i = 0; i < size_in; i++) {
+            if (fscanf(file, "%f", &row_in[i]) != 1)
+                break;
+        }
+        if (i == size_in) {
+            for (i = 0; i < size_out; i++) {
+                if (fscanf(file, "%f", &row_out[i]) != 1)
+                    break;
+            }
+            i = i == size_out ? -1 : size_in + i;
+        }
+        if (i >= 0) {
+            // a short row would otherwise be padded with the previous one
+            post("implicitmap: snapshot %i in '%s' stops after %i values, "
+                 "import stopped", count + 1, maxpd_atom_get_string(argv), i);
+            break;
+        }
+        t_snapshot snap = impmap_add_snapshot(x);
+        for (i = 0; i < x->size_in; i++)
+            snap->inputs[i] = map_in[i] >= 0 ? row_in[map_in[i]] : x->fill;
+        for (i = 0; i < x->size_out; i++)
+            snap->outputs[i] = map_out[i] >= 0 ? row_out[map_out[i]] : x->fill;
+        impmap_pack_snapshot(x, snap);
+        count++;
+    }
+    fclose(file);
+    x->admit_grid.valid = 0;
+    if (filled)
+        post("implicitmap: imported %i snapshots, filling %i columns missing "
+             "from the file", count, filled);
+    else
+        post("implicitmap: imported %i snapshots", count);
+    maxpd_atom_set_int(&x->msg_buffer, x->num_snapshots);
+    outlet_anything(x->outlet3, gensym("numSnapshots"), 1, &x->msg_buffer);
+    impmap_write_snapshot_arrays(x);
+}
+
+// *********************************************************
+// -(record)------------------------------------------------
+// "record <file>" appends every incoming update to a log, "record" stops
+void impmap_record(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    if (x->record_log) {
+        post("implicitmap: recorded %li updates", x->record_log->count);
+        impmap_log_close(x->record_log);
+        x->record_log = 0;
+    }
+    if (!argc || argv->a_type != A_SYM)
+        return;
+    x->record_log = impmap_open_log(x, maxpd_atom_get_string(argv), 1);
+    if (!x->record_log)
+        post("implicitmap: could not open '%s' for recording - it may hold "
+             "a log of a different signal layout", maxpd_atom_get_string(argv));
+}
+
+// *********************************************************
+// -(capture)-----------------------------------------------
+// "capture <file>" logs every output vector, "capture" stops
+void impmap_capture(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    if (x->capture_log) {
+        post("implicitmap: captured %li output vectors", x->capture_log->count);
+        impmap_log_close(x->capture_log);
+        x->capture_log = 0;
+    }
+    if (!argc || argv->a_type != A_SYM)
+        return;
+    x->capture_log = impmap_open_log(x, maxpd_atom_get_string(argv), 1);
+    if (!x->capture_log)
+        post("implicitmap: could not open '%s' for capture - it may hold "
+             "a log of a different signal layout", maxpd_atom_get_string(argv));
+}
+
+// *********************************************************
+// -(replay)------------------------------------------------
+// "replay <file> [speed]" feeds a recorded log back through the input path
+// at the given multiple of real time; a speed of 0 replays as fast as
+// possible.  "replay" stops.  Live input is ignored while replaying.
+void impmap_replay(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    if (x->replay_log)
+        impmap_stop_replay(x);
+    if (!argc || argv->a_type != A_SYM)
+        return;
+
+    x->replay_log = impmap_open_log(x, maxpd_atom_get_string(argv), 0);
+    if (!x->replay_log) {
+        post("implicitmap: could not open '%s' for replay",
+             maxpd_atom_get_string(argv));
+        return;
+    }
+    if (!impmap_log_signal_map(x, x->replay_log, x->replay_map)) {
+        post("implicitmap: '%s' has no inputs in common with the current "
+             "layout", maxpd_atom_get_string(argv));
+        impmap_log_close(x->replay_log);
+        x->replay_log = 0;
+        return;
+    }
+    x->replay_speed = 1;
+    if (argc > 1) {
+        if ((argv+1)->a_type == A_FLOAT)
+            x->replay_speed = atom_getfloat(argv+1);
+#ifdef MAXMSP
+        else if ((argv+1)->a_type == A_LONG)
+            x->replay_speed = atom_getlong(argv+1);
+#endif
+    }
+    if (x->replay_speed < 0)
+        x->replay_speed = 0;
+    x->replay_pending = 0;
+    x->replay_first = -1;
+    x->replay_tt.sec = x->replay_tt.frac = 0;
+    clock_delay(x->replay_clock, 0);
+}
+
+// *********************************************************
+// -(replay tick)-------------------------------------------
+// Records sharing a timetag were sent in the same bundle, so they are
+// applied together and output as a single input frame.
+void impmap_replay_tick(impmap *x)
+{
+    int count = 0;
+    double now = maxpd_get_time();
+
+    while (x->replay_log) {
+        if (!x->replay_pending) {
+            if (impmap_log_read(x->replay_log, &x->replay_rec,
+                                x->replay_values, MAX_LIST)) {
+                impmap_stop_replay(x);
+                return;
+            }
+            if (x->replay_rec.direction != IMPMAP_LOG_INPUT)
+                continue;
+            x->replay_pending = 1;
+            if (x->replay_first < 0) {
+                x->replay_first = impmap_log_record_time(&x->replay_rec);
+                x->replay_start = now;
+            }
+        }
+        t_impmap_log_record *rec = &x->replay_rec;
+
+        if (x->replay_speed > 0) {
+            double due = x->replay_start + (impmap_log_record_time(rec)
+                                            - x->replay_first) * 1000.
+                                           / x->replay_speed;
+            if (due > now) {
+                impmap_process_input(x);
+                clock_delay(x->replay_clock, due - now);
+                return;
+            }
+        }
+        else if (count >= REPLAY_CHUNK) {
+            // yield to the scheduler between chunks
+            impmap_process_input(x);
+            clock_delay(x->replay_clock, 0);
+            return;
+        }
+
+        x->replay_tt.sec = rec->sec;
+        x->replay_tt.frac = rec->frac;
+        x->replay_pending = 0;
+        // updates of signals that have since been removed are skipped
+        int index = rec->index < x->replay_log->num_signals[IMPMAP_LOG_INPUT]
+                    && rec->index < MAX_LIST ? x->replay_map[rec->index] : -1;
+        if (index < 0)
+            continue;
+        t_signal_ref *ref = &x->signals_in[index];
+        impmap_receive_input(x, index, ref->offset,
+                             rec->length < ref->length ? rec->length
+                                                       : ref->length,
+                             x->replay_values, &x->replay_tt);
+        count++;
+    }
+}
+
+// *********************************************************
+// -(stop replay)-------------------------------------------
+void impmap_stop_replay(impmap *x)
+{
+    impmap_frame_complete(x);
+    impmap_process_input(x);
+    clock_unset(x->replay_clock);
+    maxpd_atom_set_int(&x->msg_buffer, (int)x->replay_log->count);
+    outlet_anything(x->outlet3, gensym("replayed"), 1, &x->msg_buffer);
+    impmap_log_close(x->replay_log);
+    x->replay_log = 0;
+}
+
+// *********************************************************
+// -(follow)------------------------------------------------
+// Follows the input stream through recorded gesture templates:
+//   "follow 1|0"              starts or stops following
+//   "follow load <log>"       adds the input frames of a recorded log
+//   "follow record"           starts recording a template from the input
+//   "follow stop"             adds the template recorded since then
+//   "follow clear"            removes all templates
+//   "follow sigma|forget|beam <value>" sets the alignment parameters
+// While following, every input frame outputs "likelihood" and "progress"
+// lists with one element per template on outlet3.
+void impmap_follow(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    t_impmap_follower *f = x->follower;
+    const char *cmd;
+    float value;
+    int index = -1;
+
+    if (!argc)
+        return;
+    if (argv->a_type != A_SYM) {
+        x->following = maxpd_atom_get_float(argv) != 0;
+        impmap_follow_reset(f);
+        return;
+    }
+    cmd = maxpd_atom_get_string(argv);
+    if (strcmp(cmd, "load") == 0) {
+        float *inputs;
+        mapper_timetag_t *tts;
+        int num_rows;
+        if (argc < 2 || (argv+1)->a_type != A_SYM) {
+            post("implicitmap: usage: follow load <log>");
+            return;
+        }
+        num_rows = impmap_read_log_matrix(x, maxpd_atom_get_string(argv+1),
+                                          &inputs, &tts);
+        if (num_rows > 0)
+            index = impmap_follow_add(f, inputs, num_rows, x->size_in);
+        if (num_rows >= 0) {
+            free(inputs);
+            free(tts);
+        }
+    }
+    else if (strcmp(cmd, "record") == 0) {
+        x->follow_rows = 0;
+        x->follow_recording = 1;
+        return;
+    }
+    else if (strcmp(cmd, "stop") == 0) {
+        if (!x->follow_recording)
+            return;
+        x->follow_recording = 0;
+        index = impmap_follow_add(f, x->follow_frames, x->follow_rows,
+                                  x->size_in);
+    }
+    else if (strcmp(cmd, "clear") == 0)
+        impmap_follow_clear(f);
+    else if (argc > 1 && (argv+1)->a_type != A_SYM) {
+        value = maxpd_atom_get_float(argv+1);
+        if (strcmp(cmd, "sigma") == 0 && value > 0)
+            f->sigma = value;
+        else if (strcmp(cmd, "forget") == 0 && value >= 0 && value < 1)
+            f->forget = value;
+        else if (strcmp(cmd, "beam") == 0 && value > 0 && value < 1)
+            f->beam = value;
+        else
+            post("implicitmap: bad follow parameter '%s'", cmd);
+        impmap_follow_reset(f);
+        return;
+    }
+    else {
+        post("implicitmap: unknown follow command '%s'", cmd);
+        return;
+    }
+
+    if (strcmp(cmd, "clear") != 0) {
+        if (index < 0) {
+            post("implicitmap: could not add a gesture template");
+            return;
+        }
+        post("implicitmap: template %i holds %i frames", index,
+             f->templates[index].num_frames);
+    }
+    maxpd_atom_set_int(&x->msg_buffer, f->num_templates);
+    outlet_anything(x->outlet3, gensym("templates"), 1, &x->msg_buffer);
+}
+
+// *********************************************************
+// -(follow one input frame)--------------------------------
+void impmap_follow_input(impmap *x)
+{
+    float likelihood[IMPMAP_FOLLOW_MAX_TEMPLATES];
+    float progress[IMPMAP_FOLLOW_MAX_TEMPLATES];
+    t_atom atoms[IMPMAP_FOLLOW_MAX_TEMPLATES];
+    int i, n;
+
+    if (x->follow_recording) {
+        if (x->follow_rows == x->follow_capacity) {
+            x->follow_capacity = x->follow_capacity
+                                 ? x->follow_capacity * 2 : 1024;
+            x->follow_frames = realloc(x->follow_frames,
+                                       (long)x->follow_capacity * MAX_LIST
+                                       * sizeof(float));
+        }
+        memcpy(x->follow_frames + (long)x->follow_rows++ * x->size_in,
+               x->values_in, x->size_in * sizeof(float));
+    }
+    if (!x->following || !x->follower->num_templates)
+        return;
+
+    n = impmap_follow_step(x->follower, x->values_in, x->size_in,
+                           likelihood, progress);
+    for (i = 0; i < n; i++)
+        maxpd_atom_set_float(atoms + i, likelihood[i]);
+    outlet_anything(x->outlet3, gensym("likelihood"), n, atoms);
+    for (i = 0; i < n; i++)
+        maxpd_atom_set_float(atoms + i, progress[i]);
+    outlet_anything(x->outlet3, gensym("progress"), n, atoms);
+}
+
+// *********************************************************
+// -(randomize)---------------------------------------------
+void impmap_randomize(impmap *x)
+{
+    int i;
+    float rand_val;
+
+    if (x->ready) {
+        mapper_timetag_now(&x->tt);
+        mapper_device_start_queue(x->device, x->tt);
+        mapper_signal *psig = mapper_device_signals(x->device, MAPPER_DIR_OUTGOING);
+        while (psig) {
+            if (*psig == x->dummy_output) {
+                psig = mapper_signal_query_next(psig);
+                continue;
+            }
+            t_signal_ref *ref = mapper_signal_user_data(*psig);
+            if (mapper_signal_type(*psig) != 'f')
+                continue;
+            int length = mapper_signal_length(*psig);
+            float v[length];
+            float *min = (float*)mapper_signal_minimum(*psig);
+            float *max = (float*)mapper_signal_maximum(*psig);
+            for (i = 0; i < length; i++) {
+                rand_val = (float)rand() / (float)RAND_MAX;
+                if (min && max) {
+                    v[i] = rand_val * (max[i] - min[i]) + min[i];
+                }
+                else {
+                    // if ranges have not been declared, assume normalized between 0 and 1
+                    v[i] = rand_val;
+                }
+                maxpd_atom_set_float(x->buffer_out + ref->offset + i, v[i]);
+            }
+            mapper_signal_update(*psig, v, 1, x->tt);
+            psig = mapper_signal_query_next(psig);
+        }
+        mapper_device_send_queue(x->device, x->tt);
+        outlet_anything(x->outlet2, gensym("out"), x->size_out, x->buffer_out);
+    }
+}
+
+// *********************************************************
+// -(anything)----------------------------------------------
+void impmap_list(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    if (x->mute)
+        return;
+
+    if (argc != x->size_out) {
+        post("vector size mismatch");
+        return;
+    }
+
+    int i;
+    for (i = 0; i < argc; i++)
+        x->values_out[i] = atom_getfloat(argv + i);
+    x->out_valid = 1;
+    impmap_update_outputs(x, x->values_out);
+    impmap_output_outputs(x);
+}
+
+// *********************************************************
+// -(evaluate the native model)-----------------------------
+void impmap_evaluate(impmap *x)
+{
+    float out[MAX_LIST];
+    if (x->mute)
+        return;
+    if (x->morphing)
+        impmap_morph_evaluate(x, out);
+    else
+        impmap_model_update(x->model, x->values_in, out, x->changed_in,
+                            x->num_changed);
+    impmap_clear_changed(x);
+
+    // don't send anything if the result hasn't changed
+    if (x->out_valid && memcmp(out, x->values_out,
+                               x->size_out * sizeof(float)) == 0) {
+        x->sends_skipped++;
+        return;
+    }
+    memcpy(x->values_out, out, x->size_out * sizeof(float));
+    x->out_valid = 1;
+    impmap_update_outputs(x, x->values_out);
+    if (x->monitor)
+        impmap_output_outputs(x);
+    if (x->variance)
+        impmap_output_variance(x);
+}
+
+// *********************************************************
+// -(output the model's variance on outlet4)----------------
+// Only the current scene's model estimates its variance, so nothing is
+// output while morphing.
+void impmap_output_variance(impmap *x)
+{
+    float variance[MAX_LIST];
+    t_atom atoms[MAX_LIST];
+    if (x->morphing || impmap_model_variance(x->model, x->values_in, variance))
+        return;
+    maxpd_atom_set_float_array(atoms, variance, x->size_out);
+    outlet_anything(x->outlet4, gensym("variance"), x->size_out, atoms);
+}
+
+// *********************************************************
+// -(output the output vector on outlet2)-------------------
+void impmap_output_outputs(impmap *x)
+{
+    if (x->arrays[ARRAY_OUT]
+        && !impmap_write_array(x, ARRAY_OUT, x->values_out, x->size_out)) {
+        maxpd_atom_set_string(&x->msg_buffer, "out");
+        outlet_anything(x->outlet2, gensym("updated"), 1, &x->msg_buffer);
+        return;
+    }
+    maxpd_atom_set_float_array(x->buffer_out, x->values_out, x->size_out);
+    outlet_anything(x->outlet2, gensym("out"), x->size_out, x->buffer_out);
+}
+
+// *********************************************************
+// -(sweep)-------------------------------------------------
+// "sweep <dim> <min> <max> <steps> [<dim> <min> <max> <steps>] [out <k>]"
+// evaluates the model over a 1-D or 2-D grid with the other inputs held at
+// their current values.  The first dimension varies fastest.  Results are
+// written to the "sweep" array if one is bound, otherwise they are output as
+// "sweep <steps> <steps> <values...>" with every output (or only output k)
+// for each grid point.  While morphing the grid is evaluated through the
+// blend that is being sent.
+void impmap_sweep(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    int dims[2], steps[2] = {1, 1}, num_dims = 0, select = -1;
+    float lo[2] = {0, 0}, hi[2] = {0, 0};
+    int i, j, k, num_points, size_result;
+    float *inputs, *outputs;
+
+    if (x->morphing ? !impmap_morph_ready(x)
+        : !impmap_model_ready(x->model, x->size_in, x->size_out)) {
+        post("implicitmap: sweep needs a trained native engine");
+        return;
+    }
+    while (argc >= 4 && num_dims < 2 && argv->a_type != A_SYM) {
+        if (maxpd_atom_get_int_arg(1, argv, &dims[num_dims])
+            || maxpd_atom_get_int_arg(1, argv+3, &steps[num_dims])
+            || dims[num_dims] < 0 || dims[num_dims] >= x->size_in
+            || steps[num_dims] < 1) {
+            post("implicitmap: bad sweep dimension");
+            return;
+        }
+        lo[num_dims] = maxpd_atom_get_float(argv+1);
+        hi[num_dims] = maxpd_atom_get_float(argv+2);
+        num_dims++;
+        argc -= 4;
+        argv += 4;
+    }
+    if (argc == 2 && argv->a_type == A_SYM
+        && strcmp(maxpd_atom_get_string(argv), "out") == 0) {
+        if (maxpd_atom_get_int_arg(1, argv+1, &select)
+            || select < 0 || select >= x->size_out) {
+            post("implicitmap: bad sweep output");
+            return;
+        }
+        argc = 0;
+    }
+    if (!num_dims || argc) {
+        post("implicitmap: usage: sweep <dim> <min> <max> <steps> "
+             "[<dim> <min> <max> <steps>] [out <k>]");
+        return;
+    }
+    num_points = steps[0] * steps[1];
+    if (num_points > MAX_SWEEP) {
+        post("implicitmap: sweep is limited to %i points", MAX_SWEEP);
+        return;
+    }
+
+    // build the grid and evaluate it in one call
+    inputs = malloc(num_points * x->size_in * sizeof(float));
+    outputs = malloc(num_points * x->size_out * sizeof(float));
+    for (j = 0; j < steps[1]; j++) {
+        for (i = 0; i < steps[0]; i++) {
+            float *row = inputs + (j * steps[0] + i) * x->size_in;
+            memcpy(row, x->values_in, x->size_in * sizeof(float));
+            for (k = 0; k < num_dims; k++) {
+                int step = k ? j : i;
+                row[dims[k]] = steps[k] > 1
+                    ? lo[k] + (hi[k] - lo[k]) * step / (steps[k] - 1) : lo[k];
+            }
+        }
+    }
+    if (x->morphing)
+        impmap_morph_batch(x, inputs, outputs, num_points);
+    else
+        impmap_model_evaluate_batch(x->model, inputs, outputs, num_points);
+    free(inputs);
+
+    if (select >= 0) {
+        for (i = 0; i < num_points; i++)
+            outputs[i] = outputs[i * x->size_out + select];
+        size_result = num_points;
+    }
+    else
+        size_result = num_points * x->size_out;
+
+    if (x->arrays[ARRAY_SWEEP]
+        && !impmap_write_array(x, ARRAY_SWEEP, outputs, size_result)) {
+        maxpd_atom_set_string(&x->msg_buffer, "sweep");
+        outlet_anything(x->outlet2, gensym("updated"), 1, &x->msg_buffer);
+    }
+    else {
+        t_atom *atoms = malloc((size_result + 2) * sizeof(t_atom));
+        maxpd_atom_set_int(atoms, steps[0]);
+        maxpd_atom_set_int(atoms+1, steps[1]);
+        maxpd_atom_set_float_array(atoms+2, outputs, size_result);
+        outlet_anything(x->outlet2, gensym("sweep"), size_result + 2, atoms);
+        free(atoms);
+    }
+    free(outputs);
+}
+
+// *********************************************************
+// -(update output signals)---------------------------------
+void impmap_update_outputs(impmap *x, const float *values)
+{
+    impmap_send_outputs(x, values, 0);
+}
+
+// *********************************************************
+// -(send output signals)-----------------------------------
+// In delta mode only signals that moved beyond their deadband are queued,
+// unless this is a forced refresh.  Refreshes repeat the last output
+// vector, so they are not captured.  Signals that do not fit in the
+// output vector are never sent.
+void impmap_send_outputs(impmap *x, const float *values, int force)
+{
+    int i;
+    mapper_signal *psig = mapper_device_signals(x->device, MAPPER_DIR_OUTGOING);
+    while (psig) {
+        if (*psig == x->dummy_output) {
+            psig = mapper_signal_query_next(psig);
+            continue;
+        }
+        t_signal_ref *ref = mapper_signal_user_data(*psig);
+        const float *v = values + ref->offset;
+        float *last = x->sent_out + ref->offset;
+        int len = ref->length;
+        if (ref->offloaded || ref->offset + len > MAX_LIST) {
+            psig = mapper_signal_query_next(psig);
+            continue;
+        }
+
+        if (x->delta && !force && ref->sent) {
+            for (i = 0; i < len; i++) {
+                if (fabsf(v[i] - last[i]) > ref->deadband_abs
+                                            + ref->deadband_rel * fabsf(last[i]))
+                    break;
+            }
+            if (i == len) {
+                x->updates_suppressed++;
+                psig = mapper_signal_query_next(psig);
+                continue;
+            }
+        }
+
+        if (!x->queue_open) {
+            mapper_timetag_now(&x->tt);
+            mapper_device_start_queue(x->device, x->tt);
+            x->queue_open = 1;
+        }
+        // we can pass the vector directly since all our signals are type 'f'
+        mapper_signal_update(*psig, v, 1, x->tt);
+        memcpy(last, v, len * sizeof(float));
+        ref->sent = 1;
+        x->updates_sent++;
+        psig = mapper_signal_query_next(psig);
+    }
+
+    if (x->capture_log && !force) {
+        // tag captured outputs with the replayed input time so the two logs
+        // can be aligned
+        t_impmap_log_record rec;
+        mapper_timetag_t *tt = x->replay_log ? &x->replay_tt : &x->tt;
+        rec.sec = tt->sec;
+        rec.frac = tt->frac;
+        rec.index = IMPMAP_LOG_ALL_SIGNALS;
+        rec.offset = 0;
+        rec.length = x->size_out;
+        rec.direction = IMPMAP_LOG_OUTPUT;
+        impmap_log_write(x->capture_log, &rec, values);
+    }
+
+    if (x->queue_open) {
+        mapper_device_send_queue(x->device, x->tt);
+        x->queue_open = 0;
+    }
+}
+
+// *********************************************************
+// -(input handler)-----------------------------------------
+void impmap_on_input(mapper_signal sig, mapper_id instance, const void *value,
+                     int count, mapper_timetag_t *time)
+{
+    t_signal_ref *ref = mapper_signal_user_data(sig);
+    if (!ref) {
+        post("implicitmap: no user data for signal '%s' in on_input()",
+             mapper_signal_name(sig));
+        return;
+    }
+    impmap *x = ref->x;
+    int len = mapper_signal_length(sig);
+
+    if (x->record_log && value) {
+        t_impmap_log_record rec;
+        mapper_timetag_t now;
+        if (!time) {
+            mapper_timetag_now(&now);
+            time = &now;
+        }
+        rec.sec = time->sec;
+        rec.frac = time->frac;
+        rec.index = ref - x->signals_in;
+        rec.offset = ref->offset;
+        rec.length = len;
+        rec.direction = IMPMAP_LOG_INPUT;
+        impmap_log_write(x->record_log, &rec, value);
+    }
+
+    // recorded input takes the place of live input during replay
+    if (x->replay_log)
+        return;
+
+    impmap_receive_input(x, ref - x->signals_in, ref->offset, len, value, time);
+}
+
+// *********************************************************
+// -(route an input update through frame assembly)----------
+// Live and replayed updates both arrive here.  Without a frame policy each
+// bundle is treated as a frame when replaying.
+void impmap_receive_input(impmap *x, int index, int offset, int length,
+                          const float *values, mapper_timetag_t *tt)
+{
+    int i;
+    x->frame_updates++;
+
+    if (x->frame_policy == FRAME_OFF || index < 0 || index >= x->num_inputs) {
+        if (x->replay_log && tt) {
+            // a new timetag means the previous frame is complete
+            if (x->new_in && (tt->sec != x->frame_tt.sec
+                              || tt->frac != x->frame_tt.frac)) {
+                x->frames++;
+                impmap_process_input(x);
+            }
+            x->frame_tt = *tt;
+        }
+        impmap_set_input(x, index, offset, length, values);
+        return;
+    }
+
+    // a repeated signal or a distant timetag starts the next frame
+    if (x->frame_count) {
+        if (x->frame_arrived[index])
+            impmap_frame_complete(x);
+        else if (tt && fabs(mapper_timetag_difference(*tt, x->frame_tt))
+                 * 1000. > x->frame_window)
+            impmap_frame_complete(x);
+    }
+    if (!x->frame_count) {
+        if (tt)
+            x->frame_tt = *tt;
+        else
+            mapper_timetag_now(&x->frame_tt);
+        x->frame_start = maxpd_get_time();
+    }
+
+    // stage the update; the signal's offset may have moved since recording
+    offset = x->signals_in[index].offset;
+    if (length > x->signals_in[index].length)
+        length = x->signals_in[index].length;
+    for (i = 0; i < length && offset + i < MAX_LIST; i++)
+        x->frame_values[offset + i] = values ? values[i] : 0;
+    if (!x->frame_arrived[index]) {
+        x->frame_arrived[index] = 1;
+        x->frame_signals[x->frame_count++] = index;
+    }
+
+    switch (x->frame_policy) {
+        case FRAME_QUORUM: {
+            int needed = x->frame_quorum < 1
+                         ? (int)ceil(x->frame_quorum * x->num_inputs)
+                         : (int)x->frame_quorum;
+            if (x->frame_count >= needed || x->frame_count >= x->num_inputs)
+                impmap_frame_complete(x);
+            break;
+        }
+        case FRAME_DEADLINE:
+            if (x->frame_count >= x->num_inputs
+                || maxpd_get_time() - x->frame_start >= x->frame_deadline)
+                impmap_frame_complete(x);
+            break;
+        default:
+            if (x->frame_count >= x->num_inputs)
+                impmap_frame_complete(x);
+            break;
+    }
+}
+
+// *********************************************************
+// -(write into the input vector)---------------------------
+// Atoms for outlet1 are only built when the vector is output.
+void impmap_set_input(impmap *x, int index, int offset, int length,
+                      const float *values)
+{
+    int i, changed = 0;
+    for (i = 0; i < length; i++) {
+        if (offset + i >= MAX_LIST) {
+            post("implicitmap: Maximum vector length exceeded!");
+            break;
+        }
+        float v = values ? values[i] : 0;
+        if (v != x->values_in[offset + i]) {
+            changed = 1;
+            if (!x->changed_flag[offset + i] && x->num_changed >= 0) {
+                x->changed_flag[offset + i] = 1;
+                x->changed_in[x->num_changed++] = offset + i;
+            }
+        }
+        x->values_in[offset + i] = v;
+    }
+    if (changed && x->num_dirty >= 0) {
+        if (index < 0 || index >= x->num_inputs)
+            x->num_dirty = -1;
+        else if (!x->dirty_flag[index]) {
+            x->dirty_flag[index] = 1;
+            x->dirty_in[x->num_dirty++] = index;
+        }
+    }
+    x->new_in = 1;
+}
+
+// *********************************************************
+// -(input format on outlet1)-------------------------------
+void impmap_input_format(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    const char *format = "list";
+    if (argc && argv->a_type == A_SYM)
+        format = maxpd_atom_get_string(argv);
+    if (strcmp(format, "list") == 0)
+        x->input_format = INPUT_LIST;
+    else if (strcmp(format, "range") == 0)
+        x->input_format = INPUT_RANGE;
+    else if (strcmp(format, "named") == 0)
+        x->input_format = INPUT_NAMED;
+    else
+        post("implicitmap: unknown input format '%s'", format);
+}
+
+// *********************************************************
+// -(compare ints for qsort)--------------------------------
+static int compare_ints(const void *l, const void *r)
+{
+    return *(const int*)l - *(const int*)r;
+}
+
+// *********************************************************
+// -(output the input vector on outlet1)--------------------
+// In range format adjacent changed signals are merged into one segment.
+void impmap_output_input(impmap *x)
+{
+    int i, j;
+
+    if (x->arrays[ARRAY_IN]
+        && !impmap_write_array(x, ARRAY_IN, x->values_in, x->size_in)) {
+        outlet_anything(x->outlet1, gensym("updated"), 0, 0);
+        impmap_clear_dirty(x);
+        return;
+    }
+    if (x->input_format == INPUT_LIST || x->num_dirty < 0) {
+        if (x->input_format == INPUT_LIST || x->num_inputs == 0) {
+            maxpd_atom_set_float_array(x->buffer_in, x->values_in, x->size_in);
+            outlet_anything(x->outlet1, gensym("list"), x->size_in,
+                            x->buffer_in);
+            impmap_clear_dirty(x);
+            return;
+        }
+        // layout changed or unknown signal: everything is dirty
+        for (i = 0; i < x->num_inputs; i++)
+            x->dirty_in[i] = i;
+        x->num_dirty = x->num_inputs;
+    }
+    else
+        qsort(x->dirty_in, x->num_dirty, sizeof(int), compare_ints);
+
+    for (i = 0; i < x->num_dirty; i = j) {
+        t_signal_ref *ref = &x->signals_in[x->dirty_in[i]];
+        int offset = ref->offset, length = ref->length;
+        j = i + 1;
+        if (x->input_format == INPUT_RANGE) {
+            while (j < x->num_dirty && x->dirty_in[j] == x->dirty_in[j-1] + 1) {
+                length += x->signals_in[x->dirty_in[j]].length;
+                j++;
+            }
+        }
+        if (offset + length > x->size_in)
+            length = x->size_in - offset;
+        if (length <= 0)
+            continue;
+        if (x->input_format == INPUT_RANGE) {
+            if (length >= MAX_LIST)
+                length = MAX_LIST - 1;
+            maxpd_atom_set_int(x->buffer_in, offset);
+            maxpd_atom_set_float_array(x->buffer_in + 1, x->values_in + offset,
+                                       length);
+            outlet_anything(x->outlet1, gensym("list"), length + 1,
+                            x->buffer_in);
+        }
+        else {
+            maxpd_atom_set_float_array(x->buffer_in, x->values_in + offset,
+                                       length);
+            outlet_anything(x->outlet1, ref->name, length, x->buffer_in);
+        }
+    }
+    impmap_clear_dirty(x);
+}
+
+// *********************************************************
+// -(bind a vector to an array)-----------------------------
+// "array <in|out|snapin|snapout> <name>" writes the vector into the named
+// Pd array or Max buffer~ instead of sending it as a list, and outputs an
+// "updated" message each time it is rewritten.  Omitting the name unbinds.
+// Snapshots are still announced as lists since external engines need them.
+void impmap_array(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    static const char *targets[NUM_ARRAYS] = {"in", "out", "snapin", "snapout",
+                                               "sweep"};
+    int which;
+
+    if (!argc || argv->a_type != A_SYM) {
+        post("implicitmap: usage: array <in|out|snapin|snapout|sweep> [name]");
+        return;
+    }
+    for (which = 0; which < NUM_ARRAYS; which++) {
+        if (strcmp(maxpd_atom_get_string(argv), targets[which]) == 0)
+            break;
+    }
+    if (which == NUM_ARRAYS) {
+        post("implicitmap: unknown array target '%s'",
+             maxpd_atom_get_string(argv));
+        return;
+    }
+    x->arrays[which] = (argc > 1 && (argv+1)->a_type == A_SYM)
+                       ? gensym((char *)maxpd_atom_get_string(argv+1)) : 0;
+#ifdef MAXMSP
+    if (x->arrays[which]) {
+        if (x->array_refs[which])
+            buffer_ref_set(x->array_refs[which], x->arrays[which]);
+        else
+            x->array_refs[which] = buffer_ref_new((t_object *)x,
+                                                  x->arrays[which]);
+    }
+#endif
+
+    // fill the array straight away
+    if (which == ARRAY_IN)
+        impmap_write_array(x, which, x->values_in, x->size_in);
+    else if (which == ARRAY_OUT)
+        impmap_write_array(x, which, x->values_out, x->size_out);
+    else if (which != ARRAY_SWEEP)
+        impmap_write_snapshot_arrays(x);
+}
+
+// *********************************************************
+// -(write a vector into a bound array)---------------------
+// Pd arrays are resized to fit; Max buffers are written up to their
+// length, in the first channel.  Returns non-zero if nothing was written.
+int impmap_write_array(impmap *x, int which, const float *values, int length)
+{
+    void *ref = 0;
+    if (!x->arrays[which])
+        return 1;
+#ifdef MAXMSP
+    ref = x->array_refs[which];
+#endif
+    if (maxpd_array_write(x, x->arrays[which], ref, values, length)) {
+#ifndef MAXMSP
+        // a buffer~ may simply not exist yet, but a Pd array is gone
+        x->arrays[which] = 0;
+#endif
+        return 1;
+    }
+    return 0;
+}
+
+// *********************************************************
+// -(write snapshots into bound arrays)---------------------
+void impmap_write_snapshot_arrays(impmap *x)
+{
+    t_snapshot snap;
+    float *inputs, *outputs;
+    int written = 0;
+
+    if (!x->arrays[ARRAY_SNAP_IN] && !x->arrays[ARRAY_SNAP_OUT])
+        return;
+
+    // rows in the order the snapshots were taken
+    inputs = calloc(x->num_snapshots * x->size_in + 1, sizeof(float));
+    outputs = calloc(x->num_snapshots * x->size_out + 1, sizeof(float));
+    for (snap = x->snapshots; snap; snap = snap->next) {
+        if (snap->id < 0 || snap->id >= x->num_snapshots)
+            continue;
+        impmap_snapshot_values(x, snap, inputs + snap->id * x->size_in,
+                               outputs + snap->id * x->size_out);
+    }
+    if (!impmap_write_array(x, ARRAY_SNAP_IN, inputs,
+                            x->num_snapshots * x->size_in))
+        written = 1;
+    if (!impmap_write_array(x, ARRAY_SNAP_OUT, outputs,
+                            x->num_snapshots * x->size_out))
+        written = 1;
+    free(inputs);
+    free(outputs);
+
+    if (written) {
+        maxpd_atom_set_string(&x->msg_buffer, "snapshots");
+        outlet_anything(x->outlet2, gensym("updated"), 1, &x->msg_buffer);
+    }
+}
+
+// *********************************************************
+// -(render)------------------------------------------------
+// "render log <in> <out> [threads]" evaluates the model for every input
+// frame of a recorded log and writes the results as an output log with the
+// same timetags; "render array <in> <out> [threads]" reads rows of size_in
+// from one array and writes rows of size_out to another.  Rows are split
+// across worker threads, one per core by default.
+void impmap_render(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    const char *mode, *source, *dest;
+    float *inputs = 0, *outputs;
+    mapper_timetag_t *tts = 0;
+    int num_rows, num_threads, used;
+    double start;
+
+    if (!impmap_model_ready(x->model, x->size_in, x->size_out)) {
+        post("implicitmap: render needs a trained native engine");
+        return;
+    }
+    if (argc < 3 || argv->a_type != A_SYM || (argv+1)->a_type != A_SYM
+        || (argv+2)->a_type != A_SYM) {
+        post("implicitmap: usage: render <log|array> <in> <out> [threads]");
+        return;
+    }
+    mode = maxpd_atom_get_string(argv);
+    source = maxpd_atom_get_string(argv+1);
+    dest = maxpd_atom_get_string(argv+2);
+    if (maxpd_atom_get_int_arg(argc - 3, argv + 3, &num_threads)
+        || num_threads < 1)
+        num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (strcmp(mode, "log") == 0)
+        num_rows = impmap_read_log_matrix(x, source, &inputs, &tts);
+    else if (strcmp(mode, "array") == 0) {
+        num_rows = maxpd_array_read(x, gensym((char *)source), &inputs);
+        if (num_rows >= 0 && x->size_in)
+            num_rows /= x->size_in;
+    }
+    else {
+        post("implicitmap: unknown render source '%s'", mode);
+        return;
+    }
+    if (num_rows <= 0) {
+        post("implicitmap: nothing to render from '%s'", source);
+        free(inputs);
+        free(tts);
+        return;
+    }
+
+    start = maxpd_get_real_time();
+    outputs = malloc((long)num_rows * x->size_out * sizeof(float));
+    used = impmap_model_render(x->model, inputs, outputs, num_rows,
+                               num_threads);
+    post("implicitmap: rendered %i rows on %i threads in %g ms", num_rows,
+         used, maxpd_get_real_time() - start);
+
+    if (tts) {
+        t_impmap_log *log = impmap_open_log(x, dest, 1);
+        t_impmap_log_record rec;
+        int i;
+        if (!log)
+            post("implicitmap: could not open '%s' for writing", dest);
+        for (i = 0; log && i < num_rows; i++) {
+            rec.sec = tts[i].sec;
+            rec.frac = tts[i].frac;
+            rec.index = IMPMAP_LOG_ALL_SIGNALS;
+            rec.offset = 0;
+            rec.length = x->size_out;
+            rec.direction = IMPMAP_LOG_OUTPUT;
+            if (impmap_log_write(log, &rec, outputs + (long)i * x->size_out)) {
+                post("implicitmap: error writing '%s'", dest);
+                break;
+            }
+        }
+        impmap_log_close(log);
+    }
+    else
+        maxpd_array_write(x, gensym((char *)dest), 0, outputs,
+                          num_rows * x->size_out);
+
+    free(inputs);
+    free(outputs);
+    free(tts);
+    maxpd_atom_set_int(&x->msg_buffer, num_rows);
+    outlet_anything(x->outlet3, gensym("rendered"), 1, &x->msg_buffer);
+}
+
+// *********************************************************
+// -(open a log of the current layout)----------------------
+t_impmap_log *impmap_open_log(impmap *x, const char *path, int write)
+{
+    t_impmap_log_signal inputs[MAX_LIST], outputs[MAX_LIST];
+    int i;
+
+    if (!write)
+        return impmap_log_open(path, 0, 0, 0, 0, 0);
+    for (i = 0; i < x->num_inputs; i++) {
+        inputs[i].name = (char *)x->signals_in[i].name->s_name;
+        inputs[i].length = x->signals_in[i].length;
+    }
+    for (i = 0; i < x->num_outputs; i++) {
+        outputs[i].name = (char *)x->signals_out[i].name->s_name;
+        outputs[i].length = x->signals_out[i].length;
+    }
+    return impmap_log_open(path, 1, inputs, x->num_inputs, outputs,
+                           x->num_outputs);
+}
+
+// *********************************************************
+// -(match the input signals of a log by name)--------------
+// map[i] is set to the current input signal that signal i of the log
+// feeds, or -1 if it has been removed; signals whose length changed keep
+// their common elements.  Returns the number of signals matched.
+int impmap_log_signal_map(impmap *x, t_impmap_log *log, int *map)
+{
+    int i, j, matched = 0, same;
+    int num = log->num_signals[IMPMAP_LOG_INPUT];
+    t_impmap_log_signal *sigs = log->signals[IMPMAP_LOG_INPUT];
+
+    same = num == x->num_inputs;
+    for (i = 0; i < num && i < MAX_LIST; i++) {
+        map[i] = -1;
+        for (j = 0; j < x->num_inputs; j++) {
+            if (strcmp(sigs[i].name, x->signals_in[j].name->s_name) == 0) {
+                map[i] = j;
+                matched++;
+                break;
+            }
+        }
+        if (map[i] != i || sigs[i].length != x->signals_in[i].length)
+            same = 0;
+    }
+    if (!same)
+        post("implicitmap: log layout differs - matched %i of its %i input "
+             "signals to the current %i", matched, num, x->num_inputs);
+    return matched;
+}
+
+// *********************************************************
+// -(stop logs of an old layout)----------------------------
+// A log holds a single layout, so recording and capture stop when it
+// changes.
+void impmap_close_logs(impmap *x)
+{
+    if (x->record_log) {
+        post("implicitmap: layout changed - stopped recording after %li "
+             "updates", x->record_log->count);
+        impmap_log_close(x->record_log);
+        x->record_log = 0;
+    }
+    if (x->capture_log) {
+        post("implicitmap: layout changed - stopped capture after %li output "
+             "vectors", x->capture_log->count);
+        impmap_log_close(x->capture_log);
+        x->capture_log = 0;
+    }
+}
+
+// *********************************************************
+// -(read input frames from a log)--------------------------
+// Updates sharing a timetag form one row; elements not present in the log
+// keep their current values.  Returns the number of rows or -1.
+int impmap_read_log_matrix(impmap *x, const char *path, float **inputs,
+                           mapper_timetag_t **tts)
+{
+    t_impmap_log *log = impmap_open_log(x, path, 0);
+    t_impmap_log_record rec;
+    float values[MAX_LIST], row[MAX_LIST];
+    int num_rows = 0, capacity = 0, pending = 0, map[MAX_LIST];
+    mapper_timetag_t tt = {0, 0};
+
+    if (!log) {
+        post("implicitmap: could not open log '%s'", path);
+        return -1;
+    }
+    if (!impmap_log_signal_map(x, log, map)) {
+        post("implicitmap: '%s' has no inputs in common with the current "
+             "layout", path);
+        impmap_log_close(log);
+        return -1;
+    }
+    *inputs = 0;
+    *tts = 0;
+    memcpy(row, x->values_in, x->size_in * sizeof(float));
+    while (1) {
+        int done = impmap_log_read(log, &rec, values, MAX_LIST);
+        if (!done && rec.direction != IMPMAP_LOG_INPUT)
+            continue;
+        if (pending && (done || rec.sec != tt.sec || rec.frac != tt.frac)) {
+            if (num_rows == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                *inputs = realloc(*inputs, (long)capacity * x->size_in
+                                  * sizeof(float));
+                *tts = realloc(*tts, capacity * sizeof(mapper_timetag_t));
+            }
+            memcpy(*inputs + (long)num_rows * x->size_in, row,
+                   x->size_in * sizeof(float));
+            (*tts)[num_rows++] = tt;
+            pending = 0;
+        }
+        if (done)
+            break;
+        int index = rec.index < log->num_signals[IMPMAP_LOG_INPUT]
+                    && rec.index < MAX_LIST ? map[rec.index] : -1;
+        if (index >= 0) {
+            t_signal_ref *ref = &x->signals_in[index];
+            int length = rec.length < ref->length ? rec.length : ref->length;
+            memcpy(row + ref->offset, values, length * sizeof(float));
+        }
+        tt.sec = rec.sec;
+        tt.frac = rec.frac;
+        pending = 1;
+    }
+    impmap_log_close(log);
+    return num_rows;
+}
+
+// *********************************************************
+// -(forget changed input signals)--------------------------
+void impmap_clear_dirty(impmap *x)
+{
+    int i;
+    for (i = 0; i < x->num_dirty; i++)
+        x->dirty_flag[x->dirty_in[i]] = 0;
+    x->num_dirty = 0;
+}
+
+// *********************************************************
+// -(forget changed input offsets)--------------------------
+void impmap_clear_changed(impmap *x)
+{
+    int i;
+    for (i = 0; i < x->num_changed; i++)
+        x->changed_flag[x->changed_in[i]] = 0;
+    x->num_changed = 0;
+}
+
+// *********************************************************
+// -(force the next evaluation to use the whole input)------
+void impmap_invalidate_changed(impmap *x)
+{
+    impmap_clear_changed(x);
+    x->num_changed = -1;
+    x->out_valid = 0;
+}
+
+// *********************************************************
+// -(process the input vector if it has changed)------------
+// With a native model the input vector only goes out on outlet1 when it is
+// being monitored; otherwise the patch on outlet1 is the model.
+void impmap_process_input(impmap *x)
+{
+    if (!x->new_in)
+        return;
+    x->new_in = 0;
+    if (x->following || x->follow_recording)
+        impmap_follow_input(x);
+    if (x->morphing ? impmap_morph_ready(x)
+        : impmap_model_ready(x->model, x->size_in, x->size_out)) {
+        impmap_evaluate(x);
+        if (!x->monitor)
+            return;
+    }
+    impmap_output_input(x);
+}
+
+// *********************************************************
+// -(query handler)-----------------------------------------
+void impmap_on_query(mapper_signal sig, mapper_id instance, const void *value,
+                     int count, mapper_timetag_t *time)
+{
+    t_signal_ref *ref = mapper_signal_user_data(sig);
+    if (!ref) {
+        post("implicitmap: no user data for signal '%s' in on_input()",
+             mapper_signal_name(sig));
+    }
+    impmap *x = ref->x;
+
+    int i, len = mapper_signal_length(sig);
+    float *valf = (float*)value;
+    for (i = 0; i < len; i++) {
+        if (ref->offset + i >= MAX_LIST) {
+            post("mapper: Maximum vector length exceeded!");
+            break;
+        }
+        // a reply after the timeout finds the snapshot already packed
+        if (valf && x->snapshots && x->snapshots->outputs)
+            x->snapshots->outputs[ref->offset + i] = valf[i];
+    }
+
+    x->query_count --;
+
+    if (x->query_count == 0) {
+        clock_unset(x->timeout);
+        impmap_output_snapshot(x);
+    }
+}
+
+// *********************************************************
+// -(connection handler)------------------------------------
+void impmap_on_map(mapper_device dev, mapper_map map, mapper_record_event e)
+{
+    // if connected involves current generic signal, create a new generic signal
+    impmap *x = (void*)mapper_device_user_data(dev);
+    if (!x) {
+        post("error in connect handler: user_data is NULL");
+        return;
+    }
+    if (!x->ready) {
+        post("error in connect handler: device not ready");
+        return;
+    }
+
+    // retrieve devices and signals
+    mapper_slot slot = mapper_map_slot(map, MAPPER_LOC_SOURCE, 0);
+    mapper_signal src_sig = mapper_slot_signal(slot);
+    mapper_device src_dev = mapper_signal_device(src_sig);
+    slot = mapper_map_slot(map, MAPPER_LOC_DESTINATION, 0);
+    mapper_signal dst_sig = mapper_slot_signal(slot);
+    mapper_device dst_dev = mapper_signal_device(dst_sig);
+
+    // sanity check: don't allow self-connections
+    if (src_dev == dst_dev) {
+        mapper_map_release(map);
+        return;
+    }
+
+    char full_name[256];
+
+    if (e == MAPPER_ADDED) {
+        if (src_dev == x->device) {
+            snprintf(full_name, 256, "%s/%s", mapper_device_name(dst_dev),
+                     mapper_signal_name(dst_sig));
+            if (strcmp(mapper_signal_name(src_sig), full_name) == 0) {
+                // <thisDev>:<dstDevName>/<dstSigName> -> <dstDev>:<dstSigName>
+                impmap_save_topology(x);
+                return;
+            }
+            if (mapper_device_num_signals(x->device, MAPPER_DIR_OUTGOING) >= MAX_LIST) {
                 post("Max outputs reached!");
                 return;
             }
-            // unmap the generic signal
-            mapper_map_release(map);
+            // unmap the generic signal
+            mapper_map_release(map);
+
+            // add a matching output signal
+            int i, length = mapper_signal_length(dst_sig);
+            char type = mapper_signal_type(dst_sig);
+            void *min = mapper_signal_minimum(dst_sig);
+            void *max = mapper_signal_maximum(dst_sig);
+
+            float *minf = 0, *maxf = 0;
+            if (type == 'f') {
+                minf = (float*)min;
+                maxf = (float*)max;
+            }
+            else {
+                if (min) {
+                    minf = alloca(length * sizeof(float));
+                    if (type == 'i') {
+                        int *mini = (int*)min;
+                        for (i = 0; i < length; i++)
+                            minf[i] = (float)mini[i];
+                    }
+                    else if (type == 'd') {
+                        double *mind = (double*)min;
+                        for (i = 0; i < length; i++)
+                            minf[i] = (float)mind[i];
+                    }
+                    else
+                        minf = 0;
+                }
+                if (max) {
+                    maxf = alloca(length * sizeof(float));
+                    if (type == 'i') {
+                        int *maxi = (int*)max;
+                        for (i = 0; i < length; i++)
+                            maxf[i] = (float)maxi[i];
+                    }
+                    else if (type == 'd') {
+                        double *maxd = (double*)max;
+                        for (i = 0; i < length; i++)
+                            maxf[i] = (float)maxd[i];
+                    }
+                    else
+                        maxf = 0;
+                }
+            }
+            src_sig = mapper_device_add_output_signal(x->device, full_name,
+                                                      length, 'f', 0, minf, maxf);
+            if (!src_sig) {
+                post("error creating new source signal!");
+                return;
+            }
+            mapper_signal_set_callback(src_sig, impmap_on_query);
+
+            // map the new signal
+            map = mapper_map_new(1, &src_sig, 1, &dst_sig);
+            mapper_map_set_mode(map, MAPPER_MODE_EXPRESSION);
+            mapper_map_set_expression(map, "y=x");
+            mapper_map_push(map);
+
+            impmap_update_output_vector_positions(x);
+
+            //output numOutputs
+            maxpd_atom_set_int(&x->msg_buffer,
+                               mapper_device_num_signals(x->device, MAPPER_DIR_OUTGOING) - 1);
+            outlet_anything(x->outlet3, gensym("numOutputs"), 1, &x->msg_buffer);
+        }
+        else if (dst_dev == x->device) {
+            snprintf(full_name, 256, "%s/%s", mapper_device_name(src_dev),
+                     mapper_signal_name(src_sig));
+            if (strcmp(mapper_signal_name(dst_sig), full_name) == 0) {
+                // <srcDevName>:<srcSigName> -> <thisDev>:<srcDevName>/<srcSigName>
+                impmap_save_topology(x);
+                return;
+            }
+            if (mapper_device_num_signals(x->device, MAPPER_DIR_INCOMING) >= MAX_LIST) {
+                post("Max inputs reached!");
+                return;
+            }
+            // unmap the generic signal
+            mapper_map_release(map);
+
+            // add a matching input signal
+            int i, length = mapper_signal_length(src_sig);
+            char type = mapper_signal_type(src_sig);
+            void *min = mapper_signal_minimum(src_sig);
+            void *max = mapper_signal_maximum(src_sig);
+
+            float *minf = 0, *maxf = 0;
+            if (type == 'f') {
+                minf = (float*)min;
+                maxf = (float*)max;
+            }
+            else {
+                if (min) {
+                    minf = alloca(length * sizeof(float));
+                    if (type == 'i') {
+                        int *mini = (int*)min;
+                        for (i = 0; i < length; i++)
+                        minf[i] = (float)mini[i];
+                    }
+                    else if (type == 'd') {
+                        double *mind = (double*)min;
+                        for (i = 0; i < length; i++)
+                        minf[i] = (float)mind[i];
+                    }
+                    else
+                        minf = 0;
+                }
+                if (max) {
+                    maxf = alloca(length * sizeof(float));
+                    if (type == 'i') {
+                        int *maxi = (int*)max;
+                        for (i = 0; i < length; i++)
+                        maxf[i] = (float)maxi[i];
+                    }
+                    else if (type == 'd') {
+                        double *maxd = (double*)max;
+                        for (i = 0; i < length; i++)
+                        maxf[i] = (float)maxd[i];
+                    }
+                    else
+                        maxf = 0;
+                }
+            }
+            dst_sig = mapper_device_add_input_signal(x->device, full_name,
+                                                     length, 'f', 0, minf, maxf,
+                                                     impmap_on_input, 0);
+            if (!dst_sig) {
+                post("error creating new destination signal!");
+                return;
+            }
+
+            // map the new signal
+            map = mapper_map_new(1, &src_sig, 1, &dst_sig);
+            mapper_map_set_mode(map, MAPPER_MODE_EXPRESSION);
+            mapper_map_set_expression(map, "y=x");
+            mapper_map_push(map);
+
+            impmap_update_input_vector_positions(x);
+
+            //output numInputs
+            maxpd_atom_set_int(&x->msg_buffer,
+                               mapper_device_num_signals(x->device, MAPPER_DIR_INCOMING) - 1);
+            outlet_anything(x->outlet3, gensym("numInputs"), 1, &x->msg_buffer);
+        }
+    }
+    else if (e == MAPPER_MODIFIED) {
+        // keep the mode and expression of our maps in the topology
+        if (src_dev == x->device || dst_dev == x->device)
+            impmap_save_topology(x);
+    }
+    else if (e == MAPPER_REMOVED) {
+        if (src_sig == x->dummy_input || src_sig == x->dummy_output
+            || dst_sig == x->dummy_input || dst_sig == x->dummy_output)
+            return;
+        if (src_dev == x->device) {
+            snprintf(full_name, 256, "%s/%s", mapper_device_name(dst_dev),
+                     mapper_signal_name(dst_sig));
+            if (strcmp(mapper_signal_name(src_sig), full_name) != 0)
+                return;
+            // remove signal
+            mapper_device_remove_signal(x->device, src_sig);
+            impmap_update_output_vector_positions(x);
+
+            //output numOutputs
+            maxpd_atom_set_int(&x->msg_buffer,
+                               mapper_device_num_signals(x->device, MAPPER_DIR_OUTGOING) - 1);
+            outlet_anything(x->outlet3, gensym("numOutputs"), 1, &x->msg_buffer);
+        }
+        else if (dst_dev == x->device) {
+            snprintf(full_name, 256, "%s/%s", mapper_device_name(src_dev),
+                     mapper_signal_name(src_sig));
+            if (strcmp(mapper_signal_name(dst_sig), full_name) != 0)
+                return;
+            // remove signal
+            mapper_device_remove_signal(x->device, dst_sig);
+            impmap_update_input_vector_positions(x);
+
+            //output numInputs
+            maxpd_atom_set_int(&x->msg_buffer,
+                               mapper_device_num_signals(x->device, MAPPER_DIR_INCOMING) - 1);
+            outlet_anything(x->outlet3, gensym("numInputs"), 1, &x->msg_buffer);
+        }
+    }
+}
+
+// *********************************************************
+// -(topology)----------------------------------------------
+// "topology <file>" keeps the generated signal set and its maps in a file,
+// rewriting it whenever signals are added or removed or maps change.
+// Signals listed in the file are recreated together as soon as the device
+// is ready (or straight away if it already is), and their maps are pushed
+// as the remote devices are discovered, instead of waiting for every map
+// to be made again by hand.
+// "topology" on its own stops keeping the file.
+void impmap_topology(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    if (x->topology) {
+        free(x->topology);
+        x->topology = 0;
+    }
+    if (!argc || argv->a_type != A_SYM)
+        return;
+    x->topology = strdup(maxpd_atom_get_string(argv));
+    if (x->ready)
+        impmap_restore_topology(x);
+}
+
+// *********************************************************
+// -(write the signal set)----------------------------------
+// One line per signal in vector order:
+// "<input|output> <name> <length> [min <values>] [max <values>]"
+// each followed by a line for every map between it and a remote signal:
+// "map <incoming|outgoing> <device>/<signal> <mode> <expression>"
+// Offsets follow from the order and lengths; version 1 files also listed
+// them, but they are recomputed when the signals are recreated.  Maps
+// still waiting to be restored are written as they were read.
+void impmap_save_topology(impmap *x)
+{
+    int d, i, j;
+    FILE *file;
+    t_pending_map pending;
+
+    if (!x->topology || x->restoring || !x->ready)
+        return;
+    if (!(file = fopen(x->topology, "w"))) {
+        post("implicitmap: could not write topology to '%s'", x->topology);
+        return;
+    }
+    fprintf(file, "implicitmap topology 3\n");
+    for (d = 0; d < 2; d++) {
+        mapper_direction dir = d ? MAPPER_DIR_OUTGOING : MAPPER_DIR_INCOMING;
+        mapper_signal dummy = d ? x->dummy_output : x->dummy_input;
+        int num = mapper_device_num_signals(x->device, dir);
+        mapper_signal signals[num + 1];
+        mapper_signal *psig = mapper_device_signals(x->device, dir);
+
+        i = 0;
+        while (psig) {
+            if (*psig != dummy && i < num)
+                signals[i++] = *psig;
+            psig = mapper_signal_query_next(psig);
+        }
+        num = i;
+        qsort(signals, num, sizeof(mapper_signal), compare_signal_names);
+        for (i = 0; i < num; i++) {
+            int length = mapper_signal_length(signals[i]);
+            const float *min = mapper_signal_minimum(signals[i]);
+            const float *max = mapper_signal_maximum(signals[i]);
+            fprintf(file, "%s %s %i", d ? "output" : "input",
+                    mapper_signal_name(signals[i]), length);
+            if (min) {
+                fprintf(file, " min");
+                for (j = 0; j < length; j++)
+                    fprintf(file, " %.9g", min[j]);
+            }
+            if (max) {
+                fprintf(file, " max");
+                for (j = 0; j < length; j++)
+                    fprintf(file, " %.9g", max[j]);
+            }
+            fprintf(file, "\n");
+
+            int num_maps = 0;
+            mapper_map *maps = mapper_signal_maps(signals[i], dir);
+            while (maps) {
+                mapper_slot slot = mapper_map_slot(*maps,
+                                                   d ? MAPPER_LOC_DESTINATION
+                                                     : MAPPER_LOC_SOURCE, 0);
+                mapper_signal remote = mapper_slot_signal(slot);
+                const char *expr = mapper_map_expression(*maps);
+                // convergent maps cannot be restored from one remote signal
+                if (remote && mapper_signal_device(remote) != x->device
+                    && mapper_map_num_sources(*maps) == 1) {
+                    fprintf(file, "map %s %s/%s %s %s\n",
+                            d ? "outgoing" : "incoming",
+                            mapper_device_name(mapper_signal_device(remote)),
+                            mapper_signal_name(remote),
+                            impmap_mode_name(mapper_map_mode(*maps)),
+                            expr ? expr : "");
+                    num_maps++;
+                }
+                maps = mapper_map_query_next(maps);
+            }
+            for (pending = x->pending_maps; pending && !num_maps;
+                 pending = pending->next) {
+                if (strcmp(pending->name, mapper_signal_name(signals[i])) != 0)
+                    continue;
+                fprintf(file, "map %s %s %s %s\n",
+                        pending->output ? "outgoing" : "incoming",
+                        pending->remote, impmap_mode_name(pending->mode),
+                        pending->expression);
+            }
+        }
+    }
+    fclose(file);
+}
+
+const char *impmap_mode_name(mapper_mode mode)
+{
+    switch (mode) {
+        case MAPPER_MODE_RAW:
+            return "raw";
+        case MAPPER_MODE_LINEAR:
+            return "linear";
+        default:
+            return "expression";
+    }
+}
+
+// *********************************************************
+// -(recreate the signal set)-------------------------------
+// Vector positions are only recomputed once, after every signal exists.
+// The file is then rewritten to hold the whole signal set, so that a new
+// file exists as soon as the topology is kept.  Signals without map lines
+// (all of them before version 3) are mapped to the remote signal their
+// name refers to with "y=x".
+void impmap_restore_topology(impmap *x)
+{
+    char line[8192], name[256], direction[16], key[16], remote[256];
+    int num_added[2] = {0, 0}, count = 0, version, last_default = 0;
+    t_pending_map last = 0;
+    FILE *file = fopen(x->topology, "r");
+
+    if (!file) {
+        impmap_save_topology(x);
+        return;
+    }
+    if (!fgets(line, sizeof(line), file)
+        || sscanf(line, "implicitmap topology %i", &version) != 1
+        || version < 1 || version > 3) {
+        post("implicitmap: '%s' is not a topology file", x->topology);
+        fclose(file);
+        return;
+    }
+
+    x->restoring = 1;
+    x->num_subscribed = 0;
+    while (fgets(line, sizeof(line), file)) {
+        int i, offset, length, used, output;
+        float min[MAX_LIST], max[MAX_LIST];
+        int has_min = 0, has_max = 0;
+        char *p = line;
+        mapper_signal sig;
+        mapper_direction dir;
+
+        // a map of the signal on the line before
+        if (strncmp(p, "map ", 4) == 0) {
+            t_pending_map pending = last;
+            if (!last || sscanf(p, "map %15s %255s %15s%n", direction, remote,
+                                key, &used) != 3)
+                continue;
+            p += used;
+            p += strspn(p, " \t");
+            p[strcspn(p, "\r\n")] = 0;
+            if (!last_default) {
+                pending = calloc(1, sizeof(struct _pending_map));
+                pending->name = strdup(last->name);
+                pending->next = x->pending_maps;
+                x->pending_maps = pending;
+            }
+            free(pending->remote);
+            free(pending->expression);
+            pending->remote = strdup(remote);
+            pending->output = strcmp(direction, "outgoing") == 0;
+            pending->mode = strcmp(key, "raw") == 0 ? MAPPER_MODE_RAW
+                            : strcmp(key, "linear") == 0 ? MAPPER_MODE_LINEAR
+                            : MAPPER_MODE_EXPRESSION;
+            pending->expression = strdup(*p ? p : "y=x");
+            last_default = 0;
+            continue;
+        }
+        last = 0;
+
+        if (version == 1) {
+            if (sscanf(p, "%15s %i %255s %i%n", direction, &offset, name,
+                       &length, &used) != 4)
+                continue;
+        }
+        else if (sscanf(p, "%15s %255s %i%n", direction, name, &length,
+                        &used) != 3)
+            continue;
+        if (length < 1 || length > MAX_LIST)
+            continue;
+        p += used;
+        while (sscanf(p, " %7s%n", key, &used) == 1) {
+            float *values = strcmp(key, "min") == 0 ? min : max;
+            if (values == max && strcmp(key, "max") != 0)
+                break;
+            p += used;
+            for (i = 0; i < length; i++) {
+                if (sscanf(p, " %f%n", &values[i], &used) != 1)
+                    break;
+                p += used;
+            }
+            if (values == min)
+                has_min = 1;
+            else
+                has_max = 1;
+        }
+        output = strncmp(direction, "output", 6) == 0;
+        dir = output ? MAPPER_DIR_OUTGOING : MAPPER_DIR_INCOMING;
+
+        // signals that survived (e.g. a topology message) are only remapped
+        sig = mapper_device_signal_by_name(x->device, name);
+        if (!sig) {
+            if (mapper_device_num_signals(x->device, dir) >= MAX_LIST)
+                continue;
+            if (output) {
+                sig = mapper_device_add_output_signal(x->device, name, length,
+                                                      'f', 0,
+                                                      has_min ? min : 0,
+                                                      has_max ? max : 0);
+                if (sig)
+                    mapper_signal_set_callback(sig, impmap_on_query);
+            }
+            else
+                sig = mapper_device_add_input_signal(x->device, name, length,
+                                                     'f', 0,
+                                                     has_min ? min : 0,
+                                                     has_max ? max : 0,
+                                                     impmap_on_input, 0);
+            if (!sig)
+                continue;
+            num_added[output]++;
+        }
+
+        t_pending_map pending = calloc(1, sizeof(struct _pending_map));
+        pending->name = strdup(name);
+        pending->remote = strdup(name);
+        pending->output = output;
+        pending->mode = MAPPER_MODE_EXPRESSION;
+        pending->expression = strdup("y=x");
+        pending->next = x->pending_maps;
+        x->pending_maps = pending;
+        last = pending;
+        last_default = 1;
+        count++;
+    }
+    fclose(file);
+    x->restoring = 0;
+
+    if (num_added[0]) {
+        impmap_update_input_vector_positions(x);
+        maxpd_atom_set_int(&x->msg_buffer,
+                           mapper_device_num_signals(x->device, MAPPER_DIR_INCOMING) - 1);
+        outlet_anything(x->outlet3, gensym("numInputs"), 1, &x->msg_buffer);
+    }
+    if (num_added[1]) {
+        impmap_update_output_vector_positions(x);
+        maxpd_atom_set_int(&x->msg_buffer,
+                           mapper_device_num_signals(x->device, MAPPER_DIR_OUTGOING) - 1);
+        outlet_anything(x->outlet3, gensym("numOutputs"), 1, &x->msg_buffer);
+    }
+    post("implicitmap: restored %i signals from '%s'", count, x->topology);
+    impmap_save_topology(x);
+
+    // learn about remote devices so the maps can be made
+    if (x->pending_maps) {
+        mapper_database db = mapper_device_database(x->device);
+        mapper_database_subscribe(db, 0, MAPPER_OBJ_DEVICES, -1);
+        mapper_database_request_devices(db);
+        x->pending_count = 0;
+    }
+}
+
+// *********************************************************
+// -(push maps for restored signals)------------------------
+// Called periodically while maps are pending; every map whose remote
+// signal is known is pushed in the same pass.  The signals of each remote
+// device are requested once.
+void impmap_restore_maps(impmap *x)
+{
+    mapper_database db = mapper_device_database(x->device);
+    t_pending_map *pp = &x->pending_maps;
+    int i, pushed = 0;
+
+    while (*pp) {
+        t_pending_map pending = *pp;
+        char device_name[256];
+        const char *signal_name = strchr(pending->remote, '/');
+        mapper_device remote;
+        mapper_signal local, remote_sig = 0;
+
+        local = mapper_device_signal_by_name(x->device, pending->name);
+        if (!local || !signal_name) {
+            // the signal has gone, or was never a generated one
+            *pp = pending->next;
+            impmap_free_pending_map(pending);
+            continue;
+        }
+        snprintf(device_name, sizeof(device_name), "%.*s",
+                 (int)(signal_name - pending->remote), pending->remote);
+        remote = mapper_database_device_by_name(db, device_name);
+        if (remote) {
+            t_symbol *sym = gensym(device_name);
+            for (i = 0; i < x->num_subscribed; i++) {
+                if (x->subscribed[i] == sym)
+                    break;
+            }
+            if (i == x->num_subscribed && i < MAX_LIST) {
+                mapper_database_subscribe(db, remote, MAPPER_OBJ_SIGNALS, -1);
+                x->subscribed[x->num_subscribed++] = sym;
+            }
+            remote_sig = mapper_device_signal_by_name(remote, signal_name + 1);
+        }
+        if (!remote_sig) {
+            pp = &pending->next;
+            continue;
+        }
+
+        mapper_map map = pending->output
+                         ? mapper_map_new(1, &local, 1, &remote_sig)
+                         : mapper_map_new(1, &remote_sig, 1, &local);
+        mapper_map_set_mode(map, pending->mode);
+        if (pending->mode == MAPPER_MODE_EXPRESSION)
+            mapper_map_set_expression(map, pending->expression);
+        mapper_map_push(map);
+        pushed++;
+
+        *pp = pending->next;
+        impmap_free_pending_map(pending);
+    }
+    if (pushed)
+        post("implicitmap: restored %i maps", pushed);
+}
+
+void impmap_free_pending_map(t_pending_map pending)
+{
+    free(pending->name);
+    free(pending->remote);
+    free(pending->expression);
+    free(pending);
+}
+
+// *********************************************************
+// -(match columns of two layouts by signal name)-----------
+// map[i] is set to the element of the 'from' vector that element i of the
+// 'to' vector takes its value from, or -1 if it has none.  Signals whose
+// length changed keep their common elements.  Returns the number of
+// unmatched elements.
+int impmap_column_map(const t_signal_ref *from, int num_from, int size_from,
+                      const t_signal_ref *to, int num_to, int size_to,
+                      int *map)
+{
+    int i, j, k, unmatched = size_to;
+
+    for (i = 0; i < size_to; i++)
+        map[i] = -1;
+    for (j = 0; j < num_to; j++) {
+        for (i = 0; i < num_from; i++) {
+            if (from[i].name == to[j].name)
+                break;
+        }
+        if (i == num_from)
+            continue;
+        for (k = 0; k < from[i].length && k < to[j].length; k++) {
+            if (to[j].offset + k >= size_to || from[i].offset + k >= size_from)
+                break;
+            map[to[j].offset + k] = from[i].offset + k;
+            unmatched--;
+        }
+    }
+    return unmatched;
+}
+
+// *********************************************************
+// -(carry the snapshots over to a new layout)--------------
+// Columns of signals that were removed are dropped and columns of new
+// signals are filled with the 'fill' value; a trained native model is then
+// retrained on the remapped snapshots.
+void impmap_remap_snapshots(impmap *x, const t_signal_ref *from,
+                            int num_from, int size_from, int outputs)
+{
+    const t_signal_ref *to = outputs ? x->signals_out : x->signals_in;
+    int num_to = outputs ? x->num_outputs : x->num_inputs;
+    int size_to = outputs ? x->size_out : x->size_in;
+    int map[MAX_LIST], i, k, filled, changed = size_from != size_to;
+    int count = 0;
+    t_snapshot snap;
+
+    filled = impmap_column_map(from, num_from, size_from, to, num_to, size_to,
+                               map);
+    for (i = 0; i < size_to && !changed; i++)
+        changed = map[i] != i;
+    if (!changed)
+        return;
+
+    // packed vectors and their column ranges follow the old layout
+    if (outputs)
+        impmap_unpack_all(x, x->size_in, size_from);
+    else
+        impmap_unpack_all(x, size_from, x->size_out);
+
+    // other scenes' models are retrained when their scene is next current
+    for (k = 0; k < x->num_scenes; k++) {
+        snap = k == x->scene ? x->snapshots : x->scenes[k].snapshots;
+        for (; snap; snap = snap->next) {
+            float *old = outputs ? snap->outputs : snap->inputs;
+            float *values = malloc((size_to + 1) * sizeof(float));
+            for (i = 0; i < size_to; i++)
+                values[i] = map[i] >= 0 ? old[map[i]] : x->fill;
+            free(old);
+            if (outputs)
+                snap->outputs = values;
+            else
+                snap->inputs = values;
+            count++;
+        }
+    }
+    impmap_pack_all(x);
+    x->admit_grid.valid = 0;
+    if (!count)
+        return;
+    post("implicitmap: %s layout changed - remapped %i snapshots, dropping %i "
+         "and filling %i columns", outputs ? "output" : "input",
+         count, size_from - (size_to - filled), filled);
+    impmap_write_snapshot_arrays(x);
+
+    if (x->num_snapshots && x->model && x->model->trained)
+        impmap_train(x);
+}
+
+// *********************************************************
+// -(carry the follow templates over to a new input layout)-
+// Columns are matched by signal name as for the snapshots, so a layout
+// that keeps its size but reorders or replaces signals still lines up.
+void impmap_remap_templates(impmap *x, const t_signal_ref *from,
+                            int num_from, int size_from)
+{
+    int map[MAX_LIST], i, count, changed = size_from != x->size_in;
+
+    if (!x->follower->num_templates)
+        return;
+    impmap_column_map(from, num_from, size_from, x->signals_in,
+                      x->num_inputs, x->size_in, map);
+    for (i = 0; i < x->size_in && !changed; i++)
+        changed = map[i] != i;
+    if (!changed)
+        return;
+    count = impmap_follow_remap(x->follower, map, size_from, x->size_in,
+                                x->fill);
+    if (count)
+        post("implicitmap: input layout changed - remapped %i follow "
+             "templates", count);
+}
+
+// *********************************************************
+// -(scenes)------------------------------------------------
+// "scene <name>" makes the named snapshot set and model current, creating
+// an empty scene with the same engine, engine parameters, cache and PCA
+// settings as the current model if there is none; the previous
+// scene keeps its snapshots and trained model.  "scene" alone reports the
+// current scene.
+void impmap_scene(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    t_scene *scene;
+    int i;
+
+    if (!argc || argv->a_type != A_SYM) {
+        maxpd_atom_set_string(&x->msg_buffer, x->scenes[x->scene].name->s_name);
+        outlet_anything(x->outlet3, gensym("scene"), 1, &x->msg_buffer);
+        return;
+    }
+    i = impmap_find_scene(x, gensym((char *)maxpd_atom_get_string(argv)));
+    if (i == x->scene)
+        return;
+    if (x->query_count) {
+        // the pending snapshot would land in the scene being switched to
+        post("implicitmap: cannot change scene while a snapshot is in "
+             "progress");
+        return;
+    }
+    if (i < 0) {
+        if (x->num_scenes == MAX_SCENES) {
+            post("implicitmap: too many scenes");
+            return;
+        }
+        i = x->num_scenes++;
+        scene = &x->scenes[i];
+        scene->name = gensym((char *)maxpd_atom_get_string(argv));
+        scene->snapshots = 0;
+        scene->num_snapshots = 0;
+        scene->model = x->model ? impmap_model_new_like(x->model) : 0;
+        scene->morph = 0;
+    }
+
+    // store the current scene and take over the new one
+    if (x->offload)
+        impmap_offload_release(x);
+    scene = &x->scenes[x->scene];
+    scene->snapshots = x->snapshots;
+    scene->num_snapshots = x->num_snapshots;
+    scene->model = x->model;
+    scene = &x->scenes[i];
+    x->snapshots = scene->snapshots;
+    x->num_snapshots = scene->num_snapshots;
+    x->model = scene->model;
+    x->scene = i;
+    x->admit_grid.valid = 0;
+    impmap_invalidate_changed(x);
+    x->new_in = 1;
+
+    // a model trained before the signal layout changed is retrained now
+    if (x->model && x->model->size_in && x->num_snapshots
+        && !impmap_model_ready(x->model, x->size_in, x->size_out))
+        impmap_train(x);
+    else if (x->offload && x->model && x->model->trained)
+        impmap_offload_push(x);
+
+    maxpd_atom_set_string(&x->msg_buffer, scene->name->s_name);
+    outlet_anything(x->outlet3, gensym("scene"), 1, &x->msg_buffer);
+    maxpd_atom_set_int(&x->msg_buffer, x->num_snapshots);
+    outlet_anything(x->outlet3, gensym("numSnapshots"), 1, &x->msg_buffer);
+    impmap_write_snapshot_arrays(x);
+}
+
+// *********************************************************
+// -(list scenes)-------------------------------------------
+void impmap_list_scenes(impmap *x)
+{
+    t_atom names[MAX_SCENES];
+    int i;
+    for (i = 0; i < x->num_scenes; i++)
+        maxpd_atom_set_string(names + i, x->scenes[i].name->s_name);
+    outlet_anything(x->outlet3, gensym("scenes"), x->num_scenes, names);
+}
+
+int impmap_find_scene(impmap *x, t_symbol *name)
+{
+    int i;
+    for (i = 0; i < x->num_scenes; i++) {
+        if (x->scenes[i].name == name)
+            return i;
+    }
+    return -1;
+}
+
+// *********************************************************
+// -(morph)-------------------------------------------------
+// "morph <scene> <weight> [<scene> <weight> ...]" evaluates the models of
+// the named scenes and blends their outputs by the normalised weights;
+// scenes not named do not contribute.  "morph" alone returns to
+// evaluating the current scene only.  Direct maps only compute the current
+// scene's model, so offloading is suspended while morphing.  Models of
+// other scenes have missed the input changes since they last contributed,
+// so they start from a full evaluation.
+void impmap_morph(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    int i, k, was_morphing = x->morphing;
+    for (k = 0; k < x->num_scenes; k++) {
+        x->scenes[k].morph = 0;
+        if (k != x->scene && x->scenes[k].model)
+            x->scenes[k].model->stale = 1;
+    }
+    x->morphing = 0;
+    for (i = 0; i + 1 < argc; i += 2) {
+        if ((argv+i)->a_type != A_SYM)
+            continue;
+        k = impmap_find_scene(x, gensym((char *)maxpd_atom_get_string(argv+i)));
+        if (k < 0) {
+            post("implicitmap: no scene '%s'", maxpd_atom_get_string(argv+i));
+            continue;
+        }
+        x->scenes[k].morph = atom_getfloat(argv+i+1);
+        if (x->scenes[k].morph > 0)
+            x->morphing = 1;
+    }
+    if (x->morphing && !was_morphing) {
+        impmap_offload_release(x);
+        if (x->variance)
+            post("implicitmap: no variance output until the morph ends");
+    }
+    else if (!x->morphing && was_morphing && x->offload && x->model
+             && x->model->trained)
+        impmap_offload_push(x);
+    // output the new blend without waiting for the input to change
+    x->new_in = 1;
+}
+
+// *********************************************************
+// -(check some morph target can be evaluated)--------------
+int impmap_morph_ready(impmap *x)
+{
+    int k;
+    for (k = 0; k < x->num_scenes; k++) {
+        t_impmap_model *model = k == x->scene ? x->model : x->scenes[k].model;
+        if (x->scenes[k].morph > 0
+            && impmap_model_ready(model, x->size_in, x->size_out))
+            return 1;
+    }
+    return 0;
+}
+
+// *********************************************************
+// -(evaluate the morph)------------------------------------
+// Only scenes with a weight and a model trained for the current layout are
+// evaluated, accumulating into one output vector.  The models that are
+// skipped miss these input changes, so they are marked stale and start
+// from a full evaluation when they next contribute.
+void impmap_morph_evaluate(impmap *x, float *out)
+{
+    float result[MAX_LIST], total = 0;
+    int i, k;
+
+    memset(out, 0, x->size_out * sizeof(float));
+    for (k = 0; k < x->num_scenes; k++) {
+        t_impmap_model *model = k == x->scene ? x->model : x->scenes[k].model;
+        float weight = x->scenes[k].morph;
+        if (!impmap_model_ready(model, x->size_in, x->size_out))
+            continue;
+        if (weight <= 0) {
+            model->stale = 1;
+            continue;
+        }
+        impmap_model_update(model, x->values_in, result, x->changed_in,
+                            x->num_changed);
+        for (i = 0; i < x->size_out; i++)
+            out[i] += weight * result[i];
+        total += weight;
+    }
+    if (total > 0) {
+        for (i = 0; i < x->size_out; i++)
+            out[i] /= total;
+    }
+}
+
+// *********************************************************
+// -(evaluate the morph for many rows)----------------------
+void impmap_morph_batch(impmap *x, const float *inputs, float *outputs,
+                        int num_rows)
+{
+    long i, n = (long)num_rows * x->size_out;
+    float *result = malloc(n * sizeof(float)), total = 0;
+    int k;
+
+    memset(outputs, 0, n * sizeof(float));
+    for (k = 0; k < x->num_scenes; k++) {
+        t_impmap_model *model = k == x->scene ? x->model : x->scenes[k].model;
+        float weight = x->scenes[k].morph;
+        if (weight <= 0 || !impmap_model_ready(model, x->size_in, x->size_out))
+            continue;
+        impmap_model_evaluate_batch(model, inputs, result, num_rows);
+        for (i = 0; i < n; i++)
+            outputs[i] += weight * result[i];
+        total += weight;
+    }
+    if (total > 0) {
+        for (i = 0; i < n; i++)
+            outputs[i] /= total;
+    }
+    free(result);
+}
+
+// *********************************************************
+// -(offload)-----------------------------------------------
+// "offload 1 [threshold]" compiles a trained affine model into one
+// convergent map per destination signal, computing it directly from the
+// source signals, and stops sending those outputs itself.  Weights smaller
+// than threshold times the largest weight for an output are dropped.  The
+// maps are rebuilt whenever the model is retrained; "offload 0" removes
+// them and resumes sending.
+void impmap_offload(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    int offload = 0;
+    maxpd_atom_get_int_arg(argc, argv, &offload);
+    if (argc > 1 && (argv+1)->a_type != A_SYM)
+        x->offload_threshold = maxpd_atom_get_float(argv+1);
+    x->offload = offload;
+    if (offload && x->ready && x->model && x->model->trained)
+        impmap_offload_push(x);
+    else if (!offload)
+        impmap_offload_release(x);
+}
 
-            // add a matching output signal
-            int i, length = mapper_signal_length(dst_sig);
-            char type = mapper_signal_type(dst_sig);
-            void *min = mapper_signal_minimum(dst_sig);
-            void *max = mapper_signal_maximum(dst_sig);
+// *********************************************************
+// -(push the model as direct maps)-------------------------
+// Sources are x0..xn in the order of the input vector, so an output
+// element is "y[k]=b+w*x0[m]+..." (without indices for scalar signals).
+// Destinations that depend on more signals than a map can take are still
+// computed here.
+void impmap_offload_push(impmap *x)
+{
+    float *weights, bias[MAX_LIST];
+    mapper_signal remote_in[MAX_LIST];
+    int i, j, k, m, n, skipped = 0;
 
-            float *minf = 0, *maxf = 0;
-            if (type == 'f') {
-                minf = (float*)min;
-                maxf = (float*)max;
-            }
-            else {
-                if (min) {
-                    minf = alloca(length * sizeof(float));
-                    if (type == 'i') {
-                        int *mini = (int*)min;
-                        for (i = 0; i < length; i++)
-                            minf[i] = (float)mini[i];
-                    }
-                    else if (type == 'd') {
-                        double *mind = (double*)min;
-                        for (i = 0; i < length; i++)
-                            minf[i] = (float)mind[i];
-                    }
-                    else
-                        minf = 0;
+    impmap_offload_release(x);
+    // blended outputs are computed here until the morph ends
+    if (x->morphing)
+        return;
+    weights = malloc((x->size_in * x->size_out + 1) * sizeof(float));
+    if (impmap_model_affine(x->model, weights, bias)) {
+        post("implicitmap: the %s engine cannot be offloaded",
+             x->model->engine->name);
+        free(weights);
+        return;
+    }
+    for (i = 0; i < x->num_inputs; i++) {
+        mapper_signal local = mapper_device_signal_by_name(x->device,
+                                                           x->signals_in[i].name->s_name);
+        remote_in[i] = local ? impmap_remote_signal(local, 0) : 0;
+    }
+
+    for (j = 0; j < x->num_outputs; j++) {
+        t_signal_ref *out = &x->signals_out[j];
+        mapper_signal local = mapper_device_signal_by_name(x->device,
+                                                           out->name->s_name);
+        mapper_signal dst = local ? impmap_remote_signal(local, 1) : 0;
+        mapper_signal sources[MAX_MAP_SOURCES];
+        int source_of[MAX_LIST], num_sources = 0;
+        char expr[MAX_EXPRESSION];
+        int length = 0, ok = dst != 0;
+
+        // find the input signals this destination depends on
+        for (i = 0; i < x->num_inputs && ok; i++) {
+            t_signal_ref *in = &x->signals_in[i];
+            source_of[i] = -1;
+            for (k = 0; k < out->length && source_of[i] < 0; k++) {
+                float limit = 0;
+                for (m = 0; m < x->size_in; m++) {
+                    float w = fabsf(weights[m * x->size_out + out->offset + k]);
+                    limit = w > limit ? w : limit;
                 }
-                if (max) {
-                    maxf = alloca(length * sizeof(float));
-                    if (type == 'i') {
-                        int *maxi = (int*)max;
-                        for (i = 0; i < length; i++)
-                            maxf[i] = (float)maxi[i];
+                limit *= x->offload_threshold;
+                for (m = 0; m < in->length; m++) {
+                    if (fabsf(weights[(in->offset + m) * x->size_out
+                                      + out->offset + k]) > limit) {
+                        if (num_sources == MAX_MAP_SOURCES || !remote_in[i])
+                            ok = 0;
+                        else {
+                            source_of[i] = num_sources;
+                            sources[num_sources++] = remote_in[i];
+                        }
+                        break;
                     }
-                    else if (type == 'd') {
-                        double *maxd = (double*)max;
-                        for (i = 0; i < length; i++)
-                            maxf[i] = (float)maxd[i];
-                    }
-                    else
-                        maxf = 0;
                 }
             }
-            src_sig = mapper_device_add_output_signal(x->device, full_name,
-                                                      length, 'f', 0, minf, maxf);
-            if (!src_sig) {
-                post("error creating new source signal!");
-                return;
-            }
-            mapper_signal_set_callback(src_sig, impmap_on_query);
-
-            // map the new signal
-            map = mapper_map_new(1, &src_sig, 1, &dst_sig);
-            mapper_map_set_mode(map, MAPPER_MODE_EXPRESSION);
-            mapper_map_set_expression(map, "y=x");
-            mapper_map_push(map);
-
-            impmap_update_output_vector_positions(x);
-
-            //output numOutputs
-            maxpd_atom_set_int(&x->msg_buffer,
-                               mapper_device_num_signals(x->device, MAPPER_DIR_OUTGOING) - 1);
-            outlet_anything(x->outlet3, gensym("numOutputs"), 1, &x->msg_buffer);
         }
-        else if (dst_dev == x->device) {
-            snprintf(full_name, 256, "%s/%s", mapper_device_name(src_dev),
-                     mapper_signal_name(src_sig));
-            if (strcmp(mapper_signal_name(dst_sig), full_name) == 0) {
-                // <srcDevName>:<srcSigName> -> <thisDev>:<srcDevName>/<srcSigName>
-                return;
-            }
-            if (mapper_device_num_signals(x->device, MAPPER_DIR_INCOMING) >= MAX_LIST) {
-                post("Max inputs reached!");
-                return;
-            }
-            // unmap the generic signal
-            mapper_map_release(map);
 
-            // add a matching input signal
-            int i, length = mapper_signal_length(src_sig);
-            char type = mapper_signal_type(src_sig);
-            void *min = mapper_signal_minimum(src_sig);
-            void *max = mapper_signal_maximum(src_sig);
-
-            float *minf = 0, *maxf = 0;
-            if (type == 'f') {
-                minf = (float*)min;
-                maxf = (float*)max;
+        // one assignment per destination element
+        for (k = 0; k < out->length && ok; k++) {
+            float limit = 0;
+            int o = out->offset + k;
+            for (m = 0; m < x->size_in; m++) {
+                float w = fabsf(weights[m * x->size_out + o]);
+                limit = w > limit ? w : limit;
             }
-            else {
-                if (min) {
-                    minf = alloca(length * sizeof(float));
-                    if (type == 'i') {
-                        int *mini = (int*)min;
-                        for (i = 0; i < length; i++)
-                        minf[i] = (float)mini[i];
-                    }
-                    else if (type == 'd') {
-                        double *mind = (double*)min;
-                        for (i = 0; i < length; i++)
-                        minf[i] = (float)mind[i];
-                    }
-                    else
-                        minf = 0;
-                }
-                if (max) {
-                    maxf = alloca(length * sizeof(float));
-                    if (type == 'i') {
-                        int *maxi = (int*)max;
-                        for (i = 0; i < length; i++)
-                        maxf[i] = (float)maxi[i];
-                    }
-                    else if (type == 'd') {
-                        double *maxd = (double*)max;
-                        for (i = 0; i < length; i++)
-                        maxf[i] = (float)maxd[i];
-                    }
+            limit *= x->offload_threshold;
+            if (out->length > 1)
+                length += snprintf(expr + length, MAX_EXPRESSION - length,
+                                   "%sy[%i]=%.7g", k ? ";" : "", k, bias[o]);
+            else
+                length += snprintf(expr + length, MAX_EXPRESSION - length,
+                                   "y=%.7g", bias[o]);
+            for (i = 0; i < x->num_inputs && length < MAX_EXPRESSION; i++) {
+                t_signal_ref *in = &x->signals_in[i];
+                if (source_of[i] < 0)
+                    continue;
+                for (m = 0; m < in->length && length < MAX_EXPRESSION; m++) {
+                    float w = weights[(in->offset + m) * x->size_out + o];
+                    if (fabsf(w) <= limit)
+                        continue;
+                    if (in->length > 1)
+                        n = snprintf(expr + length, MAX_EXPRESSION - length,
+                                     "%+.7g*x%i[%i]", w, source_of[i], m);
                     else
-                        maxf = 0;
+                        n = snprintf(expr + length, MAX_EXPRESSION - length,
+                                     "%+.7g*x%i", w, source_of[i]);
+                    length += n;
                 }
             }
-            dst_sig = mapper_device_add_input_signal(x->device, full_name,
-                                                     length, 'f', 0, minf, maxf,
-                                                     impmap_on_input, 0);
-            if (!dst_sig) {
-                post("error creating new destination signal!");
-                return;
-            }
-
-            // map the new signal
-            map = mapper_map_new(1, &src_sig, 1, &dst_sig);
-            mapper_map_set_mode(map, MAPPER_MODE_EXPRESSION);
-            mapper_map_set_expression(map, "y=x");
-            mapper_map_push(map);
-
-            impmap_update_input_vector_positions(x);
-
-            //output numInputs
-            maxpd_atom_set_int(&x->msg_buffer,
-                               mapper_device_num_signals(x->device, MAPPER_DIR_INCOMING) - 1);
-            outlet_anything(x->outlet3, gensym("numInputs"), 1, &x->msg_buffer);
+            if (length >= MAX_EXPRESSION)
+                ok = 0;
+        }
+        if (!ok || !num_sources) {
+            skipped++;
+            continue;
         }
+
+        mapper_map map = mapper_map_new(num_sources, sources, 1, &dst);
+        mapper_map_set_mode(map, MAPPER_MODE_EXPRESSION);
+        mapper_map_set_expression(map, expr);
+        mapper_map_push(map);
+        x->offloaded[x->num_offloaded++] = map;
+        out->offloaded = 1;
     }
-    else if (e == MAPPER_REMOVED) {
-        if (src_sig == x->dummy_input || src_sig == x->dummy_output
-            || dst_sig == x->dummy_input || dst_sig == x->dummy_output)
-            return;
-        if (src_dev == x->device) {
-            snprintf(full_name, 256, "%s/%s", mapper_device_name(dst_dev),
-                     mapper_signal_name(dst_sig));
-            if (strcmp(mapper_signal_name(src_sig), full_name) != 0)
-                return;
-            // remove signal
-            mapper_device_remove_signal(x->device, src_sig);
-            impmap_update_input_vector_positions(x);
+    free(weights);
+    post("implicitmap: offloaded %i outputs to direct maps%s", x->num_offloaded,
+         skipped ? ", others are still computed here" : "");
+}
 
-            //output numOutputs
-            maxpd_atom_set_int(&x->msg_buffer,
-                               mapper_device_num_signals(x->device, MAPPER_DIR_OUTGOING) - 1);
-            outlet_anything(x->outlet3, gensym("numOutputs"), 1, &x->msg_buffer);
+// *********************************************************
+// -(remove the direct maps)--------------------------------
+void impmap_offload_release(impmap *x)
+{
+    int i;
+    for (i = 0; i < x->num_offloaded; i++)
+        mapper_map_release(x->offloaded[i]);
+    x->num_offloaded = 0;
+    for (i = 0; i < x->num_outputs; i++) {
+        if (x->signals_out[i].offloaded) {
+            x->signals_out[i].offloaded = 0;
+            x->signals_out[i].sent = 0;     // resend the current value
         }
-        else if (dst_dev == x->device) {
-            snprintf(full_name, 256, "%s/%s", mapper_device_name(src_dev),
-                     mapper_signal_name(src_sig));
-            if (strcmp(mapper_signal_name(dst_sig), full_name) != 0)
-                return;
-            // remove signal
-            mapper_device_remove_signal(x->device, dst_sig);
-            impmap_update_input_vector_positions(x);
+    }
+}
 
-            //output numInputs
-            maxpd_atom_set_int(&x->msg_buffer,
-                               mapper_device_num_signals(x->device, MAPPER_DIR_INCOMING) - 1);
-            outlet_anything(x->outlet3, gensym("numInputs"), 1, &x->msg_buffer);
+// *********************************************************
+// -(remote end of a generated signal)----------------------
+// Generated signals are mapped one-to-one to the remote signal they stand
+// for, so the other end of any of their maps is it.
+mapper_signal impmap_remote_signal(mapper_signal local, int output)
+{
+    mapper_signal remote = 0;
+    mapper_map *maps = mapper_signal_maps(local, output ? MAPPER_DIR_OUTGOING
+                                                        : MAPPER_DIR_INCOMING);
+    while (maps) {
+        mapper_slot slot = mapper_map_slot(*maps, output ? MAPPER_LOC_DESTINATION
+                                                          : MAPPER_LOC_SOURCE, 0);
+        mapper_signal sig = mapper_slot_signal(slot);
+        if (sig && mapper_signal_device(sig) != mapper_signal_device(local)) {
+            remote = sig;
+            mapper_map_query_done(maps);
+            break;
         }
+        maps = mapper_map_query_next(maps);
     }
+    return remote;
+}
+
+// *********************************************************
+// -(fill value for new snapshot columns)-------------------
+void impmap_fill(impmap *x, t_symbol *s, int argc, t_atom *argv)
+{
+    if (argc && argv->a_type != A_SYM)
+        x->fill = maxpd_atom_get_float(argv);
 }
 
 // *********************************************************
@@ -810,18 +4339,48 @@ void impmap_update_input_vector_positions(impmap *x)
     // sort input signal pointer array
     qsort(signals, num_inputs, sizeof(mapper_signal), compare_signal_names);
 
+    // direct maps refer to the old layout until the model is retrained
+    impmap_offload_release(x);
+
+    // keep the old layout for remapping the snapshots
+    t_signal_ref old_layout[MAX_LIST];
+    int old_num = x->num_inputs, old_size = x->size_in;
+    memcpy(old_layout, x->signals_in, old_num * sizeof(t_signal_ref));
+
     // set offsets and user_data
+    // the pending frame refers to the old layout
+    for (i = 0; i < x->frame_count; i++)
+        x->frame_arrived[x->frame_signals[i]] = 0;
+    x->frame_count = 0;
+
+    // so do the frames of a follow template being recorded
+    if (x->follow_recording && x->follow_rows) {
+        post("implicitmap: input layout changed - restarted follow "
+             "recording, dropping %i frames", x->follow_rows);
+        x->follow_rows = 0;
+    }
+
+    impmap_clear_dirty(x);
+    x->num_dirty = -1;
+
     for (i = 0; i < num_inputs; i++) {
         x->signals_in[i].offset = k;
+        x->signals_in[i].length = mapper_signal_length(signals[i]);
+        x->signals_in[i].name = gensym((char *)mapper_signal_name(signals[i]));
         mapper_signal_set_user_data(signals[i], &x->signals_in[i]);
         k += mapper_signal_length(signals[i]);
     }
+    x->num_inputs = num_inputs;
+    impmap_invalidate_changed(x);
+    impmap_save_topology(x);
     count = k < MAX_LIST ? k : MAX_LIST;
-    if (count != x->size_in && x->num_snapshots) {
-        post("implicitmap: input vector size has changed - resetting snapshots!");
-        impmap_clear_snapshots(x);
-    }
     x->size_in = count;
+    impmap_close_logs(x);
+    if (x->replay_log)
+        impmap_log_signal_map(x, x->replay_log, x->replay_map);
+    // every scene's snapshots follow the layout, not only the current ones
+    impmap_remap_snapshots(x, old_layout, old_num, old_size, 0);
+    impmap_remap_templates(x, old_layout, old_num, old_size);
 }
 
 // *********************************************************
@@ -845,18 +4404,29 @@ void impmap_update_output_vector_positions(impmap *x)
     // sort output signal pointer array
     qsort(signals, num_outputs, sizeof(mapper_signal), compare_signal_names);
 
+    impmap_offload_release(x);
+
+    // keep the old layout for remapping the snapshots
+    t_signal_ref old_layout[MAX_LIST];
+    int old_num = x->num_outputs, old_size = x->size_out;
+    memcpy(old_layout, x->signals_out, old_num * sizeof(t_signal_ref));
+
     // set offsets and user_data
     for (i = 0; i < num_outputs; i++) {
         x->signals_out[i].offset = k;
+        x->signals_out[i].length = mapper_signal_length(signals[i]);
+        x->signals_out[i].name = gensym((char *)mapper_signal_name(signals[i]));
+        x->signals_out[i].sent = 0;
         mapper_signal_set_user_data(signals[i], &x->signals_out[i]);
         k += mapper_signal_length(signals[i]);
     }
+    x->num_outputs = num_outputs;
     count = k < MAX_LIST ? k : MAX_LIST;
-    if (count != x->size_out && x->num_snapshots) {
-        post("implicitmap: output vector size has changed - resetting snapshots!");
-        impmap_clear_snapshots(x);
-    }
     x->size_out = count;
+    impmap_close_logs(x);
+    impmap_remap_snapshots(x, old_layout, old_num, old_size, 1);
+    impmap_apply_deadbands(x);
+    impmap_save_topology(x);
 }
 
 // *********************************************************
@@ -865,8 +4435,16 @@ int impmap_setup_mapper(impmap *x, const char *iface)
 {
     post("using name: %s", x->name);
     x->device = 0;
+    x->network = 0;
+
+    // use the requested interface (e.g. "lo" for soak testing) if any
+    if (iface) {
+        x->network = mapper_network_new(iface, 0, 0);
+        if (!x->network)
+            return 1;
+    }
 
-    x->device = mapper_device_new(x->name, port, 0);
+    x->device = mapper_device_new(x->name, port, x->network);
     if (!x->device)
         return 1;
 
@@ -883,6 +4461,9 @@ int impmap_setup_mapper(impmap *x, const char *iface)
 void impmap_poll(impmap *x)
 {
     mapper_device_poll(x->device, 0);
+    if (x->frame_count && x->frame_policy == FRAME_DEADLINE
+        && maxpd_get_time() - x->frame_start >= x->frame_deadline)
+        impmap_frame_complete(x);
     if (!x->ready) {
         if (mapper_device_ready(x->device)) {
             x->ready = 1;
@@ -898,11 +4479,23 @@ void impmap_poll(impmap *x)
                                                             1, 'f', 0, 0, 0, 0, x);
 
             impmap_print_properties(x);
+
+            if (x->topology)
+                impmap_restore_topology(x);
         }
     }
-    if (x->new_in) {
-        outlet_anything(x->outlet1, gensym("list"), x->size_in, x->buffer_in);
-        x->new_in = 0;
+    if (x->pending_maps && --x->pending_count <= 0) {
+        impmap_restore_maps(x);
+        x->pending_count = CONNECT_PERIOD;
+    }
+    impmap_process_input(x);
+
+    // resend everything now and then so receivers that missed an update or
+    // joined late catch up
+    if (x->delta && x->refresh > 0 && x->out_valid
+        && maxpd_get_time() - x->last_refresh >= x->refresh) {
+        impmap_send_outputs(x, x->values_out, 1);
+        x->last_refresh = maxpd_get_time();
     }
     clock_delay(x->clock, INTERVAL);  // Set clock to go off after delay
 }
@@ -911,17 +4504,47 @@ void impmap_poll(impmap *x)
 // -(poll libmapper)----------------------------------------
 void impmap_clear_snapshots(impmap *x)
 {
-    while (x->snapshots) {
-        t_snapshot temp = x->snapshots->next;
-        free(x->snapshots->inputs);
-        free(x->snapshots->outputs);
-        x->snapshots = temp;
-    }
+    impmap_free_snapshots(x->snapshots);
+    x->snapshots = 0;
     x->num_snapshots = 0;
+    x->admit_grid.valid = 0;
     outlet_anything(x->outlet2, gensym("clear"), 0, 0);
     maxpd_atom_set_int(x->buffer_in, 0);
     outlet_anything(x->outlet3, gensym("numSnapshots"), 1, x->buffer_in);
+    impmap_write_snapshot_arrays(x);
+}
+
+void impmap_free_snapshots(t_snapshot snapshots)
+{
+    while (snapshots) {
+        t_snapshot temp = snapshots->next;
+        impmap_free_snapshot(snapshots);
+        snapshots = temp;
+    }
+}
+
+void impmap_free_snapshot(t_snapshot snap)
+{
+    free(snap->inputs);
+    free(snap->outputs);
+    free(snap->packed);
+    free(snap);
+}
+
+#ifdef MAXMSP
+// *********************************************************
+// -(notify)------------------------------------------------
+t_max_err impmap_notify(impmap *x, t_symbol *s, t_symbol *msg, void *sender,
+                        void *data)
+{
+    int i;
+    for (i = 0; i < NUM_ARRAYS; i++) {
+        if (x->array_refs[i])
+            buffer_ref_notify(x->array_refs[i], s, msg, sender, data);
+    }
+    return MAX_ERR_NONE;
 }
+#endif
 
 // *********************************************************
 // some helper functions for abtracting differences
@@ -968,7 +4591,22 @@ void maxpd_atom_set_float(t_atom *a, float d)
 #endif
 }
 
-void maxpd_atom_set_float_array(t_atom *a, float *d, int length)
+int maxpd_atom_get_int_arg(int argc, t_atom *argv, int *value)
+{
+    if (!argc)
+        return 1;
+    if (argv->a_type == A_FLOAT)
+        *value = (int)atom_getfloat(argv);
+#ifdef MAXMSP
+    else if (argv->a_type == A_LONG)
+        *value = atom_getlong(argv);
+#endif
+    else
+        return 1;
+    return 0;
+}
+
+void maxpd_atom_set_float_array(t_atom *a, const float *d, int length)
 {
 #ifdef MAXMSP
     atom_setfloat_array(length, a, length, d);
@@ -979,3 +4617,105 @@ void maxpd_atom_set_float_array(t_atom *a, float *d, int length)
     }
 #endif
 }
+
+double maxpd_get_time(void)
+{
+#ifdef MAXMSP
+    return (double)gettime();
+#else
+    return clock_gettimesince(0);
+#endif
+}
+
+// wall-clock ms, for timing work done within one scheduler tick
+double maxpd_get_real_time(void)
+{
+#ifdef MAXMSP
+    return (double)systime_ms();
+#else
+    return sys_getrealtime() * 1000.;
+#endif
+}
+
+// Reads the first channel of a Max buffer~ or a Pd float array into a new
+// vector.  Returns its length or -1.
+int maxpd_array_read(impmap *x, t_symbol *name, float **values)
+{
+    int i, length;
+#ifdef MAXMSP
+    t_buffer_ref *ref = buffer_ref_new((t_object *)x, name);
+    t_buffer_obj *b = buffer_ref_getobject(ref);
+    float *samples;
+    long channels;
+    if (!b || !(samples = buffer_locksamples(b))) {
+        post("implicitmap: no buffer~ named '%s'", name->s_name);
+        object_free(ref);
+        return -1;
+    }
+    length = (int)buffer_getframecount(b);
+    channels = buffer_getchannelcount(b);
+    *values = malloc((length + 1) * sizeof(float));
+    for (i = 0; i < length; i++)
+        (*values)[i] = samples[i * channels];
+    buffer_unlocksamples(b);
+    object_free(ref);
+#else
+    t_garray *a = (t_garray *)pd_findbyclass(name, garray_class);
+    t_word *vec;
+    if (!a || !garray_getfloatwords(a, &length, &vec)) {
+        post("implicitmap: no float array named '%s'", name->s_name);
+        return -1;
+    }
+    *values = malloc((length + 1) * sizeof(float));
+    for (i = 0; i < length; i++)
+        (*values)[i] = vec[i].w_float;
+#endif
+    return length;
+}
+
+// Writes a vector into the first channel of a Max buffer~, up to its length,
+// or into a Pd float array, which is resized to fit.  In Max an existing
+// buffer reference may be passed to avoid looking the buffer up again.
+int maxpd_array_write(impmap *x, t_symbol *name, void *ref,
+                      const float *values, int length)
+{
+    int i;
+#ifdef MAXMSP
+    t_buffer_ref *temp = ref ? 0 : buffer_ref_new((t_object *)x, name);
+    t_buffer_obj *b = buffer_ref_getobject(ref ? ref : temp);
+    float *samples;
+    long frames, channels;
+    if (!b || !(samples = buffer_locksamples(b))) {
+        if (temp)
+            object_free(temp);
+        return 1;
+    }
+    frames = buffer_getframecount(b);
+    channels = buffer_getchannelcount(b);
+    for (i = 0; i < length && i < frames; i++)
+        samples[i * channels] = values[i];
+    buffer_unlocksamples(b);
+    buffer_setdirty(b);
+    if (temp)
+        object_free(temp);
+#else
+    t_garray *a = (t_garray *)pd_findbyclass(name, garray_class);
+    t_word *vec;
+    int size;
+    if (!a) {
+        post("implicitmap: no array named '%s'", name->s_name);
+        return 1;
+    }
+    // Pd arrays cannot be empty
+    if (garray_npoints(a) != (length > 0 ? length : 1))
+        garray_resize(a, length > 0 ? length : 1);
+    if (!garray_getfloatwords(a, &size, &vec)) {
+        post("implicitmap: '%s' is not a float array", name->s_name);
+        return 1;
+    }
+    for (i = 0; i < size; i++)
+        vec[i].w_float = i < length ? values[i] : 0;
+    garray_redraw(a);
+#endif
+    return 0;
+}
@@ -0,0 +1,481 @@
+//
+// implicitmap_loadgen.c
+// a synthetic libmapper load generator for soak testing implicitmap
+// http://www.idmil.org/software/libmapper
+//
+// Spawns a number of source devices whose output signals update at a fixed
+// rate, plus destination devices whose input signals answer snapshot
+// queries, all on one network interface (loopback by default).  Once the
+// target implicitmap device appears every source signal is mapped to its
+// CONNECT_TO_SOURCE signal and every destination signal is mapped from its
+// CONNECT_TO_DESTINATION signal, so implicitmap builds its vectors exactly
+// as it would for a session manager.  Delivered rate and loss are measured
+// on the destination side and printed periodically.
+//
+// implicitmap stamps its outputs with its own timetags, so updates cannot
+// be matched to the source ticks that caused them.  Loss is instead the
+// shortfall against one output frame per source tick, which only holds when
+// a model (or the patch) evaluates every input frame and sends every
+// output.  Anything that suppresses sends on purpose -- delta output,
+// deadbands, frame policies, muted outputs -- shows up as loss.
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+// *********************************************************
+// -(Includes)----------------------------------------------
+
+#include "mapper/mapper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define MAX_DEVICES 64
+#define MAX_SIGNALS 256
+
+// *********************************************************
+// -(structs)-----------------------------------------------
+typedef struct _loadgen_dst_sig
+{
+    mapper_signal sig;
+    long received;              // updates since the last report
+    long total;                 // updates since the maps were created
+    mapper_timetag_t last_tt;
+} t_loadgen_dst_sig;
+
+typedef struct _loadgen_dev
+{
+    mapper_device device;
+    mapper_signal signals[MAX_SIGNALS];
+    t_loadgen_dst_sig *dst_sigs;
+    int num_signals;
+} t_loadgen_dev;
+
+typedef struct _loadgen
+{
+    const char *iface;
+    const char *target;
+    int num_sources;
+    int num_src_signals;
+    int src_length;
+    int num_dests;
+    int num_dst_signals;
+    double rate;
+    double duration;
+    double report_interval;
+
+    mapper_network network;
+    mapper_database db;
+    t_loadgen_dev sources[MAX_DEVICES];
+    t_loadgen_dev dests[MAX_DEVICES];
+    int mapped;
+    long sent;                  // source updates since the last report
+    long total_sent;
+} t_loadgen;
+
+static volatile int done = 0;
+
+// *********************************************************
+// -(function prototypes)-----------------------------------
+static void loadgen_usage(const char *name);
+static int loadgen_setup(t_loadgen *lg);
+static void loadgen_free(t_loadgen *lg);
+static int loadgen_map(t_loadgen *lg);
+static void loadgen_poll(t_loadgen *lg, int block_ms);
+static void loadgen_update_sources(t_loadgen *lg, double now);
+static void loadgen_report(t_loadgen *lg, double elapsed, double period);
+static void loadgen_on_input(mapper_signal sig, mapper_id instance,
+                             const void *value, int count, mapper_timetag_t *tt);
+static void loadgen_on_signal(int sig);
+
+// *********************************************************
+// -(main)--------------------------------------------------
+int main(int argc, char **argv)
+{
+    t_loadgen lg;
+    int c;
+
+    memset(&lg, 0, sizeof(lg));
+    lg.iface = "lo";
+    lg.target = "implicitmap.1";
+    lg.num_sources = 1;
+    lg.num_src_signals = 8;
+    lg.src_length = 1;
+    lg.num_dests = 1;
+    lg.num_dst_signals = 8;
+    lg.rate = 100;
+    lg.duration = 0;
+    lg.report_interval = 1;
+
+    while ((c = getopt(argc, argv, "i:t:n:m:l:d:o:r:T:R:h")) != -1) {
+        switch (c) {
+            case 'i':
+                lg.iface = optarg;
+                break;
+            case 't':
+                lg.target = optarg;
+                break;
+            case 'n':
+                lg.num_sources = atoi(optarg);
+                break;
+            case 'm':
+                lg.num_src_signals = atoi(optarg);
+                break;
+            case 'l':
+                lg.src_length = atoi(optarg);
+                break;
+            case 'd':
+                lg.num_dests = atoi(optarg);
+                break;
+            case 'o':
+                lg.num_dst_signals = atoi(optarg);
+                break;
+            case 'r':
+                lg.rate = atof(optarg);
+                break;
+            case 'T':
+                lg.duration = atof(optarg);
+                break;
+            case 'R':
+                lg.report_interval = atof(optarg);
+                break;
+            default:
+                loadgen_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (lg.num_sources < 0 || lg.num_sources > MAX_DEVICES
+        || lg.num_dests < 0 || lg.num_dests > MAX_DEVICES
+        || lg.num_src_signals < 1 || lg.num_src_signals > MAX_SIGNALS
+        || lg.num_dst_signals < 1 || lg.num_dst_signals > MAX_SIGNALS
+        || lg.src_length < 1 || lg.rate <= 0 || lg.report_interval <= 0) {
+        loadgen_usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, loadgen_on_signal);
+    signal(SIGTERM, loadgen_on_signal);
+
+    if (loadgen_setup(&lg)) {
+        fprintf(stderr, "loadgen: error initializing devices\n");
+        loadgen_free(&lg);
+        return 1;
+    }
+
+    printf("loadgen: %d x %d source signals (length %d) at %g Hz, "
+           "%d x %d destination signals on '%s'\n", lg.num_sources,
+           lg.num_src_signals, lg.src_length, lg.rate, lg.num_dests,
+           lg.num_dst_signals, lg.iface);
+    printf("loadgen: loss is measured against one output frame per tick\n");
+    printf("loadgen: waiting for '%s'...\n", lg.target);
+
+    mapper_timetag_t start, now, next_tick, last_report;
+    double period = 1.0 / lg.rate;
+    double elapsed;
+
+    while (!done && !lg.mapped) {
+        loadgen_poll(&lg, 100);
+        lg.mapped = !loadgen_map(&lg);
+    }
+
+    mapper_timetag_now(&start);
+    next_tick = last_report = start;
+    while (!done) {
+        mapper_timetag_now(&now);
+        elapsed = mapper_timetag_difference(now, start);
+        if (lg.duration > 0 && elapsed >= lg.duration)
+            break;
+
+        if (mapper_timetag_difference(now, next_tick) >= 0) {
+            loadgen_update_sources(&lg, elapsed);
+            mapper_timetag_add_double(&next_tick, period);
+            // don't try to catch up if we fell more than one tick behind
+            if (mapper_timetag_difference(now, next_tick) > period)
+                next_tick = now;
+        }
+
+        if (mapper_timetag_difference(now, last_report) >= lg.report_interval) {
+            loadgen_report(&lg, elapsed, mapper_timetag_difference(now, last_report));
+            last_report = now;
+        }
+
+        loadgen_poll(&lg, 0);
+
+        // sleep for the remainder of the tick
+        double wait = -mapper_timetag_difference(now, next_tick);
+        if (wait > 0.001)
+            usleep((useconds_t)(wait * 1000000 * 0.5));
+    }
+
+    mapper_timetag_now(&now);
+    elapsed = mapper_timetag_difference(now, start);
+    printf("loadgen: summary after %.1f seconds\n", elapsed);
+    loadgen_report(&lg, elapsed, -1);
+
+    loadgen_free(&lg);
+    return 0;
+}
+
+// *********************************************************
+// -(usage)-------------------------------------------------
+void loadgen_usage(const char *name)
+{
+    printf("usage: %s [options]\n"
+           "  -i <iface>    network interface (default lo)\n"
+           "  -t <device>   implicitmap device name (default implicitmap.1)\n"
+           "  -n <count>    number of source devices (default 1, max %d)\n"
+           "  -m <count>    signals per source device (default 8, max %d)\n"
+           "  -l <length>   vector length of each source signal (default 1)\n"
+           "  -d <count>    number of destination devices (default 1, max %d)\n"
+           "  -o <count>    signals per destination device (default 8, max %d)\n"
+           "  -r <hz>       source update rate (default 100)\n"
+           "  -T <seconds>  stop after this long (default run until interrupted)\n"
+           "  -R <seconds>  report interval (default 1)\n",
+           name, MAX_DEVICES, MAX_SIGNALS, MAX_DEVICES, MAX_SIGNALS);
+}
+
+// *********************************************************
+// -(signal handler)----------------------------------------
+void loadgen_on_signal(int sig)
+{
+    done = 1;
+}
+
+// *********************************************************
+// -(set up devices)----------------------------------------
+int loadgen_setup(t_loadgen *lg)
+{
+    int i, j;
+    char name[64];
+    float *min, *max, init;
+
+    lg->network = mapper_network_new(lg->iface, 0, 0);
+    if (!lg->network)
+        return 1;
+
+    lg->db = mapper_database_new(lg->network, MAPPER_OBJ_DEVICES);
+    if (!lg->db)
+        return 1;
+
+    min = alloca(lg->src_length * sizeof(float));
+    max = alloca(lg->src_length * sizeof(float));
+    for (i = 0; i < lg->src_length; i++) {
+        min[i] = 0.f;
+        max[i] = 1.f;
+    }
+
+    for (i = 0; i < lg->num_sources; i++) {
+        t_loadgen_dev *dev = &lg->sources[i];
+        dev->device = mapper_device_new("loadgen_src", 0, lg->network);
+        if (!dev->device)
+            return 1;
+        for (j = 0; j < lg->num_src_signals; j++) {
+            snprintf(name, 64, "out.%03d", j);
+            dev->signals[j] = mapper_device_add_output_signal(dev->device, name,
+                                                              lg->src_length,
+                                                              'f', 0, min, max);
+        }
+        dev->num_signals = lg->num_src_signals;
+    }
+
+    for (i = 0; i < lg->num_dests; i++) {
+        t_loadgen_dev *dev = &lg->dests[i];
+        dev->device = mapper_device_new("loadgen_dst", 0, lg->network);
+        if (!dev->device)
+            return 1;
+        dev->dst_sigs = calloc(lg->num_dst_signals, sizeof(t_loadgen_dst_sig));
+        for (j = 0; j < lg->num_dst_signals; j++) {
+            snprintf(name, 64, "in.%03d", j);
+            dev->signals[j] = mapper_device_add_input_signal(dev->device, name,
+                                                             1, 'f', 0, min, max,
+                                                             loadgen_on_input,
+                                                             &dev->dst_sigs[j]);
+            dev->dst_sigs[j].sig = dev->signals[j];
+        }
+        dev->num_signals = lg->num_dst_signals;
+    }
+
+    // wait for all devices to be ready, then give destination signals a
+    // value so that snapshot queries are answered
+    int ready = 0;
+    while (!done && !ready) {
+        loadgen_poll(lg, 10);
+        ready = 1;
+        for (i = 0; i < lg->num_sources; i++)
+            ready &= mapper_device_ready(lg->sources[i].device);
+        for (i = 0; i < lg->num_dests; i++)
+            ready &= mapper_device_ready(lg->dests[i].device);
+    }
+    for (i = 0; i < lg->num_dests; i++) {
+        for (j = 0; j < lg->dests[i].num_signals; j++) {
+            init = (float)rand() / (float)RAND_MAX;
+            mapper_signal_update(lg->dests[i].signals[j], &init, 1, MAPPER_NOW);
+        }
+    }
+    return done;
+}
+
+// *********************************************************
+// -(free devices)------------------------------------------
+void loadgen_free(t_loadgen *lg)
+{
+    int i;
+    for (i = 0; i < lg->num_sources; i++) {
+        if (lg->sources[i].device)
+            mapper_device_free(lg->sources[i].device);
+    }
+    for (i = 0; i < lg->num_dests; i++) {
+        if (lg->dests[i].device)
+            mapper_device_free(lg->dests[i].device);
+        if (lg->dests[i].dst_sigs)
+            free(lg->dests[i].dst_sigs);
+    }
+    if (lg->db)
+        mapper_database_free(lg->db);
+    if (lg->network)
+        mapper_network_free(lg->network);
+}
+
+// *********************************************************
+// -(map generated signals to implicitmap)------------------
+int loadgen_map(t_loadgen *lg)
+{
+    int i, j;
+    mapper_device target = mapper_database_device_by_name(lg->db, lg->target);
+    if (!target)
+        return 1;
+
+    // we need the target's signals before we can map to them
+    mapper_database_subscribe(lg->db, target, MAPPER_OBJ_SIGNALS, -1);
+    mapper_signal to_source = mapper_device_signal_by_name(target,
+                                                           "CONNECT_TO_SOURCE");
+    mapper_signal to_dest = mapper_device_signal_by_name(target,
+                                                         "CONNECT_TO_DESTINATION");
+    if (!to_source || !to_dest)
+        return 1;
+
+    for (i = 0; i < lg->num_sources; i++) {
+        for (j = 0; j < lg->sources[i].num_signals; j++) {
+            mapper_map map = mapper_map_new(1, &lg->sources[i].signals[j],
+                                            1, &to_source);
+            mapper_map_push(map);
+        }
+    }
+    for (i = 0; i < lg->num_dests; i++) {
+        for (j = 0; j < lg->dests[i].num_signals; j++) {
+            mapper_map map = mapper_map_new(1, &to_dest, 1,
+                                            &lg->dests[i].signals[j]);
+            mapper_map_push(map);
+        }
+    }
+    printf("loadgen: requested %d source and %d destination maps\n",
+           lg->num_sources * lg->num_src_signals,
+           lg->num_dests * lg->num_dst_signals);
+    return 0;
+}
+
+// *********************************************************
+// -(poll all devices)--------------------------------------
+void loadgen_poll(t_loadgen *lg, int block_ms)
+{
+    int i;
+    for (i = 0; i < lg->num_sources; i++)
+        mapper_device_poll(lg->sources[i].device, 0);
+    for (i = 0; i < lg->num_dests; i++)
+        mapper_device_poll(lg->dests[i].device, 0);
+    mapper_database_poll(lg->db, block_ms);
+}
+
+// *********************************************************
+// -(update source signals)---------------------------------
+void loadgen_update_sources(t_loadgen *lg, double now)
+{
+    int i, j, k, len = lg->src_length;
+    float v[len];
+    mapper_timetag_t tt;
+
+    mapper_timetag_now(&tt);
+    for (i = 0; i < lg->num_sources; i++) {
+        t_loadgen_dev *dev = &lg->sources[i];
+        // one bundle per device and tick, as a real controller would send
+        mapper_device_start_queue(dev->device, tt);
+        for (j = 0; j < dev->num_signals; j++) {
+            // slow sinusoids with a different phase for each element
+            for (k = 0; k < len; k++) {
+                double phase = (double)(i * dev->num_signals * len + j * len + k);
+                v[k] = 0.5f + 0.5f * (float)sin(now * 0.5 + phase * 0.37);
+            }
+            mapper_signal_update(dev->signals[j], v, 1, tt);
+        }
+        mapper_device_send_queue(dev->device, tt);
+        lg->sent += dev->num_signals;
+    }
+}
+
+// *********************************************************
+// -(destination handler)-----------------------------------
+void loadgen_on_input(mapper_signal sig, mapper_id instance, const void *value,
+                      int count, mapper_timetag_t *tt)
+{
+    t_loadgen_dst_sig *ref = mapper_signal_user_data(sig);
+    if (!ref || !value)
+        return;
+    ref->received++;
+    ref->total++;
+    if (tt)
+        ref->last_tt = *tt;
+}
+
+// *********************************************************
+// -(report delivered rate and loss)------------------------
+// Loss is against the source rate (see the file header).  A negative
+// period prints totals since the maps were created.
+void loadgen_report(t_loadgen *lg, double elapsed, double period)
+{
+    int i, j;
+    long received = 0, min_received = -1, max_received = 0;
+    int num_sigs = 0;
+    double interval = period > 0 ? period : elapsed;
+    long sent = period > 0 ? lg->sent : lg->total_sent + lg->sent;
+
+    if (interval <= 0)
+        return;
+
+    for (i = 0; i < lg->num_dests; i++) {
+        for (j = 0; j < lg->dests[i].num_signals; j++) {
+            t_loadgen_dst_sig *ref = &lg->dests[i].dst_sigs[j];
+            long n = period > 0 ? ref->received : ref->total;
+            received += n;
+            if (min_received < 0 || n < min_received)
+                min_received = n;
+            if (n > max_received)
+                max_received = n;
+            ref->received = 0;
+            num_sigs++;
+        }
+    }
+
+    double expected = lg->rate * interval;
+    double mean = num_sigs ? (double)received / num_sigs : 0;
+    double loss = expected > 0 ? 1.0 - mean / expected : 0;
+    if (loss < 0)
+        loss = 0;
+
+    printf("%8.1fs  sent %8.1f upd/s  delivered %8.1f upd/s  "
+           "per-signal %.1f Hz (min %.1f, max %.1f)  "
+           "loss %5.1f%% (of %.1f Hz expected)\n",
+           elapsed, sent / interval, received / interval, mean / interval,
+           min_received < 0 ? 0 : min_received / interval,
+           max_received / interval, loss * 100.0, lg->rate);
+    fflush(stdout);
+
+    lg->total_sent += lg->sent;
+    lg->sent = 0;
+}
@@ -0,0 +1,654 @@
+//
+// implicitmapd.c
+// a headless host for the implicitmap object
+// http://www.idmil.org/software/libmapper
+//
+// Builds implicitmap.c against a small implementation of the Pd external
+// API (see implicitmapd.h) instead of Pd itself, so one libmapper device with
+// its snapshots and native engine can run on its own.  The daemon reads an
+// optional config file, can pin itself to a CPU and use real-time
+// scheduling, and accepts the object's messages as lines of text on a
+// Unix-domain datagram socket, e.g.
+//
+//     echo "snapshot" | socat - UNIX-SENDTO:/tmp/implicitmapd.sock
+//
+// The socket is created readable and writable by the daemon's user only,
+// since messages such as "export <file>" write files with the daemon's
+// privileges; change its group and mode to let others control it.
+// Anything the object outputs is printed as "<outlet> <selector> <args>"
+// and sent back to the most recent control client that has an address.
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+// *********************************************************
+// -(Includes)----------------------------------------------
+
+#ifdef __linux__
+    #define _GNU_SOURCE         // for sched_setaffinity()
+#endif
+#include "implicitmapd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define MAX_METHODS     64
+#define MAX_ARGS        1024
+#define MAX_MESSAGE     8192
+#define MAX_STARTUP     64
+#define SYMBOL_BUCKETS  1024
+#define MAX_WAIT        100     // ms between checks when no clock is set
+
+// *********************************************************
+// -(host structs)------------------------------------------
+typedef struct _method
+{
+    t_symbol *sel;
+    t_method fn;
+} t_daemon_method;
+
+struct _class
+{
+    t_symbol *name;
+    t_newmethod newmethod;
+    t_method freemethod;
+    size_t size;
+    int num_methods;
+    t_daemon_method methods[MAX_METHODS];
+};
+
+struct _outlet
+{
+    t_object *owner;
+    int index;
+};
+
+struct _clock
+{
+    void *owner;
+    t_method fn;
+    double due;                 // ms on the daemon clock
+    int set;
+    struct _clock *next;
+};
+
+typedef struct _daemon
+{
+    const char *alias;
+    const char *iface;
+    const char *topology;       // file the signal set is kept in
+    int cpu;                    // -1 to leave affinity alone
+    int priority;               // SCHED_FIFO priority, 0 for normal
+    const char *control_path;   // control socket, 0 to disable
+    int verbose;
+    char *startup[MAX_STARTUP]; // messages sent once the object exists
+    int num_startup;
+
+    t_class *cls;
+    t_object *object;
+    int control;                // control socket
+    struct sockaddr_un client;  // most recent control client
+    socklen_t client_length;
+    int have_client;
+} t_daemon;
+
+// *********************************************************
+// -(globals)-----------------------------------------------
+static t_daemon daemon_state;
+static t_symbol *symbols[SYMBOL_BUCKETS];
+static struct _clock *clocks = 0;
+static struct timespec start_time;
+static volatile int done = 0;
+t_class *garray_class = 0;
+
+int implicitmap_setup(void);
+
+// *********************************************************
+// -(function prototypes)-----------------------------------
+static void daemon_usage(const char *name);
+static int daemon_read_config(t_daemon *d, const char *path);
+static void daemon_set(t_daemon *d, const char *key, const char *value);
+static void daemon_schedule(t_daemon *d);
+static int daemon_open_control(t_daemon *d);
+static void daemon_read_control(t_daemon *d);
+static void daemon_send(t_daemon *d, char *message);
+static int daemon_run_clocks(void);
+static double daemon_now(void);
+static void daemon_on_signal(int sig);
+
+// *********************************************************
+// -(main)--------------------------------------------------
+int main(int argc, char **argv)
+{
+    t_daemon *d = &daemon_state;
+    t_atom args[6];
+    int c, i, num_args = 0;
+    const char *config = 0;
+
+    d->cpu = -1;
+    d->control_path = "/tmp/implicitmapd.sock";
+    d->control = -1;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    // the config file is read first so that options can override it
+    while ((c = getopt(argc, argv, "c:a:i:C:P:p:vh")) != -1) {
+        if (c == 'c')
+            config = optarg;
+    }
+    if (config && daemon_read_config(d, config)) {
+        fprintf(stderr, "implicitmapd: could not read '%s'\n", config);
+        return 1;
+    }
+    optind = 1;
+    while ((c = getopt(argc, argv, "c:a:i:C:P:p:vh")) != -1) {
+        switch (c) {
+            case 'c':
+                break;
+            case 'a':
+                daemon_set(d, "alias", optarg);
+                break;
+            case 'i':
+                daemon_set(d, "interface", optarg);
+                break;
+            case 'C':
+                daemon_set(d, "cpu", optarg);
+                break;
+            case 'P':
+                daemon_set(d, "priority", optarg);
+                break;
+            case 'p':
+                daemon_set(d, "control", optarg);
+                break;
+            case 'v':
+                d->verbose = 1;
+                break;
+            default:
+                daemon_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    signal(SIGINT, daemon_on_signal);
+    signal(SIGTERM, daemon_on_signal);
+    daemon_schedule(d);
+    if (d->control_path && daemon_open_control(d))
+        return 1;
+
+    implicitmap_setup();
+    if (!d->cls) {
+        fprintf(stderr, "implicitmapd: object class was not registered\n");
+        return 1;
+    }
+    if (d->alias) {
+        SETSYMBOL(args + num_args, gensym("@alias"));
+        SETSYMBOL(args + num_args + 1, gensym(d->alias));
+        num_args += 2;
+    }
+    if (d->iface) {
+        SETSYMBOL(args + num_args, gensym("@interface"));
+        SETSYMBOL(args + num_args + 1, gensym(d->iface));
+        num_args += 2;
+    }
+    if (d->topology) {
+        SETSYMBOL(args + num_args, gensym("@topology"));
+        SETSYMBOL(args + num_args + 1, gensym(d->topology));
+        num_args += 2;
+    }
+    d->object = ((void *(*)(t_symbol *, int, t_atom *))
+                 (void (*)(void))d->cls->newmethod)(d->cls->name, num_args,
+                                                    args);
+    if (!d->object) {
+        fprintf(stderr, "implicitmapd: could not create object\n");
+        return 1;
+    }
+    for (i = 0; i < d->num_startup; i++)
+        daemon_send(d, d->startup[i]);
+
+    while (!done) {
+        int wait = daemon_run_clocks();
+        struct pollfd pfd = {d->control, POLLIN, 0};
+        if (d->control < 0) {
+            poll(0, 0, wait);
+            continue;
+        }
+        if (poll(&pfd, 1, wait) > 0 && (pfd.revents & POLLIN))
+            daemon_read_control(d);
+    }
+
+    if (d->cls->freemethod)
+        ((void (*)(t_object *))d->cls->freemethod)(d->object);
+    free(d->object);
+    if (d->control >= 0) {
+        close(d->control);
+        unlink(d->control_path);
+    }
+    for (i = 0; i < d->num_startup; i++)
+        free(d->startup[i]);
+    return 0;
+}
+
+// *********************************************************
+// -(usage)-------------------------------------------------
+void daemon_usage(const char *name)
+{
+    printf("usage: %s [options]\n"
+           "  -c <file>     config file of '<key> <value>' lines\n"
+           "  -a <alias>    device name (default implicitmap)\n"
+           "  -i <iface>    network interface\n"
+           "  -C <cpu>      pin the daemon to one CPU\n"
+           "  -P <prio>     run with SCHED_FIFO at this priority\n"
+           "  -p <path>     control socket, 'none' to disable"
+           " (default /tmp/implicitmapd.sock)\n"
+           "  -v            print everything the object outputs\n"
+           "config keys: alias, interface, topology, cpu, priority, control,\n"
+           "verbose, and 'send <message>' to send a message once the object\n"
+           "exists\n",
+           name);
+}
+
+// *********************************************************
+// -(config)------------------------------------------------
+int daemon_read_config(t_daemon *d, const char *path)
+{
+    char line[MAX_MESSAGE];
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return 1;
+    while (fgets(line, sizeof(line), file)) {
+        char *key = line, *value;
+        line[strcspn(line, "\r\n")] = 0;
+        key += strspn(key, " \t");
+        if (!*key || *key == '#')
+            continue;
+        value = key + strcspn(key, " \t");
+        if (*value)
+            *value++ = 0;
+        value += strspn(value, " \t");
+        daemon_set(d, key, value);
+    }
+    fclose(file);
+    return 0;
+}
+
+void daemon_set(t_daemon *d, const char *key, const char *value)
+{
+    if (strcmp(key, "alias") == 0)
+        d->alias = strdup(value);
+    else if (strcmp(key, "interface") == 0)
+        d->iface = strdup(value);
+    else if (strcmp(key, "topology") == 0)
+        d->topology = strdup(value);
+    else if (strcmp(key, "cpu") == 0)
+        d->cpu = atoi(value);
+    else if (strcmp(key, "priority") == 0)
+        d->priority = atoi(value);
+    else if (strcmp(key, "control") == 0)
+        d->control_path = strcmp(value, "none") == 0 ? 0 : strdup(value);
+    else if (strcmp(key, "verbose") == 0)
+        d->verbose = atoi(value);
+    else if (strcmp(key, "send") == 0) {
+        if (d->num_startup < MAX_STARTUP)
+            d->startup[d->num_startup++] = strdup(value);
+    }
+    else
+        fprintf(stderr, "implicitmapd: unknown config key '%s'\n", key);
+}
+
+// *********************************************************
+// -(CPU affinity and real-time scheduling)-----------------
+// Failures are reported but not fatal, since both usually need privileges.
+void daemon_schedule(t_daemon *d)
+{
+#ifdef __linux__
+    if (d->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(d->cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set))
+            perror("implicitmapd: sched_setaffinity");
+    }
+#else
+    if (d->cpu >= 0)
+        fprintf(stderr, "implicitmapd: CPU pinning is not supported here\n");
+#endif
+    if (d->priority > 0) {
+        struct sched_param param;
+        param.sched_priority = d->priority;
+        if (sched_setscheduler(0, SCHED_FIFO, &param))
+            perror("implicitmapd: sched_setscheduler");
+        // avoid page faults on the real-time path
+        if (mlockall(MCL_CURRENT | MCL_FUTURE))
+            perror("implicitmapd: mlockall");
+    }
+}
+
+// *********************************************************
+// -(control socket)----------------------------------------
+// A stale socket left by a previous run is replaced.  The umask makes the
+// socket private from the moment it exists.
+int daemon_open_control(t_daemon *d)
+{
+    struct sockaddr_un addr;
+    mode_t mask;
+    int result;
+
+    if (strlen(d->control_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "implicitmapd: control path '%s' is too long\n",
+                d->control_path);
+        return 1;
+    }
+    d->control = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (d->control < 0) {
+        perror("implicitmapd: socket");
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, d->control_path);
+    unlink(d->control_path);
+    mask = umask(0177);
+    result = bind(d->control, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (result) {
+        perror("implicitmapd: bind");
+        close(d->control);
+        d->control = -1;
+        return 1;
+    }
+    return 0;
+}
+
+// Each datagram holds one or more messages separated by newlines or ';'.
+void daemon_read_control(t_daemon *d)
+{
+    char buffer[MAX_MESSAGE], *message, *next;
+    struct sockaddr_un client;
+    socklen_t length = sizeof(client);
+    ssize_t size = recvfrom(d->control, buffer, sizeof(buffer) - 1, 0,
+                            (struct sockaddr *)&client, &length);
+    if (size <= 0)
+        return;
+    // clients that did not bind an address of their own cannot get replies
+    if (length > offsetof(struct sockaddr_un, sun_path)) {
+        d->client = client;
+        d->client_length = length;
+        d->have_client = 1;
+    }
+    buffer[size] = 0;
+    for (message = buffer; message; message = next) {
+        next = message + strcspn(message, "\n;");
+        next = *next ? (*next = 0, next + 1) : 0;
+        daemon_send(d, message);
+    }
+}
+
+// *********************************************************
+// -(dispatch a message to the object)----------------------
+// Words that parse as numbers become floats.  A message starting with a
+// number is a list, as in Pd.
+void daemon_send(t_daemon *d, char *message)
+{
+    t_atom argv[MAX_ARGS];
+    t_symbol *sel = 0;
+    char *word, *save;
+    int i, argc = 0;
+
+    for (word = strtok_r(message, " \t", &save); word && argc < MAX_ARGS;
+         word = strtok_r(0, " \t", &save)) {
+        char *end;
+        float f = strtof(word, &end);
+        if (!sel && *end) {
+            sel = gensym(word);
+            continue;
+        }
+        if (!sel)
+            sel = gensym("list");
+        if (*end)
+            SETSYMBOL(argv + argc, gensym(word));
+        else
+            SETFLOAT(argv + argc, f);
+        argc++;
+    }
+    if (!sel)
+        return;
+    for (i = 0; i < d->cls->num_methods; i++) {
+        if (d->cls->methods[i].sel == sel) {
+            ((void (*)(t_object *, t_symbol *, int, t_atom *))
+             d->cls->methods[i].fn)(d->object, sel, argc, argv);
+            return;
+        }
+    }
+    post("implicitmapd: no method for '%s'", sel->s_name);
+}
+
+// *********************************************************
+// -(clocks)------------------------------------------------
+// Runs every clock that is due, each at most once so that a clock that
+// re-arms itself with no delay cannot starve the control socket.  Returns
+// the ms to wait until the next one.
+int daemon_run_clocks(void)
+{
+    struct _clock *c;
+    double now = daemon_now(), next = now + MAX_WAIT;
+    int count = 0, limit = 0;
+
+    for (c = clocks; c; c = c->next)
+        limit++;
+    while (count++ < limit) {
+        struct _clock *due = 0;
+        for (c = clocks; c; c = c->next) {
+            if (c->set && c->due <= now && (!due || c->due < due->due))
+                due = c;
+        }
+        if (!due)
+            break;
+        due->set = 0;
+        ((void (*)(void *))due->fn)(due->owner);
+    }
+    now = daemon_now();
+    for (c = clocks; c; c = c->next) {
+        if (c->set && c->due < next)
+            next = c->due;
+    }
+    return next > now ? (int)(next - now + 0.999) : 0;
+}
+
+double daemon_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start_time.tv_sec) * 1000.
+           + (now.tv_nsec - start_time.tv_nsec) / 1000000.;
+}
+
+void daemon_on_signal(int sig)
+{
+    done = 1;
+}
+
+// *********************************************************
+// the host API used by implicitmap.c, in the order of implicitmapd.h
+
+t_symbol *gensym(const char *s)
+{
+    unsigned int hash = 5381;
+    const char *c;
+    t_symbol *sym;
+    for (c = s; *c; c++)
+        hash = hash * 33 + (unsigned char)*c;
+    for (sym = symbols[hash % SYMBOL_BUCKETS]; sym; sym = sym->s_next) {
+        if (strcmp(sym->s_name, s) == 0)
+            return sym;
+    }
+    sym = malloc(sizeof(t_symbol));
+    sym->s_name = strdup(s);
+    sym->s_next = symbols[hash % SYMBOL_BUCKETS];
+    symbols[hash % SYMBOL_BUCKETS] = sym;
+    return sym;
+}
+
+void post(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+t_float atom_getfloat(const t_atom *a)
+{
+    return a->a_type == A_FLOAT ? a->a_w.w_float : 0;
+}
+
+t_class *class_new(t_symbol *name, t_newmethod newmethod, t_method freemethod,
+                   size_t size, int flags, t_atomtype arg1, ...)
+{
+    t_class *c = calloc(1, sizeof(t_class));
+    c->name = name;
+    c->newmethod = newmethod;
+    c->freemethod = freemethod;
+    c->size = size;
+    daemon_state.cls = c;
+    return c;
+}
+
+void class_addmethod(t_class *c, t_method fn, t_symbol *sel,
+                     t_atomtype arg1, ...)
+{
+    if (c->num_methods >= MAX_METHODS) {
+        post("implicitmapd: too many methods, ignoring '%s'", sel->s_name);
+        return;
+    }
+    c->methods[c->num_methods].sel = sel;
+    c->methods[c->num_methods++].fn = fn;
+}
+
+void *pd_new(t_class *c)
+{
+    t_object *x = calloc(1, c->size);
+    x->ob_pd = c;
+    return x;
+}
+
+t_outlet *outlet_new(t_object *owner, t_symbol *s)
+{
+    static t_object *last_owner = 0;
+    static int count = 0;
+    t_outlet *o = malloc(sizeof(t_outlet));
+    if (owner != last_owner) {
+        last_owner = owner;
+        count = 0;
+    }
+    o->owner = owner;
+    o->index = count++;
+    return o;
+}
+
+void outlet_anything(t_outlet *o, t_symbol *s, int argc, t_atom *argv)
+{
+    t_daemon *d = &daemon_state;
+    char buffer[MAX_MESSAGE];
+    int i, length;
+
+    if (!d->verbose && !d->have_client)
+        return;
+    length = snprintf(buffer, sizeof(buffer), "%i %s", o->index, s->s_name);
+    for (i = 0; i < argc && length < MAX_MESSAGE - 1; i++) {
+        if (argv[i].a_type == A_FLOAT)
+            length += snprintf(buffer + length, sizeof(buffer) - length,
+                               " %g", argv[i].a_w.w_float);
+        else if (argv[i].a_type == A_SYMBOL)
+            length += snprintf(buffer + length, sizeof(buffer) - length,
+                               " %s", argv[i].a_w.w_symbol->s_name);
+    }
+    if (length > MAX_MESSAGE - 2)
+        length = MAX_MESSAGE - 2;
+    buffer[length++] = '\n';
+    buffer[length] = 0;
+    if (d->verbose)
+        fputs(buffer, stdout);
+    if (d->have_client)
+        sendto(d->control, buffer, length, 0, (struct sockaddr *)&d->client,
+               d->client_length);
+}
+
+t_clock *clock_new(void *owner, t_method fn)
+{
+    t_clock *c = calloc(1, sizeof(t_clock));
+    c->owner = owner;
+    c->fn = fn;
+    c->next = clocks;
+    clocks = c;
+    return c;
+}
+
+void clock_delay(t_clock *c, double delaytime)
+{
+    c->due = daemon_now() + (delaytime > 0 ? delaytime : 0);
+    c->set = 1;
+}
+
+void clock_unset(t_clock *c)
+{
+    c->set = 0;
+}
+
+void clock_free(t_clock *c)
+{
+    struct _clock **p;
+    for (p = &clocks; *p; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    free(c);
+}
+
+// system time and logical time are the same thing here
+double clock_gettimesince(double prevsystime)
+{
+    return daemon_now() - prevsystime;
+}
+
+double sys_getrealtime(void)
+{
+    return daemon_now() / 1000.;
+}
+
+void *pd_findbyclass(t_symbol *s, const t_class *c)
+{
+    return 0;
+}
+
+int garray_getfloatwords(t_garray *x, int *size, t_word **vec)
+{
+    return 0;
+}
+
+int garray_npoints(t_garray *x)
+{
+    return 0;
+}
+
+void garray_resize(t_garray *x, t_floatarg f)
+{
+}
+
+void garray_redraw(t_garray *x)
+{
+}
@@ -0,0 +1,97 @@
+//
+// implicitmapd.h
+// the subset of the Pd external API that implicitmap.c uses, implemented by
+// the implicitmapd daemon so the object can run without a patcher
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#ifndef IMPLICITMAPD_H
+#define IMPLICITMAPD_H
+
+#include <stddef.h>
+
+// Names and layouts follow m_pd.h so that the Pd code paths in
+// implicitmap.c compile unchanged.  Every method is registered as A_GIMME
+// and dispatched as (object, selector, argc, argv).  The daemon has no
+// arrays: lookups always fail and the object falls back to messages.
+
+typedef float t_float;
+typedef float t_floatarg;
+
+typedef struct _symbol
+{
+    char *s_name;
+    struct _symbol *s_next;
+} t_symbol;
+
+typedef enum
+{
+    A_NULL,
+    A_FLOAT,
+    A_SYMBOL,
+    A_GIMME,
+    A_CANT
+} t_atomtype;
+
+typedef union word
+{
+    t_float w_float;
+    t_symbol *w_symbol;
+} t_word;
+
+typedef struct _atom
+{
+    t_atomtype a_type;
+    union word a_w;
+} t_atom;
+
+typedef struct _class t_class;
+typedef struct _outlet t_outlet;
+typedef struct _clock t_clock;
+
+typedef struct _object
+{
+    t_class *ob_pd;
+} t_object;
+
+typedef void (*t_method)(void);
+typedef void *(*t_newmethod)(void);
+
+#define SETFLOAT(atom, f) ((atom)->a_type = A_FLOAT, (atom)->a_w.w_float = (f))
+#define SETSYMBOL(atom, s) ((atom)->a_type = A_SYMBOL, \
+                            (atom)->a_w.w_symbol = (s))
+
+t_symbol *gensym(const char *s);
+void post(const char *fmt, ...);
+t_float atom_getfloat(const t_atom *a);
+
+t_class *class_new(t_symbol *name, t_newmethod newmethod, t_method freemethod,
+                   size_t size, int flags, t_atomtype arg1, ...);
+void class_addmethod(t_class *c, t_method fn, t_symbol *sel,
+                     t_atomtype arg1, ...);
+void *pd_new(t_class *c);
+
+t_outlet *outlet_new(t_object *owner, t_symbol *s);
+void outlet_anything(t_outlet *o, t_symbol *s, int argc, t_atom *argv);
+
+t_clock *clock_new(void *owner, t_method fn);
+void clock_delay(t_clock *c, double delaytime);
+void clock_unset(t_clock *c);
+void clock_free(t_clock *c);
+double clock_gettimesince(double prevsystime);
+double sys_getrealtime(void);
+
+typedef struct _garray t_garray;
+extern t_class *garray_class;
+void *pd_findbyclass(t_symbol *s, const t_class *c);
+int garray_getfloatwords(t_garray *x, int *size, t_word **vec);
+int garray_npoints(t_garray *x);
+void garray_resize(t_garray *x, t_floatarg f);
+void garray_redraw(t_garray *x);
+
+#endif // IMPLICITMAPD_H
@@ -0,0 +1,562 @@
+//
+// impmap_delaunay.c
+// piecewise-linear interpolation over a Delaunay triangulation of the
+// snapshot inputs
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#include "impmap_model.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define DELAUNAY_MAX_DIM 4
+#define DELAUNAY_REACH   10     // how far beyond the first snapshots' extent
+                                // later snapshots may fall without a rebuild
+#define DELAUNAY_EPSILON 1e-12
+
+// Triangulates the snapshot inputs (2 to 4 dimensions, though 1 works too)
+// with the Bowyer-Watson algorithm, starting from a large super-simplex
+// whose corners are the first size_in + 1 points.  Each simplex keeps the
+// inverse of its edge matrix, which gives both the barycentric coordinates
+// of a query and the circumcentre used while inserting.
+//
+// A query is located by walking from the simplex found for the previous
+// one towards the most negative barycentric coordinate, so a slowly moving
+// controller usually needs one or two steps.  The outputs of the real
+// corners of that simplex are then blended with its barycentric weights,
+// which passes exactly through every snapshot.  Outside the hull of the
+// snapshots the weights of super-simplex corners are dropped.
+//
+// Snapshots are inserted oldest first.  When the model is retrained with
+// the previous snapshots unchanged, only the new ones are inserted.  Row
+// weights are ignored, since the blend interpolates every snapshot exactly.
+// A snapshot at the input of an earlier one is not inserted; it hands its
+// outputs to the earlier vertex instead, so the newest outputs win.
+
+typedef struct _simplex
+{
+    int vertices[DELAUNAY_MAX_DIM + 1];
+    int neighbours[DELAUNAY_MAX_DIM + 1];   // opposite each vertex, or -1
+    double inverse[DELAUNAY_MAX_DIM * DELAUNAY_MAX_DIM];
+    double centre[DELAUNAY_MAX_DIM];
+    double radius2;             // negative if the simplex is degenerate
+    char alive;
+    char bad;                   // inside the cavity of the current insertion
+} t_simplex;
+
+typedef struct _delaunay
+{
+    int size_in;
+    int size_out;
+    int num_points;             // including the super-simplex corners
+    int max_points;
+    double *points;
+    int *owner;                 // vertex holding each point's outputs
+    float *outputs;             // size_out per point
+    t_simplex *simplices;
+    int num_simplices;
+    int max_simplices;
+    int *free_list;
+    int num_free;
+    int *cavity;                // scratch for insertions
+    int *created;
+    int max_scratch;
+    int last;                   // simplex found by the previous evaluation
+    double centre[DELAUNAY_MAX_DIM];
+    double extent;
+    int duplicates;             // found by the last training
+} t_delaunay;
+
+static void *delaunay_new(void)
+{
+    return calloc(1, sizeof(t_delaunay));
+}
+
+static void delaunay_free(void *state)
+{
+    t_delaunay *del = state;
+    free(del->points);
+    free(del->owner);
+    free(del->outputs);
+    free(del->simplices);
+    free(del->free_list);
+    free(del->cavity);
+    free(del->created);
+    free(del);
+}
+
+// Gauss-Jordan with partial pivoting; returns non-zero if a is singular.
+static int delaunay_invert(double *a, double *inverse, int n)
+{
+    int i, j, k, pivot;
+    double largest = 0;
+
+    for (i = 0; i < n * n; i++) {
+        if (fabs(a[i]) > largest)
+            largest = fabs(a[i]);
+    }
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++)
+            inverse[i * n + j] = i == j;
+    }
+    for (k = 0; k < n; k++) {
+        for (pivot = k, i = k + 1; i < n; i++) {
+            if (fabs(a[i * n + k]) > fabs(a[pivot * n + k]))
+                pivot = i;
+        }
+        if (fabs(a[pivot * n + k]) <= largest * DELAUNAY_EPSILON)
+            return 1;
+        if (pivot != k) {
+            for (j = 0; j < n; j++) {
+                double t = a[k * n + j];
+                a[k * n + j] = a[pivot * n + j];
+                a[pivot * n + j] = t;
+                t = inverse[k * n + j];
+                inverse[k * n + j] = inverse[pivot * n + j];
+                inverse[pivot * n + j] = t;
+            }
+        }
+        double scale = 1 / a[k * n + k];
+        for (j = 0; j < n; j++) {
+            a[k * n + j] *= scale;
+            inverse[k * n + j] *= scale;
+        }
+        for (i = 0; i < n; i++) {
+            double f = a[i * n + k];
+            if (i == k || f == 0)
+                continue;
+            for (j = 0; j < n; j++) {
+                a[i * n + j] -= f * a[k * n + j];
+                inverse[i * n + j] -= f * inverse[k * n + j];
+            }
+        }
+    }
+    return 0;
+}
+
+// With the edges e_i = v_i+1 - v_0 as the rows of T, the barycentric
+// coordinates of p are the transpose of T's inverse applied to p - v_0, and
+// the circumcentre is v_0 + T^-1 b with b_i = |e_i|^2 / 2.
+static void delaunay_init_simplex(t_delaunay *del, t_simplex *s)
+{
+    int i, k, d = del->size_in;
+    const double *v0 = del->points + s->vertices[0] * d;
+    double edges[DELAUNAY_MAX_DIM * DELAUNAY_MAX_DIM], b[DELAUNAY_MAX_DIM];
+
+    for (i = 0; i < d; i++) {
+        const double *v = del->points + s->vertices[i + 1] * d;
+        b[i] = 0;
+        for (k = 0; k < d; k++) {
+            edges[i * d + k] = v[k] - v0[k];
+            b[i] += edges[i * d + k] * edges[i * d + k];
+        }
+        b[i] /= 2;
+    }
+    s->alive = 1;
+    s->bad = 0;
+    if (delaunay_invert(edges, s->inverse, d)) {
+        memset(s->inverse, 0, sizeof(s->inverse));
+        s->radius2 = -1;
+        return;
+    }
+    s->radius2 = 0;
+    for (k = 0; k < d; k++) {
+        double c = 0;
+        for (i = 0; i < d; i++)
+            c += s->inverse[k * d + i] * b[i];
+        s->centre[k] = v0[k] + c;
+        s->radius2 += c * c;
+    }
+}
+
+static void delaunay_barycentric(const t_delaunay *del, const t_simplex *s,
+                                 const double *p, double *bary)
+{
+    int i, k, d = del->size_in;
+    const double *v0 = del->points + s->vertices[0] * d;
+    double sum = 0;
+    for (i = 0; i < d; i++) {
+        double l = 0;
+        for (k = 0; k < d; k++)
+            l += s->inverse[k * d + i] * (p[k] - v0[k]);
+        bary[i + 1] = l;
+        sum += l;
+    }
+    bary[0] = 1 - sum;
+}
+
+// Visibility walk; falls back to a scan if it has not arrived after
+// visiting as many simplices as there are.
+static int delaunay_locate(const t_delaunay *del, const double *p, int start,
+                           double *bary)
+{
+    int i, s, steps, d = del->size_in;
+
+    if (start < 0 || start >= del->num_simplices
+        || !del->simplices[start].alive)
+        start = del->num_simplices - 1;
+    while (start > 0 && !del->simplices[start].alive)
+        start--;
+
+    for (s = start, steps = 0; steps < del->num_simplices; steps++) {
+        int worst = -1;
+        double lowest = -DELAUNAY_EPSILON;
+        delaunay_barycentric(del, del->simplices + s, p, bary);
+        for (i = 0; i <= d; i++) {
+            if (bary[i] < lowest) {
+                lowest = bary[i];
+                worst = i;
+            }
+        }
+        if (worst < 0 || del->simplices[s].neighbours[worst] < 0)
+            return s;
+        s = del->simplices[s].neighbours[worst];
+    }
+    for (s = 0; s < del->num_simplices; s++) {
+        if (!del->simplices[s].alive)
+            continue;
+        delaunay_barycentric(del, del->simplices + s, p, bary);
+        for (i = 0; i <= d && bary[i] >= -DELAUNAY_EPSILON; i++)
+            ;
+        if (i > d)
+            return s;
+    }
+    delaunay_barycentric(del, del->simplices + start, p, bary);
+    return start;
+}
+
+static int delaunay_alloc_simplex(t_delaunay *del)
+{
+    if (del->num_free)
+        return del->free_list[--del->num_free];
+    if (del->num_simplices == del->max_simplices) {
+        del->max_simplices = del->max_simplices ? del->max_simplices * 2 : 64;
+        del->simplices = realloc(del->simplices,
+                                 del->max_simplices * sizeof(t_simplex));
+        del->free_list = realloc(del->free_list,
+                                 del->max_simplices * sizeof(int));
+    }
+    return del->num_simplices++;
+}
+
+static void delaunay_grow_scratch(t_delaunay *del, int size)
+{
+    if (size <= del->max_scratch)
+        return;
+    del->max_scratch = size * 2;
+    del->cavity = realloc(del->cavity, del->max_scratch * sizeof(int));
+    del->created = realloc(del->created, del->max_scratch * sizeof(int));
+}
+
+// Removes every simplex whose circumsphere contains the point and fills
+// the cavity with simplices joining its boundary facets to the point.
+// Returns the vertex the point duplicates, or -1 once it is inserted.
+static int delaunay_insert(t_delaunay *del, int point)
+{
+    int i, j, k, a, b, d = del->size_in;
+    int num_cavity = 0, num_created = 0;
+    const double *p = del->points + point * d;
+    double bary[DELAUNAY_MAX_DIM + 1];
+    int start = delaunay_locate(del, p, del->last, bary);
+
+    for (i = 0; i <= d; i++) {
+        const double *v = del->points + del->simplices[start].vertices[i] * d;
+        double dist = 0;
+        for (k = 0; k < d; k++)
+            dist += (p[k] - v[k]) * (p[k] - v[k]);
+        if (dist <= DELAUNAY_EPSILON * del->extent * del->extent)
+            return del->simplices[start].vertices[i];
+    }
+
+    delaunay_grow_scratch(del, 1);
+    del->cavity[num_cavity++] = start;
+    del->simplices[start].bad = 1;
+    for (k = 0; k < num_cavity; k++) {
+        t_simplex *s = del->simplices + del->cavity[k];
+        for (i = 0; i <= d; i++) {
+            int n = s->neighbours[i];
+            if (n < 0 || del->simplices[n].bad
+                || del->simplices[n].radius2 < 0)
+                continue;
+            t_simplex *t = del->simplices + n;
+            double dist = 0;
+            for (j = 0; j < d; j++)
+                dist += (p[j] - t->centre[j]) * (p[j] - t->centre[j]);
+            if (dist >= t->radius2)
+                continue;
+            t->bad = 1;
+            delaunay_grow_scratch(del, num_cavity + 1);
+            del->cavity[num_cavity++] = n;
+        }
+    }
+
+    // one new simplex per boundary facet, with the point replacing the
+    // vertex opposite the facet so that the outer neighbour keeps its slot
+    for (k = 0; k < num_cavity; k++) {
+        for (i = 0; i <= d; i++) {
+            int old = del->cavity[k];
+            int n = del->simplices[old].neighbours[i];
+            if (n >= 0 && del->simplices[n].bad)
+                continue;
+            int c = delaunay_alloc_simplex(del);
+            t_simplex *s = del->simplices + old, *t = del->simplices + c;
+            memcpy(t->vertices, s->vertices, sizeof(t->vertices));
+            t->vertices[i] = point;
+            for (j = 0; j <= d; j++)
+                t->neighbours[j] = -1;
+            t->neighbours[i] = n;
+            if (n >= 0) {
+                for (j = 0; j <= d; j++) {
+                    if (del->simplices[n].neighbours[j] == old)
+                        del->simplices[n].neighbours[j] = c;
+                }
+            }
+            delaunay_init_simplex(del, t);
+            delaunay_grow_scratch(del, num_created + 1);
+            del->created[num_created++] = c;
+        }
+    }
+
+    // new simplices sharing all but one of their vertices are neighbours
+    for (a = 0; a < num_created; a++) {
+        t_simplex *s = del->simplices + del->created[a];
+        for (b = a + 1; b < num_created; b++) {
+            t_simplex *t = del->simplices + del->created[b];
+            int shared = 0, only_s = -1, only_t = -1;
+            for (i = 0; i <= d; i++) {
+                for (j = 0; j <= d && t->vertices[j] != s->vertices[i]; j++)
+                    ;
+                if (j <= d)
+                    shared++;
+                else
+                    only_s = i;
+            }
+            if (shared != d)
+                continue;
+            for (j = 0; j <= d; j++) {
+                for (i = 0; i <= d && s->vertices[i] != t->vertices[j]; i++)
+                    ;
+                if (i > d)
+                    only_t = j;
+            }
+            s->neighbours[only_s] = del->created[b];
+            t->neighbours[only_t] = del->created[a];
+        }
+    }
+
+    for (k = 0; k < num_cavity; k++) {
+        t_simplex *s = del->simplices + del->cavity[k];
+        s->alive = 0;
+        s->bad = 0;
+        del->free_list[del->num_free++] = del->cavity[k];
+    }
+    del->last = del->created[num_created - 1];
+    return -1;
+}
+
+static void delaunay_add_point(t_delaunay *del, const float *in)
+{
+    int k, d = del->size_in;
+    if (del->num_points == del->max_points) {
+        del->max_points = del->max_points ? del->max_points * 2 : 64;
+        del->points = realloc(del->points,
+                              del->max_points * d * sizeof(double));
+        del->owner = realloc(del->owner, del->max_points * sizeof(int));
+    }
+    for (k = 0; k < d; k++)
+        del->points[del->num_points * d + k] = in[k];
+    del->owner[del->num_points] = del->num_points;
+    del->num_points++;
+}
+
+// Starts over with a super-simplex large enough to hold every point
+// within DELAUNAY_REACH extents of the centre of these snapshots.
+static void delaunay_reset(t_delaunay *del, const float *inputs, int num_rows,
+                           int size_in)
+{
+    int i, k, r, d = size_in;
+    double lo[DELAUNAY_MAX_DIM], hi[DELAUNAY_MAX_DIM], side;
+
+    del->size_in = d;
+    del->num_points = 0;
+    del->num_simplices = 0;
+    del->num_free = 0;
+    del->last = 0;
+    del->extent = 0;
+    for (k = 0; k < d; k++) {
+        lo[k] = hi[k] = inputs[k];
+        for (r = 1; r < num_rows; r++) {
+            double x = inputs[r * d + k];
+            if (x < lo[k])
+                lo[k] = x;
+            if (x > hi[k])
+                hi[k] = x;
+        }
+        del->centre[k] = (lo[k] + hi[k]) / 2;
+        if ((hi[k] - lo[k]) / 2 > del->extent)
+            del->extent = (hi[k] - lo[k]) / 2;
+    }
+    if (del->extent <= 0)
+        del->extent = 1;
+
+    // corner 0 is at centre - side in every dimension, corner k > 0 is side
+    // (d + 1) further along dimension k - 1; the simplex then holds the
+    // cube of half-width side / d around the centre
+    side = DELAUNAY_REACH * d * del->extent * 10;    // with room to spare
+    float corner[DELAUNAY_MAX_DIM] = {0};
+    for (i = 0; i <= d; i++) {
+        for (k = 0; k < d; k++)
+            corner[k] = (float)(del->centre[k] - side
+                                + (i == k + 1 ? side * (d + 1) : 0));
+        delaunay_add_point(del, corner);
+    }
+    int s = delaunay_alloc_simplex(del);
+    t_simplex *t = del->simplices + s;
+    for (i = 0; i <= d; i++) {
+        t->vertices[i] = i;
+        t->neighbours[i] = -1;
+    }
+    delaunay_init_simplex(del, t);
+}
+
+// Returns how many snapshots are already triangulated, or -1 if the
+// triangulation has to be rebuilt because earlier snapshots changed or new
+// ones fall outside the super-simplex.  Rows are newest first, so earlier
+// snapshots are the last rows.
+static int delaunay_reusable(const t_delaunay *del, const float *inputs,
+                             int num_rows, int size_in)
+{
+    int i, k, d = size_in, old = del->num_points - (d + 1);
+
+    if (!del->num_points || del->size_in != d || old > num_rows)
+        return -1;
+    for (k = 0; k < num_rows; k++) {
+        const float *x = inputs + (num_rows - 1 - k) * d;
+        for (i = 0; i < d; i++) {
+            if (k < old ? (double)x[i] != del->points[(d + 1 + k) * d + i]
+                : fabs(x[i] - del->centre[i]) > DELAUNAY_REACH * del->extent)
+                return -1;
+        }
+    }
+    return old;
+}
+
+static int delaunay_train(void *state, const float *inputs,
+                          const float *outputs, const float *weights,
+                          int num_rows, int size_in, int size_out)
+{
+    t_delaunay *del = state;
+    int k, r, d = size_in, old, p;
+
+    if (size_in > DELAUNAY_MAX_DIM)
+        return 1;
+
+    old = delaunay_reusable(del, inputs, num_rows, d);
+    if (old < 0) {
+        delaunay_reset(del, inputs, num_rows, d);
+        old = 0;
+    }
+    del->duplicates = 0;
+    for (k = old; k < num_rows; k++) {
+        delaunay_add_point(del, inputs + (num_rows - 1 - k) * d);
+        p = delaunay_insert(del, del->num_points - 1);
+        if (p >= 0) {
+            del->owner[del->num_points - 1] = p;
+            del->duplicates++;
+        }
+    }
+
+    free(del->outputs);
+    del->outputs = calloc(del->num_points * size_out, sizeof(float));
+    del->size_out = size_out;
+    for (r = 0; r < num_rows; r++)
+        memcpy(del->outputs + (d + num_rows - r) * size_out,
+               outputs + r * size_out, size_out * sizeof(float));
+    // oldest first, so the newest of several duplicates is copied last
+    for (p = d + 1; p < del->num_points; p++) {
+        if (del->owner[p] != p)
+            memcpy(del->outputs + del->owner[p] * size_out,
+                   del->outputs + p * size_out, size_out * sizeof(float));
+    }
+    return 0;
+}
+
+static int delaunay_duplicates(void *state)
+{
+    return ((t_delaunay *)state)->duplicates;
+}
+
+static void delaunay_blend(const t_delaunay *del, const float *in, float *out,
+                           int *last)
+{
+    int i, k, d = del->size_in, size_out = del->size_out, nearest = -1;
+    double p[DELAUNAY_MAX_DIM] = {0}, bary[DELAUNAY_MAX_DIM + 1], total = 0;
+
+    for (k = 0; k < d; k++)
+        p[k] = in[k];
+    *last = delaunay_locate(del, p, *last, bary);
+    const t_simplex *s = del->simplices + *last;
+
+    memset(out, 0, size_out * sizeof(float));
+    for (i = 0; i <= d; i++) {
+        if (s->vertices[i] <= d)
+            continue;
+        if (nearest < 0 || bary[i] > bary[nearest])
+            nearest = i;
+        if (bary[i] > 0)
+            total += bary[i];
+    }
+    if (nearest < 0)
+        return;
+    if (total <= DELAUNAY_EPSILON) {
+        memcpy(out, del->outputs + s->vertices[nearest] * size_out,
+               size_out * sizeof(float));
+        return;
+    }
+    for (i = 0; i <= d; i++) {
+        if (s->vertices[i] <= d || bary[i] <= 0)
+            continue;
+        const float *y = del->outputs + s->vertices[i] * size_out;
+        float w = (float)(bary[i] / total);
+        for (k = 0; k < size_out; k++)
+            out[k] += w * y[k];
+    }
+}
+
+static void delaunay_evaluate(void *state, const float *in, float *out)
+{
+    t_delaunay *del = state;
+    delaunay_blend(del, in, out, &del->last);
+}
+
+// Walks from row to row without touching the stored starting simplex.
+static void delaunay_batch(void *state, const float *inputs, float *outputs,
+                           int num_rows)
+{
+    const t_delaunay *del = state;
+    int r, last = del->last;
+    for (r = 0; r < num_rows; r++)
+        delaunay_blend(del, inputs + (long)r * del->size_in,
+                       outputs + (long)r * del->size_out, &last);
+}
+
+const t_impmap_engine impmap_engine_delaunay = {
+    "delaunay",
+    delaunay_new,
+    delaunay_free,
+    0,
+    delaunay_train,
+    delaunay_evaluate,
+    0,
+    delaunay_batch,
+    0,
+    0,
+    0,
+    delaunay_duplicates
+};
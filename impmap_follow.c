@@ -0,0 +1,366 @@
+//
+// impmap_follow.c
+// online alignment of the input stream against recorded gesture templates
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#include "impmap_follow.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define DEAD HUGE_VALF
+
+// Each template frame holds the best path that ends there: its accumulated
+// squared distance and weight, where every step multiplies the past by
+// 'forget', so the normalised cost cost/weight is an exponentially weighted
+// mean distance along the path.  Frame j is reached from frames j, j-1 and
+// j-2 of the previous step; the first frame can also start a new path on
+// any step.
+//
+// Only frames whose cost is within the beam of the best cost over all
+// templates stay live, so each step only touches a few frames per
+// template.  The live frames form two ranges: the head, which starts at
+// the first frame and holds hypotheses that have only just started, and
+// the range further on that is being followed.  The distance from an input
+// to a template's bounding box is a lower bound on its distance to every
+// frame, which gives a lower bound on the template's next cost; templates
+// whose bound is outside the last step's beam are dropped without touching
+// their frames.  Frames are stored one dimension at a time, so distances
+// to a range of frames are computed with contiguous loops that the
+// compiler can vectorise.
+
+t_impmap_follower *impmap_follow_new(void)
+{
+    t_impmap_follower *f = calloc(1, sizeof(t_impmap_follower));
+    f->sigma = 0.1f;
+    f->forget = 0.9f;
+    f->beam = 0.001f;
+    f->limit = DEAD;
+    return f;
+}
+
+void impmap_follow_free(t_impmap_follower *f)
+{
+    if (!f)
+        return;
+    impmap_follow_clear(f);
+    free(f);
+}
+
+static void follow_restart(t_impmap_template *t)
+{
+    int j;
+    for (j = 0; j < t->num_frames; j++) {
+        t->cost[j] = DEAD;
+        t->weight[j] = 0;
+    }
+    t->head = -1;
+    t->lo = 1;
+    t->hi = 0;
+    t->best = DEAD;
+    t->position = 0;
+}
+
+// *********************************************************
+// -(add a template)----------------------------------------
+// Frames are rows of 'size' values.  Returns the template's index or -1.
+int impmap_follow_add(t_impmap_follower *f, const float *frames,
+                      int num_frames, int size)
+{
+    int i, j;
+    if (f->num_templates == IMPMAP_FOLLOW_MAX_TEMPLATES || num_frames < 1
+        || size < 1)
+        return -1;
+    t_impmap_template *t = f->templates + f->num_templates;
+    t->num_frames = num_frames;
+    t->size = size;
+    t->frames = malloc((long)num_frames * size * sizeof(float));
+    t->low = malloc(size * sizeof(float));
+    t->high = malloc(size * sizeof(float));
+    t->cost = malloc(num_frames * sizeof(float));
+    t->weight = malloc(num_frames * sizeof(float));
+    t->dist = malloc(num_frames * sizeof(float));
+    for (i = 0; i < size; i++) {
+        float *p = t->frames + (long)i * num_frames;
+        t->low[i] = t->high[i] = frames[i];
+        for (j = 0; j < num_frames; j++) {
+            p[j] = frames[(long)j * size + i];
+            if (p[j] < t->low[i])
+                t->low[i] = p[j];
+            else if (p[j] > t->high[i])
+                t->high[i] = p[j];
+        }
+    }
+    follow_restart(t);
+    return f->num_templates++;
+}
+
+// *********************************************************
+// -(remove all templates)----------------------------------
+void impmap_follow_clear(t_impmap_follower *f)
+{
+    int k;
+    for (k = 0; k < f->num_templates; k++) {
+        t_impmap_template *t = f->templates + k;
+        free(t->frames);
+        free(t->low);
+        free(t->high);
+        free(t->cost);
+        free(t->weight);
+        free(t->dist);
+    }
+    f->num_templates = 0;
+    f->limit = DEAD;
+}
+
+// *********************************************************
+// -(carry the templates over to a new frame layout)--------
+// Dimension i of the new frames is dimension map[i] of the old ones, or
+// 'fill' if map[i] is negative.  Templates recorded with a frame size
+// other than size_from are left alone.  Returns the number remapped.
+int impmap_follow_remap(t_impmap_follower *f, const int *map, int size_from,
+                        int size_to, float fill)
+{
+    int i, j, k, count = 0;
+    for (k = 0; k < f->num_templates; k++) {
+        t_impmap_template *t = f->templates + k;
+        if (t->size != size_from)
+            continue;
+        float *frames = malloc((long)t->num_frames * size_to * sizeof(float));
+        float *low = malloc(size_to * sizeof(float));
+        float *high = malloc(size_to * sizeof(float));
+        for (i = 0; i < size_to; i++) {
+            float *p = frames + (long)i * t->num_frames;
+            if (map[i] >= 0) {
+                memcpy(p, t->frames + (long)map[i] * t->num_frames,
+                       t->num_frames * sizeof(float));
+                low[i] = t->low[map[i]];
+                high[i] = t->high[map[i]];
+                continue;
+            }
+            for (j = 0; j < t->num_frames; j++)
+                p[j] = fill;
+            low[i] = high[i] = fill;
+        }
+        free(t->frames);
+        free(t->low);
+        free(t->high);
+        t->frames = frames;
+        t->low = low;
+        t->high = high;
+        t->size = size_to;
+        follow_restart(t);
+        count++;
+    }
+    f->limit = DEAD;
+    return count;
+}
+
+// *********************************************************
+// -(forget the alignments so far)--------------------------
+void impmap_follow_reset(t_impmap_follower *f)
+{
+    int k;
+    for (k = 0; k < f->num_templates; k++)
+        follow_restart(f->templates + k);
+    f->limit = DEAD;
+}
+
+// Advances frames [a, b] by one step, highest first so that each frame
+// still sees the previous step's values of the frames before it.
+static void follow_cells(const t_impmap_follower *f, t_impmap_template *t,
+                         const float *in, int a, int b)
+{
+    int i, j, p, n = t->num_frames;
+    float *dist = t->dist;
+
+    for (j = a; j <= b; j++)
+        dist[j] = 0;
+    for (i = 0; i < t->size; i++) {
+        const float *frames = t->frames + (long)i * n;
+        float x = in[i];
+        for (j = a; j <= b; j++) {
+            float d = frames[j] - x;
+            dist[j] += d * d;
+        }
+    }
+    for (j = b; j >= a; j--) {
+        float cost = DEAD, weight = 0, best = DEAD;
+        if (j == 0) {
+            cost = best = dist[0];
+            weight = 1;
+        }
+        for (p = j; p >= 0 && p >= j - 2; p--) {
+            if (t->cost[p] == DEAD)
+                continue;
+            float c = dist[j] + f->forget * t->cost[p];
+            float w = 1 + f->forget * t->weight[p];
+            if (c / w < best) {
+                cost = c;
+                weight = w;
+                best = c / w;
+            }
+        }
+        t->cost[j] = cost;
+        t->weight[j] = weight;
+        if (best < t->best) {
+            t->best = best;
+            t->position = j;
+        }
+    }
+}
+
+// The frames advanced on this step: the head and the frames it reaches,
+// and the followed range and the frames it reaches (top is -1 if empty).
+static void follow_regions(const t_impmap_template *t, int *head_top, int *top)
+{
+    int last = t->num_frames - 1;
+    *head_top = t->head + 2 < last ? t->head + 2 : last;
+    if (t->lo > t->hi)
+        *top = -1;
+    else
+        *top = t->hi + 2 < last ? t->hi + 2 : last;
+}
+
+// Kills the frames in [a, b] whose cost is above limit and returns the
+// first and last survivors, or -1.
+static void follow_drop(t_impmap_template *t, int a, int b, float limit,
+                        int *first, int *last)
+{
+    int j;
+    *first = *last = -1;
+    for (j = a; j <= b; j++) {
+        if (t->cost[j] == DEAD)
+            continue;
+        if (t->cost[j] / t->weight[j] > limit) {
+            t->cost[j] = DEAD;
+            t->weight[j] = 0;
+            continue;
+        }
+        if (*first < 0)
+            *first = j;
+        *last = j;
+    }
+}
+
+// Kills the live frames only, so that dropping a template costs nothing
+// for the frames that were already dead.
+static void follow_kill(t_impmap_template *t)
+{
+    int j;
+    for (j = 0; j <= t->head; j++)
+        t->cost[j] = DEAD;
+    for (j = t->lo; j <= t->hi; j++)
+        t->cost[j] = DEAD;
+    t->head = -1;
+    t->lo = 1;
+    t->hi = 0;
+    t->best = DEAD;
+}
+
+static void follow_template(const t_impmap_follower *f, t_impmap_template *t,
+                            const float *in)
+{
+    int i, head_top, top;
+    float bound = 0;
+
+    // each step moves a path's normalised cost at least a fraction
+    // (1 - forget) of the way towards the new distance, which is at least
+    // the distance to the bounding box
+    for (i = 0; i < t->size; i++) {
+        float d = in[i] < t->low[i] ? t->low[i] - in[i]
+                  : in[i] > t->high[i] ? in[i] - t->high[i] : 0;
+        bound += d * d;
+    }
+    if (bound > t->best)
+        bound = (1 - f->forget) * bound + f->forget * t->best;
+    if (bound > f->limit) {
+        follow_kill(t);
+        return;
+    }
+
+    // a followed range that has come back within reach of the head joins it
+    if (t->lo <= t->hi && t->lo <= t->head + 3) {
+        t->head = t->hi;
+        t->lo = 1;
+        t->hi = 0;
+    }
+    t->best = DEAD;
+    follow_regions(t, &head_top, &top);
+    if (top >= 0)
+        follow_cells(f, t, in, t->lo, top);
+    follow_cells(f, t, in, 0, head_top);
+}
+
+static void follow_prune(t_impmap_template *t, float limit)
+{
+    int head_top, top, first, last;
+
+    if (t->best == DEAD)
+        return;
+    follow_regions(t, &head_top, &top);
+    if (top >= 0) {
+        follow_drop(t, t->lo, top, limit, &first, &last);
+        t->lo = first < 0 ? 1 : first;
+        t->hi = first < 0 ? 0 : last;
+    }
+    follow_drop(t, 0, head_top, limit, &first, &last);
+    t->head = last;
+    // keep the head short by following a hypothesis on its own once it
+    // has left the first frames
+    if (first > 2 && t->lo > t->hi) {
+        t->lo = first;
+        t->hi = last;
+        t->head = -1;
+    }
+}
+
+// *********************************************************
+// -(follow one input frame)--------------------------------
+// Fills likelihood (normalised over the templates) and progress (0 at the
+// first frame of a template, 1 at its last) and returns the number of
+// templates.  Templates recorded with a different frame size are ignored;
+// those loaded under an earlier input layout are remapped when it changes.
+int impmap_follow_step(t_impmap_follower *f, const float *in, int size,
+                       float *likelihood, float *progress)
+{
+    int k;
+    float best = DEAD, total = 0, scale = 0.5f / (f->sigma * f->sigma);
+
+    for (k = 0; k < f->num_templates; k++) {
+        t_impmap_template *t = f->templates + k;
+        if (t->size != size) {
+            t->best = DEAD;
+            continue;
+        }
+        follow_template(f, t, in);
+        if (t->best < best)
+            best = t->best;
+    }
+
+    // frames whose likelihood relative to the best is below the beam
+    f->limit = best == DEAD ? DEAD : best - logf(f->beam) / scale;
+    for (k = 0; k < f->num_templates; k++) {
+        t_impmap_template *t = f->templates + k;
+        follow_prune(t, f->limit);
+        if (t->best == DEAD) {
+            likelihood[k] = progress[k] = 0;
+            continue;
+        }
+        likelihood[k] = expf(-scale * (t->best - best));
+        total += likelihood[k];
+        progress[k] = t->num_frames > 1
+                      ? (float)t->position / (t->num_frames - 1) : 1;
+    }
+    if (total > 0) {
+        for (k = 0; k < f->num_templates; k++)
+            likelihood[k] /= total;
+    }
+    return f->num_templates;
+}
@@ -0,0 +1,63 @@
+//
+// impmap_follow.h
+// online alignment of the input stream against recorded gesture templates
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#ifndef IMPMAP_FOLLOW_H
+#define IMPMAP_FOLLOW_H
+
+#define IMPMAP_FOLLOW_MAX_TEMPLATES 64
+
+// A template is a recorded sequence of input vectors.  Every incoming
+// frame advances a left-to-right alignment against each template (stay,
+// advance or skip one frame), so a gesture can be followed while it is
+// being performed at a different speed.  For each template the follower
+// reports how likely it is that the gesture is being performed and how far
+// through it the performance is.
+
+typedef struct _impmap_template
+{
+    int num_frames;
+    int size;                   // length of each frame
+    float *frames;              // size rows of num_frames, one per dimension
+    float *low;                 // per-dimension bounds of the frames
+    float *high;
+    float *cost;                // accumulated weighted distance per frame
+    float *weight;              // accumulated weight of the path per frame
+    float *dist;                // scratch for the frame distances
+    int head;                   // last live frame of the hypotheses that
+                                // started recently, or -1
+    int lo, hi;                 // live frames of the hypothesis being
+                                // followed further on, empty if lo > hi
+    float best;                 // lowest normalised cost, or HUGE_VALF
+    int position;               // frame holding it
+} t_impmap_template;
+
+typedef struct _impmap_follower
+{
+    float sigma;                // expected distance between matching frames
+    float forget;               // weight of the past on each step
+    float beam;                 // relative likelihood below which frames drop
+    float limit;                // cost above which frames were dropped last step
+    int num_templates;
+    t_impmap_template templates[IMPMAP_FOLLOW_MAX_TEMPLATES];
+} t_impmap_follower;
+
+t_impmap_follower *impmap_follow_new(void);
+void impmap_follow_free(t_impmap_follower *f);
+int impmap_follow_add(t_impmap_follower *f, const float *frames,
+                      int num_frames, int size);
+void impmap_follow_clear(t_impmap_follower *f);
+void impmap_follow_reset(t_impmap_follower *f);
+int impmap_follow_remap(t_impmap_follower *f, const int *map, int size_from,
+                        int size_to, float fill);
+int impmap_follow_step(t_impmap_follower *f, const float *in, int size,
+                       float *likelihood, float *progress);
+
+#endif // IMPMAP_FOLLOW_H
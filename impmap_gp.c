@@ -0,0 +1,378 @@
+//
+// impmap_gp.c
+// Gaussian-process regression engine with predictive variance
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#include "impmap_model.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define GP_DRIFT 1.25           // rebuild once an input's spread has changed
+                                // by more than this factor
+
+// Zero-mean GP on the centred outputs with a squared-exponential kernel of
+// unit amplitude, so that noise is relative to the signal variance.  The
+// length scale is given in standard deviations of each input, measured
+// when the factorisation is built from scratch and measured again once the
+// spread of some input has moved by more than GP_DRIFT, or an input that
+// did not vary (as with a single snapshot) starts to.
+//
+// The kernel matrix K + noise I is held as its Cholesky factor.  Snapshots
+// are appended oldest first, each adding one row to the factor with a
+// single triangular solve, so retraining after adding snapshots costs
+// O(n^2) per new snapshot instead of a fresh O(n^3) factorisation.  The
+// factor is rebuilt if earlier snapshots have changed or a parameter has.
+//
+// Scaled inputs are stored one dimension at a time so that the kernel
+// vector of a query is computed with contiguous loops over the snapshots.
+// The per-output variance is the latent variance 1 - v.v (v = L^-1 k)
+// scaled by the variance of that output over the snapshots.  A snapshot
+// standing for several merged ones has its noise divided by its weight,
+// as the mean of that many noisy observations would.
+
+typedef struct _gp
+{
+    float lengthscale;
+    float noise;
+    int rebuild;                // parameters changed since the last build
+    int size_in;
+    int size_out;
+    int num_points;
+    int max_points;
+    float *points;              // size_in rows of max_points, scaled
+    float *weights;             // of each point
+    float *scale;               // 1 / (lengthscale * std) for each input
+    float *spread;              // the std it was measured from, 0 if none
+    double *chol;               // lower factor, rows packed one after another
+    float *alpha;               // num_points rows of size_out
+    float *mean;                // of each output over the snapshots
+    float *amplitude;           // variance of each output
+    float *kernel;              // scratch for evaluate()
+    double *solve;              // scratch for variance()
+} t_gp;
+
+static void *gp_new(void)
+{
+    t_gp *gp = calloc(1, sizeof(t_gp));
+    gp->lengthscale = 0.5f;
+    gp->noise = 0.001f;
+    return gp;
+}
+
+static void gp_free(void *state)
+{
+    t_gp *gp = state;
+    free(gp->points);
+    free(gp->weights);
+    free(gp->scale);
+    free(gp->spread);
+    free(gp->chol);
+    free(gp->alpha);
+    free(gp->mean);
+    free(gp->amplitude);
+    free(gp->kernel);
+    free(gp->solve);
+    free(gp);
+}
+
+static int gp_set(void *state, const char *param, int argc, const float *argv)
+{
+    t_gp *gp = state;
+    if (argc != 1 || argv[0] <= 0)
+        return 1;
+    if (strcmp(param, "lengthscale") == 0)
+        gp->lengthscale = argv[0];
+    else if (strcmp(param, "noise") == 0)
+        gp->noise = argv[0];
+    else
+        return 1;
+    gp->rebuild = 1;
+    return 0;
+}
+
+static void gp_grow(t_gp *gp, int num_points)
+{
+    int j, old = gp->max_points, n = gp->num_points;
+    if (num_points <= old)
+        return;
+    gp->max_points = old ? old : 64;
+    while (gp->max_points < num_points)
+        gp->max_points *= 2;
+
+    float *points = malloc(gp->size_in * gp->max_points * sizeof(float));
+    for (j = 0; j < gp->size_in && n; j++)
+        memcpy(points + j * gp->max_points, gp->points + j * old,
+               n * sizeof(float));
+    free(gp->points);
+    gp->points = points;
+    gp->weights = realloc(gp->weights, gp->max_points * sizeof(float));
+    gp->chol = realloc(gp->chol, (long)gp->max_points * (gp->max_points + 1)
+                                 / 2 * sizeof(double));
+    free(gp->kernel);
+    free(gp->solve);
+    gp->kernel = malloc(gp->max_points * sizeof(float));
+    gp->solve = malloc(gp->max_points * sizeof(double));
+}
+
+// Squared-exponential kernel between a scaled query and every snapshot.
+static void gp_kernel(const t_gp *gp, const float *x, float *k)
+{
+    int i, j, n = gp->num_points;
+    for (i = 0; i < n; i++)
+        k[i] = 0;
+    for (j = 0; j < gp->size_in; j++) {
+        const float *p = gp->points + j * gp->max_points;
+        float xj = x[j];
+        for (i = 0; i < n; i++) {
+            float d = p[i] - xj;
+            k[i] += d * d;
+        }
+    }
+    for (i = 0; i < n; i++)
+        k[i] = expf(-0.5f * k[i]);
+}
+
+// Forward substitution with the first n rows of the factor.
+static void gp_forward(const t_gp *gp, double *v, int n)
+{
+    int i, k;
+    for (i = 0; i < n; i++) {
+        const double *row = gp->chol + (long)i * (i + 1) / 2;
+        double s = v[i];
+        for (k = 0; k < i; k++)
+            s -= row[k] * v[k];
+        v[i] = s / row[i];
+    }
+}
+
+// Adds one snapshot to the factor: its row l solves L l = k, and its
+// diagonal is what remains of 1 + noise / weight.
+static int gp_append(t_gp *gp, const float *in, float weight)
+{
+    int j, k, n = gp->num_points;
+    float x[gp->size_in];
+    double diag = 1 + gp->noise / weight;
+
+    gp_grow(gp, n + 1);
+    for (j = 0; j < gp->size_in; j++)
+        x[j] = in[j] * gp->scale[j];
+    gp_kernel(gp, x, gp->kernel);
+
+    double *row = gp->chol + (long)n * (n + 1) / 2;
+    for (k = 0; k < n; k++)
+        row[k] = gp->kernel[k];
+    gp_forward(gp, row, n);
+    for (k = 0; k < n; k++)
+        diag -= row[k] * row[k];
+    if (diag <= 0)
+        return 1;
+    row[n] = sqrt(diag);
+    for (j = 0; j < gp->size_in; j++)
+        gp->points[j * gp->max_points + n] = x[j];
+    gp->weights[n] = weight;
+    gp->num_points++;
+    return 0;
+}
+
+// Standard deviation of each input over the rows.
+static void gp_spread(const float *inputs, int num_rows, int size_in,
+                      double *spread)
+{
+    int j, r;
+    for (j = 0; j < size_in; j++) {
+        double mean = 0, var = 0;
+        for (r = 0; r < num_rows; r++)
+            mean += inputs[(long)r * size_in + j];
+        mean /= num_rows;
+        for (r = 0; r < num_rows; r++) {
+            double d = inputs[(long)r * size_in + j] - mean;
+            var += d * d;
+        }
+        spread[j] = sqrt(var / num_rows);
+    }
+}
+
+// Returns how many snapshots are already factored, or -1 if the factor has
+// to be rebuilt.  Rows are newest first, so earlier snapshots are the last
+// rows.
+static int gp_reusable(const t_gp *gp, const float *inputs,
+                       const float *weights, int num_rows, int size_in,
+                       const double *spread)
+{
+    int j, k, old = gp->num_points;
+    if (gp->rebuild || !old || gp->size_in != size_in || old > num_rows)
+        return -1;
+    for (j = 0; j < size_in; j++) {
+        double was = gp->spread[j];
+        if (was <= 1e-12 ? spread[j] > 1e-12
+            : spread[j] > was * GP_DRIFT || spread[j] * GP_DRIFT < was)
+            return -1;
+    }
+    for (k = 0; k < old; k++) {
+        const float *x = inputs + (long)(num_rows - 1 - k) * size_in;
+        if (gp->weights[k] != (weights ? weights[num_rows - 1 - k] : 1))
+            return -1;
+        for (j = 0; j < size_in; j++) {
+            if (x[j] * gp->scale[j] != gp->points[j * gp->max_points + k])
+                return -1;
+        }
+    }
+    return old;
+}
+
+static int gp_train(void *state, const float *inputs, const float *outputs,
+                    const float *weights, int num_rows, int size_in,
+                    int size_out)
+{
+    t_gp *gp = state;
+    int i, j, k, r, old;
+    double spread[size_in];
+
+    gp_spread(inputs, num_rows, size_in, spread);
+    old = gp_reusable(gp, inputs, weights, num_rows, size_in, spread);
+    if (old < 0) {
+        free(gp->points);
+        free(gp->weights);
+        free(gp->chol);
+        gp->points = 0;
+        gp->weights = 0;
+        gp->chol = 0;
+        gp->max_points = 0;
+        free(gp->scale);
+        free(gp->spread);
+        gp->scale = malloc(size_in * sizeof(float));
+        gp->spread = malloc(size_in * sizeof(float));
+        gp->size_in = size_in;
+        gp->num_points = 0;
+        gp->rebuild = 0;
+        // an input that has not varied, as over a single row, keeps no
+        // spread, so the scale is measured again as soon as it does
+        for (j = 0; j < size_in; j++) {
+            gp->spread[j] = spread[j] > 1e-12 ? (float)spread[j] : 0;
+            gp->scale[j] = (float)(1 / (gp->lengthscale
+                                        * (spread[j] > 1e-12
+                                           ? spread[j] : 1)));
+        }
+        old = 0;
+    }
+    for (k = old; k < num_rows; k++) {
+        r = num_rows - 1 - k;
+        if (gp_append(gp, inputs + (long)r * size_in,
+                      weights ? weights[r] : 1)) {
+            gp->num_points = 0;
+            return 1;
+        }
+    }
+
+    // alpha = (K + noise I)^-1 (y - mean) by forward and back substitution
+    int n = gp->num_points;
+    double *y = malloc((long)n * sizeof(double));
+    free(gp->alpha);
+    free(gp->mean);
+    free(gp->amplitude);
+    gp->alpha = malloc((long)n * size_out * sizeof(float));
+    gp->mean = calloc(size_out, sizeof(float));
+    gp->amplitude = calloc(size_out, sizeof(float));
+    gp->size_out = size_out;
+    for (i = 0; i < size_out; i++) {
+        double mean = 0, var = 0;
+        for (k = 0; k < n; k++) {
+            y[k] = outputs[(long)(num_rows - 1 - k) * size_out + i];
+            mean += y[k];
+        }
+        mean /= n;
+        for (k = 0; k < n; k++) {
+            y[k] -= mean;
+            var += y[k] * y[k];
+        }
+        gp->mean[i] = (float)mean;
+        gp->amplitude[i] = (float)(var / n);
+        gp_forward(gp, y, n);
+        for (k = n - 1; k >= 0; k--) {
+            double s = y[k];
+            for (r = k + 1; r < n; r++)
+                s -= gp->chol[(long)r * (r + 1) / 2 + k] * y[r];
+            y[k] = s / gp->chol[(long)k * (k + 1) / 2 + k];
+        }
+        for (k = 0; k < n; k++)
+            gp->alpha[(long)k * size_out + i] = (float)y[k];
+    }
+    free(y);
+    return 0;
+}
+
+static void gp_predict(const t_gp *gp, const float *in, float *out, float *k)
+{
+    int i, j, size_out = gp->size_out;
+    float x[gp->size_in];
+    for (j = 0; j < gp->size_in; j++)
+        x[j] = in[j] * gp->scale[j];
+    gp_kernel(gp, x, k);
+    memcpy(out, gp->mean, size_out * sizeof(float));
+    for (j = 0; j < gp->num_points; j++) {
+        const float *a = gp->alpha + (long)j * size_out;
+        for (i = 0; i < size_out; i++)
+            out[i] += k[j] * a[i];
+    }
+}
+
+static void gp_evaluate(void *state, const float *in, float *out)
+{
+    t_gp *gp = state;
+    gp_predict(gp, in, out, gp->kernel);
+}
+
+static void gp_batch(void *state, const float *inputs, float *outputs,
+                     int num_rows)
+{
+    const t_gp *gp = state;
+    int r;
+    float *k = malloc(gp->num_points * sizeof(float));
+    for (r = 0; r < num_rows; r++)
+        gp_predict(gp, inputs + (long)r * gp->size_in,
+                   outputs + (long)r * gp->size_out, k);
+    free(k);
+}
+
+static void gp_variance(void *state, const float *in, float *variance)
+{
+    t_gp *gp = state;
+    int i, j, n = gp->num_points;
+    float x[gp->size_in];
+    double latent = 1;
+
+    for (j = 0; j < gp->size_in; j++)
+        x[j] = in[j] * gp->scale[j];
+    gp_kernel(gp, x, gp->kernel);
+    for (j = 0; j < n; j++)
+        gp->solve[j] = gp->kernel[j];
+    gp_forward(gp, gp->solve, n);
+    for (j = 0; j < n; j++)
+        latent -= gp->solve[j] * gp->solve[j];
+    if (latent < 0)
+        latent = 0;
+    for (i = 0; i < gp->size_out; i++)
+        variance[i] = (float)(gp->amplitude[i] * latent);
+}
+
+const t_impmap_engine impmap_engine_gp = {
+    "gp",
+    gp_new,
+    gp_free,
+    gp_set,
+    gp_train,
+    gp_evaluate,
+    0,
+    gp_batch,
+    0,
+    gp_variance,
+    0,
+    0
+};
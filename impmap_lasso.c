@@ -0,0 +1,293 @@
+//
+// impmap_lasso.c
+// sparse affine mapping engine fitted by elastic-net regression
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#include "impmap_model.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Affine map y = W x + b like the linear engine, but each output is fitted
+// by coordinate descent on the elastic-net objective
+//
+//   1/2n |y - X w|^2 + lambda (ratio |w|_1 + (1 - ratio)/2 |w|^2)
+//
+// over standardised inputs, so most weights end up exactly zero.  lambda
+// is lowered geometrically from the smallest value that zeroes every
+// weight down to the requested fraction of it, warm-starting each step
+// from the last.  The surviving weights are stored in compressed sparse
+// rows (one row per output), so evaluation only touches the inputs each
+// output actually depends on.
+
+typedef struct _lasso
+{
+    float lambda;               // final penalty relative to the smallest
+                                // penalty that zeroes every weight
+    float ratio;                // share of the penalty on |w|_1
+    int path;                   // steps along the regularisation path
+    int iterations;             // maximum sweeps per step
+    float tolerance;            // largest weight change that counts as done
+    int size_in;
+    int size_out;
+    int *row_start;             // size_out + 1 offsets into cols and values
+    int *cols;
+    float *values;
+    float *bias;
+} t_lasso;
+
+static void *lasso_new(void)
+{
+    t_lasso *lasso = calloc(1, sizeof(t_lasso));
+    lasso->lambda = 0.01f;
+    lasso->ratio = 1;
+    lasso->path = 20;
+    lasso->iterations = 1000;
+    lasso->tolerance = 1e-4f;
+    return lasso;
+}
+
+static void lasso_free(void *state)
+{
+    t_lasso *lasso = state;
+    free(lasso->row_start);
+    free(lasso->cols);
+    free(lasso->values);
+    free(lasso->bias);
+    free(lasso);
+}
+
+static int lasso_set(void *state, const char *param, int argc,
+                     const float *argv)
+{
+    t_lasso *lasso = state;
+    if (argc != 1 || argv[0] < 0)
+        return 1;
+    if (strcmp(param, "lambda") == 0)
+        lasso->lambda = argv[0];
+    else if (strcmp(param, "ratio") == 0 && argv[0] <= 1)
+        lasso->ratio = argv[0];
+    else if (strcmp(param, "path") == 0 && argv[0] >= 1)
+        lasso->path = (int)argv[0];
+    else if (strcmp(param, "iterations") == 0 && argv[0] >= 1)
+        lasso->iterations = (int)argv[0];
+    else if (strcmp(param, "tolerance") == 0)
+        lasso->tolerance = argv[0];
+    else
+        return 1;
+    return 0;
+}
+
+// Coordinate descent with covariance updates: resid[j] holds c[j] minus
+// row j of the Gram matrix times w, and is revised only when a weight
+// actually changes.
+static void lasso_descend(const t_lasso *lasso, const double *gram,
+                          double *w, double *resid, int n, double lambda)
+{
+    int j, k, sweep;
+    double l1 = lambda * lasso->ratio, l2 = lambda * (1 - lasso->ratio);
+
+    for (sweep = 0; sweep < lasso->iterations; sweep++) {
+        double largest = 0;
+        for (j = 0; j < n; j++) {
+            double gjj = gram[j * n + j];
+            if (gjj <= 0)
+                continue;
+            double rho = resid[j] + gjj * w[j], next = 0;
+            if (rho > l1)
+                next = (rho - l1) / (gjj + l2);
+            else if (rho < -l1)
+                next = (rho + l1) / (gjj + l2);
+            double d = next - w[j];
+            if (d == 0)
+                continue;
+            w[j] = next;
+            for (k = 0; k < n; k++)
+                resid[k] -= gram[k * n + j] * d;
+            if (fabs(d) > largest)
+                largest = fabs(d);
+        }
+        if (largest < lasso->tolerance)
+            break;
+    }
+}
+
+static int lasso_train(void *state, const float *inputs, const float *outputs,
+                       const float *weights, int num_rows, int size_in,
+                       int size_out)
+{
+    t_lasso *lasso = state;
+    int i, j, k, r, step, n = size_in, nnz = 0;
+    double *mean = calloc(n, sizeof(double));
+    double *scale = calloc(n, sizeof(double));
+    double *gram = calloc(n * n, sizeof(double));
+    double *c = malloc(n * sizeof(double));
+    double *w = calloc(n * size_out, sizeof(double));
+    double *resid = malloc(n * sizeof(double));
+    double *ymean = calloc(size_out, sizeof(double));
+    double x[n], total = 0;
+
+    // standardise the inputs so that one penalty suits them all; sums over
+    // rows are weighted and divided by the total weight
+    for (r = 0; r < num_rows; r++) {
+        double wr = weights ? weights[r] : 1;
+        for (j = 0; j < n; j++)
+            mean[j] += wr * inputs[r * n + j];
+        for (i = 0; i < size_out; i++)
+            ymean[i] += wr * outputs[r * size_out + i];
+        total += wr;
+    }
+    for (j = 0; j < n; j++)
+        mean[j] /= total;
+    for (i = 0; i < size_out; i++)
+        ymean[i] /= total;
+    for (r = 0; r < num_rows; r++) {
+        double wr = weights ? weights[r] : 1;
+        for (j = 0; j < n; j++) {
+            double d = inputs[r * n + j] - mean[j];
+            scale[j] += wr * d * d;
+        }
+    }
+    for (j = 0; j < n; j++) {
+        scale[j] = sqrt(scale[j] / total);
+        scale[j] = scale[j] > 1e-12 ? 1 / scale[j] : 0;
+    }
+    for (r = 0; r < num_rows; r++) {
+        double wr = weights ? weights[r] : 1;
+        for (j = 0; j < n; j++)
+            x[j] = (inputs[r * n + j] - mean[j]) * scale[j];
+        for (j = 0; j < n; j++) {
+            for (k = 0; k <= j; k++)
+                gram[j * n + k] += wr * x[j] * x[k];
+        }
+    }
+    for (j = 0; j < n; j++) {
+        for (k = 0; k <= j; k++) {
+            gram[j * n + k] /= total;
+            gram[k * n + j] = gram[j * n + k];
+        }
+    }
+
+    for (i = 0; i < size_out; i++) {
+        double *wi = w + i * n, lambda_max = 0;
+        memset(c, 0, n * sizeof(double));
+        for (r = 0; r < num_rows; r++) {
+            double y = outputs[r * size_out + i] - ymean[i];
+            if (weights)
+                y *= weights[r];
+            for (j = 0; j < n; j++)
+                c[j] += (inputs[r * n + j] - mean[j]) * scale[j] * y;
+        }
+        for (j = 0; j < n; j++) {
+            c[j] /= total;
+            resid[j] = c[j];
+            if (fabs(c[j]) > lambda_max)
+                lambda_max = fabs(c[j]);
+        }
+        // a pure ridge penalty has no lambda that zeroes everything, so
+        // walk down from the same scale
+        if (lasso->ratio > 0)
+            lambda_max /= lasso->ratio;
+        for (step = 1; step <= lasso->path; step++) {
+            double lambda = lambda_max * pow(lasso->lambda,
+                                             (double)step / lasso->path);
+            lasso_descend(lasso, gram, wi, resid, n, lambda);
+        }
+        for (j = 0; j < n; j++) {
+            if (wi[j] != 0)
+                nnz++;
+        }
+    }
+
+    free(lasso->row_start);
+    free(lasso->cols);
+    free(lasso->values);
+    free(lasso->bias);
+    lasso->row_start = malloc((size_out + 1) * sizeof(int));
+    lasso->cols = malloc((nnz ? nnz : 1) * sizeof(int));
+    lasso->values = malloc((nnz ? nnz : 1) * sizeof(float));
+    lasso->bias = malloc(size_out * sizeof(float));
+    lasso->size_in = size_in;
+    lasso->size_out = size_out;
+
+    // undo the standardisation while packing the rows
+    for (i = 0, k = 0; i < size_out; i++) {
+        double b = ymean[i];
+        lasso->row_start[i] = k;
+        for (j = 0; j < n; j++) {
+            double wij = w[i * n + j] * scale[j];
+            if (wij == 0)
+                continue;
+            lasso->cols[k] = j;
+            lasso->values[k++] = (float)wij;
+            b -= wij * mean[j];
+        }
+        lasso->bias[i] = (float)b;
+    }
+    lasso->row_start[size_out] = k;
+
+    free(mean);
+    free(scale);
+    free(gram);
+    free(c);
+    free(w);
+    free(resid);
+    free(ymean);
+    return 0;
+}
+
+static void lasso_evaluate(void *state, const float *in, float *out)
+{
+    const t_lasso *lasso = state;
+    int i, k;
+    for (i = 0; i < lasso->size_out; i++) {
+        float y = lasso->bias[i];
+        for (k = lasso->row_start[i]; k < lasso->row_start[i + 1]; k++)
+            y += lasso->values[k] * in[lasso->cols[k]];
+        out[i] = y;
+    }
+}
+
+static void lasso_batch(void *state, const float *inputs, float *outputs,
+                        int num_rows)
+{
+    const t_lasso *lasso = state;
+    int r;
+    for (r = 0; r < num_rows; r++)
+        lasso_evaluate(state, inputs + (long)r * lasso->size_in,
+                       outputs + (long)r * lasso->size_out);
+}
+
+static int lasso_affine(void *state, float *weights, float *bias)
+{
+    const t_lasso *lasso = state;
+    int i, k, size_out = lasso->size_out;
+    memset(weights, 0, lasso->size_in * size_out * sizeof(float));
+    for (i = 0; i < size_out; i++) {
+        for (k = lasso->row_start[i]; k < lasso->row_start[i + 1]; k++)
+            weights[lasso->cols[k] * size_out + i] = lasso->values[k];
+    }
+    memcpy(bias, lasso->bias, size_out * sizeof(float));
+    return 0;
+}
+
+const t_impmap_engine impmap_engine_lasso = {
+    "lasso",
+    lasso_new,
+    lasso_free,
+    lasso_set,
+    lasso_train,
+    lasso_evaluate,
+    0,
+    lasso_batch,
+    lasso_affine,
+    0,
+    0,
+    0
+};
@@ -0,0 +1,210 @@
+//
+// impmap_log.c
+// compact append-only binary logs of timestamped vector updates
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#include "impmap_log.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define HEADER_SIZE 8
+#define MAX_NAME    1024
+
+static void log_free_layout(t_impmap_log *log)
+{
+    int d, i;
+    for (d = 0; d < 2; d++) {
+        for (i = 0; i < log->num_signals[d]; i++)
+            free(log->signals[d][i].name);
+        free(log->signals[d]);
+        log->signals[d] = 0;
+        log->num_signals[d] = 0;
+    }
+}
+
+// Each direction is a signal count followed by the length, name length and
+// name of each signal.
+static int log_write_layout(FILE *file, const t_impmap_log_signal *signals,
+                            int num_signals)
+{
+    uint16_t n = num_signals, length, size;
+    int i;
+    if (fwrite(&n, 2, 1, file) != 1)
+        return 1;
+    for (i = 0; i < num_signals; i++) {
+        length = signals[i].length;
+        size = strlen(signals[i].name);
+        if (fwrite(&length, 2, 1, file) != 1 || fwrite(&size, 2, 1, file) != 1
+            || fwrite(signals[i].name, 1, size, file) != size)
+            return 1;
+    }
+    return 0;
+}
+
+static int log_read_layout(FILE *file, t_impmap_log *log, int direction)
+{
+    uint16_t n, length, size;
+    int i;
+    if (fread(&n, 2, 1, file) != 1)
+        return 1;
+    log->signals[direction] = calloc(n ? n : 1, sizeof(t_impmap_log_signal));
+    for (i = 0; i < n; i++) {
+        t_impmap_log_signal *sig = log->signals[direction] + i;
+        if (fread(&length, 2, 1, file) != 1 || fread(&size, 2, 1, file) != 1
+            || size > MAX_NAME)
+            return 1;
+        sig->name = malloc(size + 1);
+        log->num_signals[direction]++;
+        if (fread(sig->name, 1, size, file) != size)
+            return 1;
+        sig->name[size] = 0;
+        sig->length = length;
+    }
+    return 0;
+}
+
+static int log_same_layout(const t_impmap_log_signal *a, int num_a,
+                           const t_impmap_log_signal *b, int num_b)
+{
+    int i;
+    if (num_a != num_b)
+        return 0;
+    for (i = 0; i < num_a; i++) {
+        if (a[i].length != b[i].length || strcmp(a[i].name, b[i].name) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+// *********************************************************
+// -(open)--------------------------------------------------
+// Logs opened for writing are appended to; a header holding the given
+// layout is only written if the file is empty, and appending to a log of a
+// different layout fails.  Logs opened for reading load their layout into
+// 'num_signals' and 'signals'.  Returns 0 if the file cannot be opened or
+// is not a log of a compatible version.
+t_impmap_log *impmap_log_open(const char *path, int write,
+                              const t_impmap_log_signal *inputs,
+                              int num_inputs,
+                              const t_impmap_log_signal *outputs,
+                              int num_outputs)
+{
+    char header[HEADER_SIZE];
+    uint32_t version = IMPMAP_LOG_VERSION;
+    t_impmap_log *log = 0;
+    FILE *file = fopen(path, write ? "a+b" : "rb");
+    if (!file)
+        return 0;
+
+    if (write) {
+        fseek(file, 0, SEEK_END);
+        if (ftell(file) == 0) {
+            memcpy(header, IMPMAP_LOG_MAGIC, 4);
+            memcpy(header + 4, &version, 4);
+            if (fwrite(header, HEADER_SIZE, 1, file) != 1
+                || log_write_layout(file, inputs, num_inputs)
+                || log_write_layout(file, outputs, num_outputs)) {
+                fclose(file);
+                return 0;
+            }
+            log = calloc(1, sizeof(t_impmap_log));
+            log->file = file;
+            log->writing = 1;
+            return log;
+        }
+        rewind(file);
+    }
+    if (fread(header, HEADER_SIZE, 1, file) != 1
+        || memcmp(header, IMPMAP_LOG_MAGIC, 4) != 0)
+        goto bad_header;
+    memcpy(&version, header + 4, 4);
+    if (version != IMPMAP_LOG_VERSION)
+        goto bad_header;
+
+    log = calloc(1, sizeof(t_impmap_log));
+    log->file = file;
+    log->writing = write;
+    if (log_read_layout(file, log, IMPMAP_LOG_INPUT)
+        || log_read_layout(file, log, IMPMAP_LOG_OUTPUT))
+        goto bad_header;
+    if (write) {
+        // records appended must refer to the same layout as those before
+        if (!log_same_layout(inputs, num_inputs, log->signals[IMPMAP_LOG_INPUT],
+                             log->num_signals[IMPMAP_LOG_INPUT])
+            || !log_same_layout(outputs, num_outputs,
+                                log->signals[IMPMAP_LOG_OUTPUT],
+                                log->num_signals[IMPMAP_LOG_OUTPUT]))
+            goto bad_header;
+        fseek(file, 0, SEEK_END);
+    }
+    return log;
+
+bad_header:
+    if (log) {
+        log_free_layout(log);
+        free(log);
+    }
+    fclose(file);
+    return 0;
+}
+
+// *********************************************************
+// -(close)-------------------------------------------------
+void impmap_log_close(t_impmap_log *log)
+{
+    if (!log)
+        return;
+    if (log->file)
+        fclose(log->file);
+    log_free_layout(log);
+    free(log);
+}
+
+// *********************************************************
+// -(write one record)--------------------------------------
+int impmap_log_write(t_impmap_log *log, const t_impmap_log_record *rec,
+                     const float *values)
+{
+    if (!log || !log->writing)
+        return 1;
+    if (fwrite(rec, sizeof(t_impmap_log_record), 1, log->file) != 1)
+        return 1;
+    if (rec->length && fwrite(values, sizeof(float), rec->length,
+                              log->file) != rec->length)
+        return 1;
+    log->count++;
+    return 0;
+}
+
+// *********************************************************
+// -(read one record)---------------------------------------
+// Elements beyond max_length are skipped.  Returns non-zero at the end of
+// the log or on a truncated record.
+int impmap_log_read(t_impmap_log *log, t_impmap_log_record *rec,
+                    float *values, int max_length)
+{
+    if (!log || log->writing)
+        return 1;
+    if (fread(rec, sizeof(t_impmap_log_record), 1, log->file) != 1)
+        return 1;
+    int length = rec->length < max_length ? rec->length : max_length;
+    if (length && fread(values, sizeof(float), length, log->file) != (size_t)length)
+        return 1;
+    if (rec->length > length)
+        fseek(log->file, (rec->length - length) * sizeof(float), SEEK_CUR);
+    log->count++;
+    return 0;
+}
+
+// *********************************************************
+// -(record timetag in seconds)-----------------------------
+double impmap_log_record_time(const t_impmap_log_record *rec)
+{
+    return (double)rec->sec + (double)rec->frac / 4294967296.0;
+}
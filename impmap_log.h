@@ -0,0 +1,71 @@
+//
+// impmap_log.h
+// compact append-only binary logs of timestamped vector updates
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#ifndef IMPMAP_LOG_H
+#define IMPMAP_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// A log is a file header followed by fixed-size record headers, each
+// immediately followed by 'length' native-endian 32-bit floats.  Logs are
+// meant to be replayed on the machine that recorded them.  The file header
+// holds the input and output signal layouts the records refer to (the
+// name and length of each signal in vector order), so that a log can be
+// replayed after signals have been added or removed.
+
+#define IMPMAP_LOG_MAGIC        "IMPL"
+#define IMPMAP_LOG_VERSION      2
+#define IMPMAP_LOG_ALL_SIGNALS  0xFFFF  // record holds a whole vector
+
+typedef enum {
+    IMPMAP_LOG_INPUT  = 0,
+    IMPMAP_LOG_OUTPUT = 1
+} t_impmap_log_direction;
+
+typedef struct _impmap_log_record
+{
+    uint32_t sec;               // timetag seconds
+    uint32_t frac;              // timetag fraction
+    uint16_t index;             // signal index in sorted vector order
+    uint16_t offset;            // offset of the first element in the vector
+    uint16_t length;            // number of floats following the header
+    uint16_t direction;         // t_impmap_log_direction
+} t_impmap_log_record;
+
+typedef struct _impmap_log_signal
+{
+    char *name;
+    int length;
+} t_impmap_log_signal;
+
+typedef struct _impmap_log
+{
+    FILE *file;
+    int writing;
+    long count;                 // records read or written so far
+    int num_signals[2];         // layout of the log, per direction
+    t_impmap_log_signal *signals[2];
+} t_impmap_log;
+
+t_impmap_log *impmap_log_open(const char *path, int write,
+                              const t_impmap_log_signal *inputs,
+                              int num_inputs,
+                              const t_impmap_log_signal *outputs,
+                              int num_outputs);
+void impmap_log_close(t_impmap_log *log);
+int impmap_log_write(t_impmap_log *log, const t_impmap_log_record *rec,
+                     const float *values);
+int impmap_log_read(t_impmap_log *log, t_impmap_log_record *rec,
+                    float *values, int max_length);
+double impmap_log_record_time(const t_impmap_log_record *rec);
+
+#endif // IMPMAP_LOG_H
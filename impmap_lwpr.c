@@ -0,0 +1,411 @@
+//
+// impmap_lwpr.c
+// locally weighted regression engine that learns one sample at a time
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#include "impmap_model.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define LWPR_MAX_FIELDS 4096
+#define LWPR_PRIOR      10      // initial diagonal of each field's inverse
+                                // covariance, i.e. a weak ridge prior
+#define LWPR_DRIFT      2       // start again once an input's spread has
+                                // changed by more than this factor
+
+// A set of Gaussian receptive fields, each holding a linear model of the
+// outputs in coordinates centred on the field and scaled by its width.
+// Each sample updates the fields it activates by weighted recursive least
+// squares, and creates a field of its own if none is active enough, so
+// learning costs the same however many samples came before.  The
+// prediction is the activation-weighted mean of the active fields' local
+// models.  Activations are computed for every field with an early exit
+// once a field is known to be inactive, so only the few active fields
+// run their models.
+//
+// Field widths are given in standard deviations of each input, measured
+// from the snapshots when the engine starts from scratch.  The spread of
+// the samples seen is tracked as they arrive, and once it has moved by more
+// than LWPR_DRIFT from the one the widths were measured from, or an input
+// that did not vary (as with a single snapshot) starts to, the engine asks
+// to be retrained and starts again from scratch.  Samples the
+// engine has already seen are recognised by a running hash, so retraining
+// after adding snapshots only learns the new ones.  A snapshot standing
+// for several merged ones updates the fields with its weight times their
+// activation, as if it had been seen that many times.  (Unlike full LWPR the
+// distance metric of each field stays fixed and the local models regress
+// on all inputs rather than on learned projections.)
+
+typedef struct _field
+{
+    float *centre;              // size_in
+    double *inverse;            // size_in + 1 squared, for the RLS update
+    float *beta;                // size_in + 1 rows of size_out, bias last
+} t_field;
+
+typedef struct _lwpr
+{
+    float width;
+    float generate;             // create a field below this activation
+    float cutoff;               // ignore fields below this activation
+    float forget;               // RLS forgetting factor, 1 for none
+    int reset;                  // parameters changed since the last start
+    int size_in;
+    int size_out;
+    float *metric;              // 1 / (width * std) for each input
+    float *spread;              // the std it was measured from, 0 if none
+    double *in_mean;            // running weighted mean of the inputs
+    double *in_var;             // and sum of weighted squared deviations
+    t_field *fields;
+    int num_fields;
+    int max_fields;
+    float *mean;                // running mean of the outputs
+    long num_seen;
+    double total;               // weight of the samples seen
+    unsigned int hash;          // of the samples seen, in order
+} t_lwpr;
+
+static void *lwpr_new(void)
+{
+    t_lwpr *lwpr = calloc(1, sizeof(t_lwpr));
+    lwpr->width = 0.3f;
+    lwpr->generate = 0.2f;
+    lwpr->cutoff = 0.001f;
+    lwpr->forget = 1;
+    return lwpr;
+}
+
+static void lwpr_clear(t_lwpr *lwpr)
+{
+    int k;
+    for (k = 0; k < lwpr->num_fields; k++) {
+        free(lwpr->fields[k].centre);
+        free(lwpr->fields[k].inverse);
+        free(lwpr->fields[k].beta);
+    }
+    lwpr->num_fields = 0;
+    lwpr->num_seen = 0;
+    lwpr->total = 0;
+    lwpr->hash = 2166136261u;
+}
+
+static void lwpr_free(void *state)
+{
+    t_lwpr *lwpr = state;
+    lwpr_clear(lwpr);
+    free(lwpr->fields);
+    free(lwpr->metric);
+    free(lwpr->spread);
+    free(lwpr->in_mean);
+    free(lwpr->in_var);
+    free(lwpr->mean);
+    free(lwpr);
+}
+
+static int lwpr_set(void *state, const char *param, int argc,
+                    const float *argv)
+{
+    t_lwpr *lwpr = state;
+    if (argc != 1 || argv[0] <= 0)
+        return 1;
+    if (strcmp(param, "width") == 0)
+        lwpr->width = argv[0];
+    else if (strcmp(param, "generate") == 0 && argv[0] < 1)
+        lwpr->generate = argv[0];
+    else if (strcmp(param, "cutoff") == 0 && argv[0] < 1)
+        lwpr->cutoff = argv[0];
+    else if (strcmp(param, "forget") == 0 && argv[0] <= 1)
+        lwpr->forget = argv[0];
+    else
+        return 1;
+    lwpr->reset = 1;
+    return 0;
+}
+
+// FNV-1a over the bits of one sample
+static unsigned int lwpr_hash(unsigned int hash, const float *values, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        unsigned int bits;
+        memcpy(&bits, values + i, sizeof(bits));
+        hash = (hash ^ bits) * 16777619u;
+    }
+    return hash;
+}
+
+// Activation of a field, or 0 as soon as it is known to be below cutoff.
+// Fills z with the scaled offset from the field's centre.
+static float lwpr_activation(const t_lwpr *lwpr, const t_field *f,
+                             const float *in, float *z)
+{
+    int j;
+    float dist = 0, limit = -2 * logf(lwpr->cutoff);
+    for (j = 0; j < lwpr->size_in; j++) {
+        z[j] = (in[j] - f->centre[j]) * lwpr->metric[j];
+        dist += z[j] * z[j];
+        if (dist > limit)
+            return 0;
+    }
+    return expf(-0.5f * dist);
+}
+
+static void lwpr_predict(const t_lwpr *lwpr, const float *in, float *out)
+{
+    int i, j, k, n = lwpr->size_in + 1, size_out = lwpr->size_out;
+    float z[n], y[size_out];
+    double total = 0;
+
+    for (i = 0; i < size_out; i++)
+        out[i] = 0;
+    z[n - 1] = 1;
+    for (k = 0; k < lwpr->num_fields; k++) {
+        const t_field *f = lwpr->fields + k;
+        float w = lwpr_activation(lwpr, f, in, z);
+        if (w <= lwpr->cutoff)
+            continue;
+        for (i = 0; i < size_out; i++)
+            y[i] = 0;
+        for (j = 0; j < n; j++) {
+            const float *b = f->beta + j * size_out;
+            for (i = 0; i < size_out; i++)
+                y[i] += b[i] * z[j];
+        }
+        for (i = 0; i < size_out; i++)
+            out[i] += w * y[i];
+        total += w;
+    }
+    if (total > 0) {
+        for (i = 0; i < size_out; i++)
+            out[i] /= total;
+    }
+    else
+        memcpy(out, lwpr->mean, size_out * sizeof(float));
+}
+
+static void lwpr_add_field(t_lwpr *lwpr, const float *in, const float *out)
+{
+    int j, n = lwpr->size_in + 1, size_out = lwpr->size_out;
+    if (lwpr->num_fields == lwpr->max_fields) {
+        lwpr->max_fields = lwpr->max_fields ? lwpr->max_fields * 2 : 16;
+        lwpr->fields = realloc(lwpr->fields,
+                               lwpr->max_fields * sizeof(t_field));
+    }
+    t_field *f = lwpr->fields + lwpr->num_fields++;
+    f->centre = malloc(lwpr->size_in * sizeof(float));
+    memcpy(f->centre, in, lwpr->size_in * sizeof(float));
+    f->inverse = calloc(n * n, sizeof(double));
+    for (j = 0; j < n; j++)
+        f->inverse[j * n + j] = LWPR_PRIOR;
+    f->beta = calloc(n * size_out, sizeof(float));
+    memcpy(f->beta + (n - 1) * size_out, out, size_out * sizeof(float));
+}
+
+// Weighted recursive least squares: with u = P z, the gain is
+// u / (forget / w + z.u), the coefficients move by the gain times the
+// error and P loses the gain times u^T before being divided by forget.
+static void lwpr_update_field(const t_lwpr *lwpr, t_field *f, const float *z,
+                              float w, const float *out)
+{
+    int i, j, k, n = lwpr->size_in + 1, size_out = lwpr->size_out;
+    double u[n], e[size_out], denom = lwpr->forget / w;
+
+    for (j = 0; j < n; j++) {
+        double s = 0;
+        for (k = 0; k < n; k++)
+            s += f->inverse[j * n + k] * z[k];
+        u[j] = s;
+        denom += z[j] * s;
+    }
+    for (i = 0; i < size_out; i++)
+        e[i] = out[i];
+    for (j = 0; j < n; j++) {
+        const float *b = f->beta + j * size_out;
+        for (i = 0; i < size_out; i++)
+            e[i] -= b[i] * z[j];
+    }
+    for (j = 0; j < n; j++) {
+        double gain = u[j] / denom;
+        float *b = f->beta + j * size_out;
+        for (i = 0; i < size_out; i++)
+            b[i] += (float)(gain * e[i]);
+        for (k = 0; k < n; k++)
+            f->inverse[j * n + k] = (f->inverse[j * n + k] - gain * u[k])
+                                    / lwpr->forget;
+    }
+}
+
+static void lwpr_learn_weighted(t_lwpr *lwpr, const float *in,
+                                const float *out, float weight)
+{
+    int i, k, n = lwpr->size_in + 1;
+    float z[n], best = 0;
+
+    z[n - 1] = 1;
+    for (k = 0; k < lwpr->num_fields; k++) {
+        t_field *f = lwpr->fields + k;
+        float w = lwpr_activation(lwpr, f, in, z);
+        if (w <= lwpr->cutoff)
+            continue;
+        lwpr_update_field(lwpr, f, z, w * weight, out);
+        if (w > best)
+            best = w;
+    }
+    if (best < lwpr->generate && lwpr->num_fields < LWPR_MAX_FIELDS)
+        lwpr_add_field(lwpr, in, out);
+
+    lwpr->num_seen++;
+    lwpr->total += weight;
+    for (i = 0; i < lwpr->size_in; i++) {
+        double d = in[i] - lwpr->in_mean[i];
+        lwpr->in_mean[i] += d * weight / lwpr->total;
+        lwpr->in_var[i] += weight * d * (in[i] - lwpr->in_mean[i]);
+    }
+    for (i = 0; i < lwpr->size_out; i++)
+        lwpr->mean[i] += (out[i] - lwpr->mean[i]) * weight / lwpr->total;
+    lwpr->hash = lwpr_hash(lwpr->hash, in, lwpr->size_in);
+    lwpr->hash = lwpr_hash(lwpr->hash, out, lwpr->size_out);
+    lwpr->hash = lwpr_hash(lwpr->hash, &weight, 1);
+}
+
+// Non-zero if the spread of some input has moved too far from the one the
+// metric was measured from.
+static int lwpr_drifted(const t_lwpr *lwpr, const double *spread)
+{
+    int j;
+    for (j = 0; j < lwpr->size_in; j++) {
+        double old = lwpr->spread[j];
+        if (old <= 1e-12 ? spread[j] > 1e-12
+            : spread[j] > old * LWPR_DRIFT || spread[j] * LWPR_DRIFT < old)
+            return 1;
+    }
+    return 0;
+}
+
+static void lwpr_seen_spread(const t_lwpr *lwpr, double *spread)
+{
+    int j;
+    for (j = 0; j < lwpr->size_in; j++)
+        spread[j] = lwpr->total > 0
+                    ? sqrt(lwpr->in_var[j] / lwpr->total) : 0;
+}
+
+// Asks to be retrained, which starts again, once the inputs have spread.
+static int lwpr_learn(void *state, const float *in, const float *out)
+{
+    t_lwpr *lwpr = state;
+    double spread[lwpr->size_in];
+    lwpr_learn_weighted(lwpr, in, out, 1);
+    lwpr_seen_spread(lwpr, spread);
+    return lwpr_drifted(lwpr, spread);
+}
+
+// Weighted standard deviation of each input over the rows.
+static void lwpr_rows_spread(const float *inputs, const float *weights,
+                             int num_rows, int size_in, double *spread)
+{
+    int j, r;
+    for (j = 0; j < size_in; j++) {
+        double mean = 0, var = 0, total = 0;
+        for (r = 0; r < num_rows; r++) {
+            double w = weights ? weights[r] : 1;
+            double d = inputs[(long)r * size_in + j] - mean;
+            total += w;
+            mean += d * w / total;
+            var += w * d * (inputs[(long)r * size_in + j] - mean);
+        }
+        spread[j] = total > 0 ? sqrt(var / total) : 0;
+    }
+}
+
+// Rows are newest first, so samples already seen are the last rows.
+static int lwpr_train(void *state, const float *inputs, const float *outputs,
+                      const float *weights, int num_rows, int size_in,
+                      int size_out)
+{
+    t_lwpr *lwpr = state;
+    int j, r, start = 0;
+    float one = 1;
+    double spread[size_in];
+
+    if (!lwpr->reset && lwpr->num_seen && lwpr->size_in == size_in
+        && lwpr->size_out == size_out && lwpr->num_seen <= num_rows) {
+        unsigned int hash = 2166136261u;
+        for (r = num_rows - 1; r >= num_rows - lwpr->num_seen; r--) {
+            hash = lwpr_hash(hash, inputs + (long)r * size_in, size_in);
+            hash = lwpr_hash(hash, outputs + (long)r * size_out, size_out);
+            hash = lwpr_hash(hash, weights ? weights + r : &one, 1);
+        }
+        if (hash == lwpr->hash)
+            start = (int)lwpr->num_seen;
+    }
+    lwpr_rows_spread(inputs, weights, num_rows, size_in, spread);
+    if (start && lwpr_drifted(lwpr, spread))
+        start = 0;
+    if (!start) {
+        lwpr_clear(lwpr);
+        lwpr->reset = 0;
+        lwpr->size_in = size_in;
+        lwpr->size_out = size_out;
+        free(lwpr->metric);
+        free(lwpr->spread);
+        free(lwpr->in_mean);
+        free(lwpr->in_var);
+        free(lwpr->mean);
+        lwpr->metric = malloc(size_in * sizeof(float));
+        lwpr->spread = malloc(size_in * sizeof(float));
+        lwpr->in_mean = calloc(size_in, sizeof(double));
+        lwpr->in_var = calloc(size_in, sizeof(double));
+        lwpr->mean = calloc(size_out, sizeof(float));
+        // an input that has not varied keeps no spread, so the metric is
+        // measured again as soon as it does
+        for (j = 0; j < size_in; j++) {
+            lwpr->spread[j] = spread[j] > 1e-12 ? (float)spread[j] : 0;
+            lwpr->metric[j] = (float)(1 / (lwpr->width
+                                           * (spread[j] > 1e-12
+                                              ? spread[j] : 1)));
+        }
+    }
+    for (r = num_rows - 1 - start; r >= 0; r--)
+        lwpr_learn_weighted(lwpr, inputs + (long)r * size_in,
+                            outputs + (long)r * size_out,
+                            weights ? weights[r] : 1);
+    return 0;
+}
+
+static void lwpr_evaluate(void *state, const float *in, float *out)
+{
+    lwpr_predict(state, in, out);
+}
+
+static void lwpr_batch(void *state, const float *inputs, float *outputs,
+                       int num_rows)
+{
+    const t_lwpr *lwpr = state;
+    int r;
+    for (r = 0; r < num_rows; r++)
+        lwpr_predict(lwpr, inputs + (long)r * lwpr->size_in,
+                     outputs + (long)r * lwpr->size_out);
+}
+
+const t_impmap_engine impmap_engine_lwpr = {
+    "lwpr",
+    lwpr_new,
+    lwpr_free,
+    lwpr_set,
+    lwpr_train,
+    lwpr_evaluate,
+    0,
+    lwpr_batch,
+    0,
+    0,
+    lwpr_learn,
+    0
+};
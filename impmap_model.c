@@ -0,0 +1,992 @@
+//
+// impmap_model.c
+// native mapping engines for implicitmap
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#include "impmap_model.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#define RENDER_MIN_ROWS 1024    // rows per thread below which threads don't pay
+#define LINEAR_BLOCK    16      // rows sharing each weight column in batch()
+#define JACOBI_SWEEPS   50      // rotation sweeps before giving up
+#define PCA_MIN_VARIANCE 1e-9   // relative variance of components worth keeping
+
+static void cache_alloc(t_impmap_cache *cache, int size_in, int size_out);
+static void cache_free(t_impmap_cache *cache);
+static int pca_fit(t_impmap_pca *pca, const float *inputs, int num_rows,
+                   int size_in);
+static void pca_project(const t_impmap_pca *pca, int size_in, const float *in,
+                        float *out);
+static void pca_free(t_impmap_pca *pca);
+static void model_batch(const t_impmap_model *model, const float *inputs,
+                        float *outputs, int num_rows);
+
+static const t_impmap_engine *engines[] = {
+    &impmap_engine_linear,
+    &impmap_engine_lasso,
+    &impmap_engine_rff,
+    &impmap_engine_delaunay,
+    &impmap_engine_gp,
+    &impmap_engine_lwpr,
+    0
+};
+
+// *********************************************************
+// -(engine lookup)-----------------------------------------
+const t_impmap_engine *impmap_engine_find(const char *name)
+{
+    int i;
+    for (i = 0; engines[i]; i++) {
+        if (strcmp(engines[i]->name, name) == 0)
+            return engines[i];
+    }
+    return 0;
+}
+
+// *********************************************************
+// -(new model)---------------------------------------------
+t_impmap_model *impmap_model_new(const char *engine)
+{
+    const t_impmap_engine *e = impmap_engine_find(engine);
+    if (!e)
+        return 0;
+    t_impmap_model *model = calloc(1, sizeof(t_impmap_model));
+    model->engine = e;
+    model->state = e->new();
+    if (!model->state) {
+        free(model);
+        return 0;
+    }
+    return model;
+}
+
+// *********************************************************
+// -(new untrained model with the same settings)------------
+// Same engine, engine parameters, cache size and PCA threshold.
+t_impmap_model *impmap_model_new_like(const t_impmap_model *model)
+{
+    const t_impmap_param *p;
+    t_impmap_model *like = impmap_model_new(model->engine->name);
+    if (!like)
+        return 0;
+    for (p = model->params; p; p = p->next)
+        impmap_model_set(like, p->name, p->argc, p->argv);
+    if (model->cache.num_entries)
+        impmap_model_set_cache(like, model->cache.num_entries,
+                               model->cache.epsilon);
+    impmap_model_set_pca(like, model->pca.threshold);
+    return like;
+}
+
+// *********************************************************
+// -(free model)--------------------------------------------
+void impmap_model_free(t_impmap_model *model)
+{
+    t_impmap_param *p;
+    if (!model)
+        return;
+    model->engine->free(model->state);
+    cache_free(&model->cache);
+    pca_free(&model->pca);
+    while ((p = model->params)) {
+        model->params = p->next;
+        free(p->name);
+        free(p->argv);
+        free(p);
+    }
+    free(model);
+}
+
+// *********************************************************
+// -(set engine parameter)----------------------------------
+// Parameters the engine accepts are recorded, replacing an earlier value.
+int impmap_model_set(t_impmap_model *model, const char *param, int argc,
+                     const float *argv)
+{
+    t_impmap_param *p;
+    if (!model->engine->set
+        || model->engine->set(model->state, param, argc, argv))
+        return 1;
+    for (p = model->params; p; p = p->next) {
+        if (strcmp(p->name, param) == 0)
+            break;
+    }
+    if (!p) {
+        p = malloc(sizeof(t_impmap_param));
+        p->name = strdup(param);
+        p->next = model->params;
+        model->params = p;
+    }
+    else
+        free(p->argv);
+    p->argc = argc;
+    p->argv = malloc((argc + 1) * sizeof(float));
+    memcpy(p->argv, argv, argc * sizeof(float));
+    return 0;
+}
+
+// *********************************************************
+// -(train)-------------------------------------------------
+int impmap_model_train(t_impmap_model *model, const float *inputs,
+                       const float *outputs, const float *weights,
+                       int num_rows, int size_in, int size_out)
+{
+    t_impmap_pca *pca = &model->pca;
+    float *projected = 0;
+    int r, result, size = size_in;
+
+    model->trained = 0;
+    if (num_rows < 1 || size_in < 1 || size_out < 1)
+        return 1;
+    pca_free(pca);
+    if (pca->threshold > 0) {
+        if (pca_fit(pca, inputs, num_rows, size_in))
+            return 1;
+        size = pca->size;
+        projected = malloc((long)num_rows * size * sizeof(float));
+        for (r = 0; r < num_rows; r++)
+            pca_project(pca, size_in, inputs + (long)r * size_in,
+                        projected + (long)r * size);
+        inputs = projected;
+    }
+    result = model->engine->train(model->state, inputs, outputs, weights,
+                                  num_rows, size, size_out);
+    free(projected);
+    if (result)
+        return 1;
+    model->size_in = size_in;
+    model->size_out = size_out;
+    model->trained = 1;
+    model->stale = 0;
+    if (model->cache.num_entries)
+        cache_alloc(&model->cache, size_in, size_out);
+    return 0;
+}
+
+// *********************************************************
+// -(check model matches the current vectors)---------------
+int impmap_model_ready(t_impmap_model *model, int size_in, int size_out)
+{
+    return model && model->trained && model->size_in == size_in
+           && model->size_out == size_out;
+}
+
+// *********************************************************
+// -(evaluate)----------------------------------------------
+void impmap_model_evaluate(t_impmap_model *model, const float *in, float *out)
+{
+    if (model->pca.size) {
+        pca_project(&model->pca, model->size_in, in, model->pca.scratch);
+        in = model->pca.scratch;
+    }
+    model->engine->evaluate(model->state, in, out);
+}
+
+// *********************************************************
+// -(evaluate many rows)------------------------------------
+// Bypasses the cache.  The engine's incremental state no longer matches
+// the live input afterwards, so the next update is a full evaluation.
+void impmap_model_evaluate_batch(t_impmap_model *model, const float *inputs,
+                                 float *outputs, int num_rows)
+{
+    model_batch(model, inputs, outputs, num_rows);
+    model->stale = 1;
+}
+
+static void model_batch(const t_impmap_model *model, const float *inputs,
+                        float *outputs, int num_rows)
+{
+    const t_impmap_pca *pca = &model->pca;
+    int r, size_in = model->size_in;
+    float *projected = 0;
+
+    if (pca->size) {
+        projected = malloc((long)num_rows * pca->size * sizeof(float));
+        for (r = 0; r < num_rows; r++)
+            pca_project(pca, size_in, inputs + (long)r * size_in,
+                        projected + (long)r * pca->size);
+        inputs = projected;
+        size_in = pca->size;
+    }
+    if (model->engine->batch)
+        model->engine->batch(model->state, inputs, outputs, num_rows);
+    else {
+        for (r = 0; r < num_rows; r++)
+            model->engine->evaluate(model->state,
+                                    inputs + (long)r * size_in,
+                                    outputs + (long)r * model->size_out);
+    }
+    free(projected);
+}
+
+// *********************************************************
+// -(export an affine mapping)------------------------------
+// Fills weights (size_in columns of size_out, so weights[j * size_out + i]
+// is the weight of input j on output i) and bias.  Returns non-zero if the
+// model is untrained or not affine.
+int impmap_model_affine(t_impmap_model *model, float *weights, float *bias)
+{
+    if (!model || !model->trained || !model->engine->affine)
+        return 1;
+    const t_impmap_pca *pca = &model->pca;
+    int i, j, c, size_in = model->size_in, size_out = model->size_out;
+    if (!pca->size)
+        return model->engine->affine(model->state, weights, bias);
+
+    // compose the engine's map of the components with the projection
+    float *reduced = malloc(pca->size * size_out * sizeof(float));
+    if (model->engine->affine(model->state, reduced, bias)) {
+        free(reduced);
+        return 1;
+    }
+    for (j = 0; j < size_in; j++) {
+        for (i = 0; i < size_out; i++) {
+            float w = 0;
+            for (c = 0; c < pca->size; c++)
+                w += pca->components[c * size_in + j]
+                     * reduced[c * size_out + i];
+            weights[j * size_out + i] = w;
+            bias[i] -= w * pca->mean[j];
+        }
+    }
+    free(reduced);
+    return 0;
+}
+
+// *********************************************************
+// -(estimate the output variance)--------------------------
+// Returns non-zero if the model is untrained or cannot estimate it.
+int impmap_model_variance(t_impmap_model *model, const float *in,
+                          float *variance)
+{
+    if (!model || !model->trained || !model->engine->variance)
+        return 1;
+    if (model->pca.size) {
+        pca_project(&model->pca, model->size_in, in, model->pca.scratch);
+        in = model->pca.scratch;
+    }
+    model->engine->variance(model->state, in, variance);
+    return 0;
+}
+
+// *********************************************************
+// -(learn one more sample)---------------------------------
+// Returns non-zero if the model is untrained or cannot learn online, in
+// which case it has to be retrained instead.
+int impmap_model_learn(t_impmap_model *model, const float *in,
+                       const float *out)
+{
+    if (!model || !model->trained || !model->engine->learn)
+        return 1;
+    if (model->pca.size) {
+        pca_project(&model->pca, model->size_in, in, model->pca.scratch);
+        in = model->pca.scratch;
+    }
+    if (model->engine->learn(model->state, in, out))
+        return 1;
+    // earlier evaluations no longer hold
+    if (model->cache.used)
+        memset(model->cache.used, 0, model->cache.num_entries);
+    model->stale = 1;
+    return 0;
+}
+
+// *********************************************************
+// -(rows folded into earlier ones)-------------------------
+int impmap_model_duplicates(t_impmap_model *model)
+{
+    if (!model || !model->trained || !model->engine->duplicates)
+        return 0;
+    return model->engine->duplicates(model->state);
+}
+
+// *********************************************************
+// -(render many rows on worker threads)--------------------
+typedef struct _render_job
+{
+    const t_impmap_model *model;
+    const float *inputs;
+    float *outputs;
+    int num_rows;
+} t_render_job;
+
+static void *render_thread(void *arg)
+{
+    t_render_job *job = arg;
+    model_batch(job->model, job->inputs, job->outputs, job->num_rows);
+    return 0;
+}
+
+// Splits the rows into contiguous slices, one per thread; the calling
+// thread renders the last slice itself.  Engines without batch() are
+// rendered on the calling thread only.  Returns the number of threads used.
+int impmap_model_render(t_impmap_model *model, const float *inputs,
+                        float *outputs, int num_rows, int num_threads)
+{
+    int t, spawned, first = 0;
+
+    if (num_threads > num_rows / RENDER_MIN_ROWS)
+        num_threads = num_rows / RENDER_MIN_ROWS;
+    if (!model->engine->batch || num_threads < 2) {
+        impmap_model_evaluate_batch(model, inputs, outputs, num_rows);
+        return 1;
+    }
+
+    pthread_t threads[num_threads];
+    t_render_job jobs[num_threads];
+    for (t = 0; t < num_threads; t++) {
+        int last = (int)((long)num_rows * (t + 1) / num_threads);
+        jobs[t].model = model;
+        jobs[t].inputs = inputs + (long)first * model->size_in;
+        jobs[t].outputs = outputs + (long)first * model->size_out;
+        jobs[t].num_rows = last - first;
+        first = last;
+    }
+    for (spawned = 0; spawned < num_threads - 1; spawned++) {
+        if (pthread_create(&threads[spawned], 0, render_thread,
+                           &jobs[spawned]))
+            break;
+    }
+    // render whatever could not get a thread here instead
+    for (t = spawned; t < num_threads; t++)
+        render_thread(&jobs[t]);
+    for (t = 0; t < spawned; t++)
+        pthread_join(threads[t], 0);
+    model->stale = 1;
+    return spawned + 1;
+}
+
+// *********************************************************
+// -(evaluate after a partial input change)-----------------
+// A negative num_changed means the changed offsets are unknown.  Returns
+// 1 if the output came from the cache.
+int impmap_model_update(t_impmap_model *model, const float *in, float *out,
+                        const int *changed, int num_changed)
+{
+    t_impmap_cache *cache = &model->cache;
+    int i, size_in = model->size_in, size_out = model->size_out;
+    int *key = 0;
+    unsigned int hash = 2166136261u, slot = 0;
+
+    if (cache->num_entries && cache->keys) {
+        key = cache->scratch;
+        for (i = 0; i < size_in; i++) {
+            // the key holds the bits of the rounded value, which may be
+            // far beyond the range of an int
+            float q = cache->epsilon > 0
+                      ? floorf(in[i] / cache->epsilon + 0.5f) : in[i];
+            memcpy(key + i, &q, sizeof(int));
+            // FNV-1a over the quantised elements
+            hash = (hash ^ (unsigned int)key[i]) * 16777619u;
+        }
+        slot = hash & (cache->num_entries - 1);
+        if (cache->used[slot] && cache->hashes[slot] == hash
+            && memcmp(cache->keys + slot * size_in, key,
+                      size_in * sizeof(int)) == 0) {
+            memcpy(out, cache->outputs + slot * size_out,
+                   size_out * sizeof(float));
+            cache->hits++;
+            // the engine did not see these changes
+            model->stale = 1;
+            return 1;
+        }
+        cache->misses++;
+    }
+
+    // a change in any input moves every principal component
+    if (model->engine->update && num_changed >= 0 && !model->stale
+        && !model->pca.size)
+        model->engine->update(model->state, in, out, changed, num_changed);
+    else
+        impmap_model_evaluate(model, in, out);
+    model->stale = 0;
+
+    if (key) {
+        memcpy(cache->keys + slot * size_in, key, size_in * sizeof(int));
+        memcpy(cache->outputs + slot * size_out, out, size_out * sizeof(float));
+        cache->hashes[slot] = hash;
+        cache->used[slot] = 1;
+    }
+    return 0;
+}
+
+// *********************************************************
+// -(configure the evaluation cache)------------------------
+// The number of entries is rounded up to a power of two; 0 disables the
+// cache.  Entries are direct-mapped, so a collision simply replaces the
+// older evaluation.
+void impmap_model_set_cache(t_impmap_model *model, int num_entries,
+                            float epsilon)
+{
+    t_impmap_cache *cache = &model->cache;
+    int size = 1;
+
+    cache_free(cache);
+    cache->epsilon = epsilon > 0 ? epsilon : 0;
+    cache->hits = cache->misses = 0;
+    if (num_entries <= 0) {
+        cache->num_entries = 0;
+        return;
+    }
+    while (size < num_entries)
+        size <<= 1;
+    cache->num_entries = size;
+    if (model->trained)
+        cache_alloc(cache, model->size_in, model->size_out);
+}
+
+// *********************************************************
+// -(configure the principal component stage)--------------
+// A threshold in (0, 1] keeps the fewest leading components that explain
+// that fraction of the variance of the snapshot inputs; 0 disables the
+// stage.  The model must be retrained for the change to take effect.
+void impmap_model_set_pca(t_impmap_model *model, float threshold)
+{
+    if (threshold > 1)
+        threshold = 1;
+    model->pca.threshold = threshold > 0 ? threshold : 0;
+    pca_free(&model->pca);
+    model->trained = 0;
+}
+
+// Uses the eigenvectors of the covariance of the inputs or, for wide data
+// with more inputs than snapshots, those of the much smaller Gram matrix
+// of the centred snapshots, which span the same components.
+static int pca_fit(t_impmap_pca *pca, const float *inputs, int num_rows,
+                   int size_in)
+{
+    int i, j, c, r, k, wide = size_in > num_rows;
+    int n = wide ? num_rows : size_in;
+    double *mean = calloc(size_in, sizeof(double));
+    double *centred = malloc((long)num_rows * size_in * sizeof(double));
+    double *a = calloc(n * n, sizeof(double));
+    double *values = malloc(n * sizeof(double));
+    double *vectors = malloc(n * n * sizeof(double));
+    double total = 0, kept = 0;
+
+    for (r = 0; r < num_rows; r++) {
+        for (j = 0; j < size_in; j++)
+            mean[j] += inputs[(long)r * size_in + j];
+    }
+    for (j = 0; j < size_in; j++)
+        mean[j] /= num_rows;
+    for (r = 0; r < num_rows; r++) {
+        for (j = 0; j < size_in; j++)
+            centred[(long)r * size_in + j] = inputs[(long)r * size_in + j]
+                                             - mean[j];
+    }
+
+    if (wide) {
+        for (i = 0; i < n; i++) {
+            for (r = 0; r <= i; r++) {
+                double s = 0;
+                for (j = 0; j < size_in; j++)
+                    s += centred[(long)i * size_in + j]
+                         * centred[(long)r * size_in + j];
+                a[i * n + r] = a[r * n + i] = s;
+            }
+        }
+    }
+    else {
+        for (r = 0; r < num_rows; r++) {
+            const double *x = centred + (long)r * size_in;
+            for (i = 0; i < n; i++) {
+                for (j = 0; j <= i; j++)
+                    a[i * n + j] += x[i] * x[j];
+            }
+        }
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < i; j++)
+                a[j * n + i] = a[i * n + j];
+        }
+    }
+
+    if (impmap_symmetric_eigen(a, n, values, vectors)) {
+        free(mean);
+        free(centred);
+        free(a);
+        free(values);
+        free(vectors);
+        return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (values[i] > 0)
+            total += values[i];
+    }
+    for (k = 0; k < n && values[k] > total * PCA_MIN_VARIANCE;) {
+        kept += values[k++];
+        if (kept >= pca->threshold * total)
+            break;
+    }
+    // constant inputs still need one (empty) coordinate
+    if (k < 1)
+        k = 1;
+
+    pca->size = k;
+    pca->mean = malloc(size_in * sizeof(float));
+    pca->components = malloc(k * size_in * sizeof(float));
+    pca->scratch = malloc(k * sizeof(float));
+    for (j = 0; j < size_in; j++)
+        pca->mean[j] = (float)mean[j];
+    for (c = 0; c < k; c++) {
+        float *v = pca->components + c * size_in;
+        if (!wide) {
+            for (j = 0; j < size_in; j++)
+                v[j] = (float)vectors[c * n + j];
+            continue;
+        }
+        // map the Gram eigenvector back to input space and normalise
+        double norm = 0;
+        for (j = 0; j < size_in; j++) {
+            double s = 0;
+            for (r = 0; r < num_rows; r++)
+                s += centred[(long)r * size_in + j] * vectors[c * n + r];
+            mean[j] = s;
+            norm += s * s;
+        }
+        norm = norm > 0 ? 1 / sqrt(norm) : 0;
+        for (j = 0; j < size_in; j++)
+            v[j] = (float)(mean[j] * norm);
+    }
+
+    free(mean);
+    free(centred);
+    free(a);
+    free(values);
+    free(vectors);
+    return 0;
+}
+
+static void pca_project(const t_impmap_pca *pca, int size_in, const float *in,
+                        float *out)
+{
+    int c, j;
+    for (c = 0; c < pca->size; c++) {
+        const float *v = pca->components + c * size_in;
+        float s = 0;
+        for (j = 0; j < size_in; j++)
+            s += v[j] * (in[j] - pca->mean[j]);
+        out[c] = s;
+    }
+}
+
+static void pca_free(t_impmap_pca *pca)
+{
+    free(pca->mean);
+    free(pca->components);
+    free(pca->scratch);
+    pca->mean = 0;
+    pca->components = 0;
+    pca->scratch = 0;
+    pca->size = 0;
+}
+
+static void cache_alloc(t_impmap_cache *cache, int size_in, int size_out)
+{
+    int num_entries = cache->num_entries;
+    cache_free(cache);
+    cache->num_entries = num_entries;
+    cache->keys = malloc(num_entries * size_in * sizeof(int));
+    cache->outputs = malloc(num_entries * size_out * sizeof(float));
+    cache->hashes = malloc(num_entries * sizeof(unsigned int));
+    cache->used = calloc(num_entries, 1);
+    cache->scratch = malloc(size_in * sizeof(int));
+}
+
+static void cache_free(t_impmap_cache *cache)
+{
+    free(cache->keys);
+    free(cache->outputs);
+    free(cache->hashes);
+    free(cache->used);
+    free(cache->scratch);
+    cache->keys = 0;
+    cache->outputs = 0;
+    cache->hashes = 0;
+    cache->used = 0;
+    cache->scratch = 0;
+}
+
+// *********************************************************
+// -(cholesky factorisation)--------------------------------
+// Factors the symmetric positive-definite matrix a in place into its lower
+// triangle.  Returns non-zero if a is not positive definite.
+int impmap_cholesky(double *a, int n)
+{
+    int i, j, k;
+    for (j = 0; j < n; j++) {
+        double d = a[j * n + j];
+        for (k = 0; k < j; k++)
+            d -= a[j * n + k] * a[j * n + k];
+        if (d <= 0)
+            return 1;
+        d = sqrt(d);
+        a[j * n + j] = d;
+        for (i = j + 1; i < n; i++) {
+            double s = a[i * n + j];
+            for (k = 0; k < j; k++)
+                s -= a[i * n + k] * a[j * n + k];
+            a[i * n + j] = s / d;
+        }
+        for (i = 0; i < j; i++)
+            a[i * n + j] = 0;
+    }
+    return 0;
+}
+
+// *********************************************************
+// -(solve using cholesky factor)---------------------------
+// Solves L L^T x = b in place for num_rhs right-hand sides stored as the
+// columns of the n x num_rhs matrix b.
+void impmap_cholesky_solve(const double *l, int n, double *b, int num_rhs)
+{
+    int i, k, r;
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < i; k++) {
+            double lik = l[i * n + k];
+            for (r = 0; r < num_rhs; r++)
+                b[i * num_rhs + r] -= lik * b[k * num_rhs + r];
+        }
+        for (r = 0; r < num_rhs; r++)
+            b[i * num_rhs + r] /= l[i * n + i];
+    }
+    for (i = n - 1; i >= 0; i--) {
+        for (k = i + 1; k < n; k++) {
+            double lki = l[k * n + i];
+            for (r = 0; r < num_rhs; r++)
+                b[i * num_rhs + r] -= lki * b[k * num_rhs + r];
+        }
+        for (r = 0; r < num_rhs; r++)
+            b[i * num_rhs + r] /= l[i * n + i];
+    }
+}
+
+// *********************************************************
+// -(symmetric eigendecomposition)--------------------------
+// Diagonalises the symmetric n x n matrix a with cyclic Jacobi rotations,
+// destroying it.  The eigenvalues are left in descending order in values
+// and the matching unit eigenvectors in the rows of vectors.  Returns
+// non-zero if the rotations have not converged.
+int impmap_symmetric_eigen(double *a, int n, double *values, double *vectors)
+{
+    int i, p, q, k, sweep;
+
+    for (p = 0; p < n; p++) {
+        for (q = 0; q < n; q++)
+            vectors[p * n + q] = p == q;
+    }
+    for (sweep = 0; sweep < JACOBI_SWEEPS; sweep++) {
+        double off = 0, diag = 0;
+        for (p = 0; p < n; p++) {
+            diag += a[p * n + p] * a[p * n + p];
+            for (q = p + 1; q < n; q++)
+                off += a[p * n + q] * a[p * n + q];
+        }
+        if (off <= 1e-24 * diag)
+            break;
+        for (p = 0; p < n - 1; p++) {
+            for (q = p + 1; q < n; q++) {
+                double apq = a[p * n + q];
+                if (apq == 0)
+                    continue;
+                // rotate so that a[p][q] becomes zero
+                double theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+                double t = (theta >= 0 ? 1 : -1)
+                           / (fabs(theta) + sqrt(theta * theta + 1));
+                double c = 1 / sqrt(t * t + 1), s = t * c;
+                for (k = 0; k < n; k++) {
+                    double akp = a[k * n + p], akq = a[k * n + q];
+                    a[k * n + p] = c * akp - s * akq;
+                    a[k * n + q] = s * akp + c * akq;
+                }
+                for (k = 0; k < n; k++) {
+                    double apk = a[p * n + k], aqk = a[q * n + k];
+                    a[p * n + k] = c * apk - s * aqk;
+                    a[q * n + k] = s * apk + c * aqk;
+                }
+                for (k = 0; k < n; k++) {
+                    double vpk = vectors[p * n + k], vqk = vectors[q * n + k];
+                    vectors[p * n + k] = c * vpk - s * vqk;
+                    vectors[q * n + k] = s * vpk + c * vqk;
+                }
+            }
+        }
+    }
+    if (sweep == JACOBI_SWEEPS)
+        return 1;
+
+    // selection sort, largest eigenvalue first
+    for (p = 0; p < n; p++)
+        values[p] = a[p * n + p];
+    for (p = 0; p < n - 1; p++) {
+        for (i = p, q = p + 1; q < n; q++) {
+            if (values[q] > values[i])
+                i = q;
+        }
+        if (i == p)
+            continue;
+        double v = values[p];
+        values[p] = values[i];
+        values[i] = v;
+        for (k = 0; k < n; k++) {
+            v = vectors[p * n + k];
+            vectors[p * n + k] = vectors[i * n + k];
+            vectors[i * n + k] = v;
+        }
+    }
+    return 0;
+}
+
+// *********************************************************
+// -(linear engine)-----------------------------------------
+// Affine least-squares map y = W x + b fitted with a small ridge penalty so
+// that it stays solvable with fewer snapshots than inputs.  W is stored
+// column-major so that each input contributes one contiguous column, which
+// also lets a change in input j be applied as y += W[:,j] * dx_j.
+
+typedef struct _linear
+{
+    float lambda;               // ridge penalty relative to the mean variance
+    float density;              // fraction of changed inputs above which
+                                // a full evaluation is cheaper
+    int resync;                 // incremental updates between full evaluations
+    int size_in;
+    int size_out;
+    float *weights;             // size_in columns of size_out
+    float *bias;
+    float *last_in;             // input and output of the previous evaluation
+    float *last_out;
+    int valid;
+    int num_updates;
+} t_linear;
+
+static void *linear_new(void)
+{
+    t_linear *lin = calloc(1, sizeof(t_linear));
+    lin->lambda = 0.001f;
+    lin->density = 0.25f;
+    lin->resync = 1000;
+    return lin;
+}
+
+static void linear_free(void *state)
+{
+    t_linear *lin = state;
+    free(lin->weights);
+    free(lin->bias);
+    free(lin->last_in);
+    free(lin->last_out);
+    free(lin);
+}
+
+static int linear_set(void *state, const char *param, int argc,
+                      const float *argv)
+{
+    t_linear *lin = state;
+    if (argc != 1 || argv[0] < 0)
+        return 1;
+    if (strcmp(param, "lambda") == 0)
+        lin->lambda = argv[0];
+    else if (strcmp(param, "density") == 0)
+        lin->density = argv[0];
+    else if (strcmp(param, "resync") == 0)
+        lin->resync = (int)argv[0];
+    else
+        return 1;
+    return 0;
+}
+
+static int linear_train(void *state, const float *inputs, const float *outputs,
+                        const float *weights, int num_rows, int size_in,
+                        int size_out)
+{
+    t_linear *lin = state;
+    int i, j, k, r, n = size_in;
+    double *g = calloc(n * n + 1, sizeof(double));
+    double *b = calloc(n * size_out + 1, sizeof(double));
+    double row[n + 1], mean_in[n + 1], mean_out[size_out + 1], yc[size_out + 1];
+    double total = 0, trace = 0;
+
+    // centre the data so that the ridge penalty leaves the bias alone and
+    // does not depend on where the inputs sit
+    for (j = 0; j < size_in; j++)
+        mean_in[j] = 0;
+    for (i = 0; i < size_out; i++)
+        mean_out[i] = 0;
+    for (r = 0; r < num_rows; r++) {
+        double w = weights ? weights[r] : 1;
+        for (j = 0; j < size_in; j++)
+            mean_in[j] += w * inputs[r * size_in + j];
+        for (i = 0; i < size_out; i++)
+            mean_out[i] += w * outputs[r * size_out + i];
+        total += w;
+    }
+    for (j = 0; j < size_in && total > 0; j++)
+        mean_in[j] /= total;
+    for (i = 0; i < size_out && total > 0; i++)
+        mean_out[i] /= total;
+
+    // accumulate the normal equations of the centred data
+    for (r = 0; r < num_rows; r++) {
+        const float *x = inputs + r * size_in;
+        const float *y = outputs + r * size_out;
+        double w = weights ? weights[r] : 1;
+        for (j = 0; j < size_in; j++)
+            row[j] = x[j] - mean_in[j];
+        for (i = 0; i < size_out; i++)
+            yc[i] = y[i] - mean_out[i];
+        for (j = 0; j < n; j++) {
+            double wj = w * row[j];
+            for (k = 0; k <= j; k++)
+                g[j * n + k] += wj * row[k];
+            for (i = 0; i < size_out; i++)
+                b[j * size_out + i] += wj * yc[i];
+        }
+    }
+    for (j = 0; j < n; j++) {
+        for (k = 0; k < j; k++)
+            g[k * n + j] = g[j * n + k];
+        trace += g[j * n + j];
+    }
+    for (j = 0; j < n; j++)
+        g[j * n + j] += lin->lambda * trace / n + 1e-9;
+
+    if (n && impmap_cholesky(g, n)) {
+        free(g);
+        free(b);
+        return 1;
+    }
+    if (n)
+        impmap_cholesky_solve(g, n, b, size_out);
+
+    free(lin->weights);
+    free(lin->bias);
+    free(lin->last_in);
+    free(lin->last_out);
+    lin->weights = malloc(size_in * size_out * sizeof(float));
+    lin->bias = malloc(size_out * sizeof(float));
+    lin->last_in = malloc(size_in * sizeof(float));
+    lin->last_out = malloc(size_out * sizeof(float));
+    lin->valid = 0;
+    for (j = 0; j < size_in; j++) {
+        for (i = 0; i < size_out; i++)
+            lin->weights[j * size_out + i] = (float)b[j * size_out + i];
+    }
+    for (i = 0; i < size_out; i++) {
+        double bias = mean_out[i];
+        for (j = 0; j < size_in; j++)
+            bias -= b[j * size_out + i] * mean_in[j];
+        lin->bias[i] = (float)bias;
+    }
+    lin->size_in = size_in;
+    lin->size_out = size_out;
+
+    free(g);
+    free(b);
+    return 0;
+}
+
+static void linear_evaluate(void *state, const float *in, float *out)
+{
+    t_linear *lin = state;
+    int i, j, size_out = lin->size_out;
+    float *y = lin->last_out;
+    memcpy(y, lin->bias, size_out * sizeof(float));
+    for (j = 0; j < lin->size_in; j++) {
+        const float *w = lin->weights + j * size_out;
+        float xj = in[j];
+        if (xj == 0)
+            continue;
+        for (i = 0; i < size_out; i++)
+            y[i] += w[i] * xj;
+    }
+    memcpy(lin->last_in, in, lin->size_in * sizeof(float));
+    memcpy(out, y, size_out * sizeof(float));
+    lin->valid = 1;
+    lin->num_updates = 0;
+}
+
+// Rank-one updates accumulate rounding error, so a full evaluation is
+// forced every 'resync' updates.
+static void linear_update(void *state, const float *in, float *out,
+                          const int *changed, int num_changed)
+{
+    t_linear *lin = state;
+    int i, k, size_out = lin->size_out;
+    float *y = lin->last_out;
+
+    if (!lin->valid || num_changed > lin->density * lin->size_in
+        || lin->num_updates >= lin->resync) {
+        linear_evaluate(state, in, out);
+        return;
+    }
+    for (k = 0; k < num_changed; k++) {
+        int j = changed[k];
+        float dx = in[j] - lin->last_in[j];
+        if (dx == 0)
+            continue;
+        const float *w = lin->weights + j * size_out;
+        for (i = 0; i < size_out; i++)
+            y[i] += w[i] * dx;
+        lin->last_in[j] = in[j];
+    }
+    memcpy(out, y, size_out * sizeof(float));
+    lin->num_updates++;
+}
+
+// Rows are processed in blocks so that each weight column is loaded once
+// per block rather than once per row.  Leaves last_in and last_out alone.
+static void linear_batch(void *state, const float *inputs, float *outputs,
+                         int num_rows)
+{
+    t_linear *lin = state;
+    int i, j, r, r0, size_in = lin->size_in, size_out = lin->size_out;
+    for (r0 = 0; r0 < num_rows; r0 += LINEAR_BLOCK) {
+        int r1 = r0 + LINEAR_BLOCK < num_rows ? r0 + LINEAR_BLOCK : num_rows;
+        for (r = r0; r < r1; r++)
+            memcpy(outputs + (long)r * size_out, lin->bias,
+                   size_out * sizeof(float));
+        for (j = 0; j < size_in; j++) {
+            const float *w = lin->weights + j * size_out;
+            for (r = r0; r < r1; r++) {
+                float xj = inputs[(long)r * size_in + j];
+                float *y = outputs + (long)r * size_out;
+                for (i = 0; i < size_out; i++)
+                    y[i] += w[i] * xj;
+            }
+        }
+    }
+}
+
+static int linear_affine(void *state, float *weights, float *bias)
+{
+    t_linear *lin = state;
+    memcpy(weights, lin->weights, lin->size_in * lin->size_out * sizeof(float));
+    memcpy(bias, lin->bias, lin->size_out * sizeof(float));
+    return 0;
+}
+
+const t_impmap_engine impmap_engine_linear = {
+    "linear",
+    linear_new,
+    linear_free,
+    linear_set,
+    linear_train,
+    linear_evaluate,
+    linear_update,
+    linear_batch,
+    linear_affine,
+    0,
+    0,
+    0
+};
@@ -0,0 +1,148 @@
+//
+// impmap_model.h
+// native mapping engines for implicitmap
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#ifndef IMPMAP_MODEL_H
+#define IMPMAP_MODEL_H
+
+// An engine learns a mapping from the snapshot matrices (one row per
+// snapshot, inputs and outputs stored row-major) and evaluates it on the
+// live input vector.  Engines keep all of their state behind an opaque
+// pointer so the object only ever talks to them through this table.
+// Engines that can cheaply revise their previous output when only a few
+// inputs have changed also provide update(), which receives the offsets
+// changed since the last evaluation; others leave it null.  Engines with a
+// faster path for many rows at once (e.g. for drawing response curves) can
+// provide batch(); otherwise evaluate() is called for each row.  batch()
+// must not modify the engine state, since rendering calls it from several
+// threads at once.  Engines whose mapping is affine can export it through
+// affine() so that it can be evaluated elsewhere.  Engines that can tell
+// how uncertain they are provide variance(), which gives one variance per
+// output for an input.  Engines that learn online provide learn(), which
+// folds one more sample into the trained model.  Engines that fold a row
+// at the input of an earlier one into it provide duplicates(), which gives
+// how many rows the last train() folded.
+//
+// train() also receives a weight for each row, the number of snapshots the
+// row stands for once near-duplicates have been merged, or null if every
+// row is a single snapshot.  Engines that fit a squared error weight each
+// row's error by it; interpolating engines may ignore it.
+
+typedef struct _impmap_engine
+{
+    const char *name;
+    void *(*new)(void);
+    void (*free)(void *state);
+    int (*set)(void *state, const char *param, int argc, const float *argv);
+    int (*train)(void *state, const float *inputs, const float *outputs,
+                 const float *weights, int num_rows, int size_in,
+                 int size_out);
+    void (*evaluate)(void *state, const float *in, float *out);
+    void (*update)(void *state, const float *in, float *out,
+                   const int *changed, int num_changed);
+    void (*batch)(void *state, const float *inputs, float *outputs,
+                  int num_rows);
+    int (*affine)(void *state, float *weights, float *bias);
+    void (*variance)(void *state, const float *in, float *variance);
+    int (*learn)(void *state, const float *in, const float *out);
+    int (*duplicates)(void *state);
+} t_impmap_engine;
+
+// Optional memo of recent evaluations, keyed on the input vector quantised
+// to multiples of epsilon (or on its exact bits if epsilon is 0).
+typedef struct _impmap_cache
+{
+    int num_entries;            // power of two, 0 if disabled
+    float epsilon;
+    int *keys;                  // num_entries quantised input vectors
+    float *outputs;             // num_entries output vectors
+    unsigned int *hashes;
+    char *used;
+    int *scratch;
+    long hits;
+    long misses;
+} t_impmap_cache;
+
+// Optional projection of the input vector onto its principal components,
+// fitted from the snapshot inputs whenever the model is trained.  The
+// engine then only ever sees the size projected coordinates.
+typedef struct _impmap_pca
+{
+    float threshold;            // fraction of variance to keep, 0 if disabled
+    int size;                   // number of components kept, 0 if inactive
+    float *mean;                // size_in
+    float *components;          // size rows of size_in
+    float *scratch;             // projection of the live input
+} t_impmap_pca;
+
+// Engine parameters that have been set, kept so that another model of the
+// same engine can be given them.
+typedef struct _impmap_param
+{
+    char *name;
+    int argc;
+    float *argv;
+    struct _impmap_param *next;
+} t_impmap_param;
+
+typedef struct _impmap_model
+{
+    const t_impmap_engine *engine;
+    void *state;
+    int size_in;
+    int size_out;
+    int trained;
+    int stale;                  // engine missed input changes during hits
+    t_impmap_cache cache;
+    t_impmap_pca pca;
+    t_impmap_param *params;
+} t_impmap_model;
+
+const t_impmap_engine *impmap_engine_find(const char *name);
+
+t_impmap_model *impmap_model_new(const char *engine);
+t_impmap_model *impmap_model_new_like(const t_impmap_model *model);
+void impmap_model_free(t_impmap_model *model);
+int impmap_model_set(t_impmap_model *model, const char *param, int argc,
+                     const float *argv);
+int impmap_model_train(t_impmap_model *model, const float *inputs,
+                       const float *outputs, const float *weights,
+                       int num_rows, int size_in, int size_out);
+int impmap_model_ready(t_impmap_model *model, int size_in, int size_out);
+void impmap_model_evaluate(t_impmap_model *model, const float *in, float *out);
+int impmap_model_update(t_impmap_model *model, const float *in, float *out,
+                        const int *changed, int num_changed);
+void impmap_model_evaluate_batch(t_impmap_model *model, const float *inputs,
+                                 float *outputs, int num_rows);
+int impmap_model_affine(t_impmap_model *model, float *weights, float *bias);
+int impmap_model_variance(t_impmap_model *model, const float *in,
+                          float *variance);
+int impmap_model_learn(t_impmap_model *model, const float *in,
+                       const float *out);
+int impmap_model_duplicates(t_impmap_model *model);
+int impmap_model_render(t_impmap_model *model, const float *inputs,
+                        float *outputs, int num_rows, int num_threads);
+void impmap_model_set_cache(t_impmap_model *model, int num_entries,
+                            float epsilon);
+void impmap_model_set_pca(t_impmap_model *model, float threshold);
+
+// dense linear algebra shared by the engines; matrices are row-major
+int impmap_cholesky(double *a, int n);
+void impmap_cholesky_solve(const double *l, int n, double *b, int num_rhs);
+int impmap_symmetric_eigen(double *a, int n, double *values, double *vectors);
+
+extern const t_impmap_engine impmap_engine_linear;
+extern const t_impmap_engine impmap_engine_lasso;
+extern const t_impmap_engine impmap_engine_rff;
+extern const t_impmap_engine impmap_engine_delaunay;
+extern const t_impmap_engine impmap_engine_gp;
+extern const t_impmap_engine impmap_engine_lwpr;
+
+#endif // IMPMAP_MODEL_H
@@ -0,0 +1,158 @@
+//
+// impmap_pack.c
+// compact storage formats for snapshot vectors
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#include "impmap_pack.h"
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+static const char *names[] = {"float", "half", "int16", "int8"};
+
+int impmap_pack_find(const char *name)
+{
+    int i;
+    for (i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char *impmap_pack_name(int format)
+{
+    return format >= 0 && format < 4 ? names[format] : "unknown";
+}
+
+int impmap_pack_bytes(int format)
+{
+    switch (format) {
+        case IMPMAP_PACK_HALF:
+        case IMPMAP_PACK_INT16:
+            return 2;
+        case IMPMAP_PACK_INT8:
+            return 1;
+        default:
+            return 4;
+    }
+}
+
+// Steps available above a column's minimum, 0 for the float formats.
+int impmap_pack_levels(int format)
+{
+    switch (format) {
+        case IMPMAP_PACK_INT16:
+            return 65535;
+        case IMPMAP_PACK_INT8:
+            return 255;
+        default:
+            return 0;
+    }
+}
+
+// Rounds to nearest even, saturating to infinity.
+static uint16_t float_to_half(float f)
+{
+    uint32_t x, sign;
+    memcpy(&x, &f, 4);
+    sign = x & 0x80000000u;
+    x ^= sign;
+    if (x >= 0x47800000u)                   // too large, infinite or NaN
+        x = x > 0x7f800000u ? 0x7e00 : 0x7c00;
+    else if (x < 0x38800000u) {             // subnormal: let the FPU round
+        float t;
+        memcpy(&t, &x, 4);
+        t += 0.5f;
+        memcpy(&x, &t, 4);
+        x -= 0x3f000000u;
+    }
+    else {
+        uint32_t odd = (x >> 13) & 1;
+        x += 0xc8000fffu + odd;             // rebias the exponent and round
+        x >>= 13;
+    }
+    return (uint16_t)(x | (sign >> 16));
+}
+
+// Shifting the exponent and mantissa into place and scaling by 2^112
+// rebiases normal and subnormal halves alike.
+static float half_to_float(uint16_t h)
+{
+    uint32_t bits = (uint32_t)(h & 0x7fff) << 13;
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    float f;
+    if (bits >= 0x0f800000u)                // infinite or NaN
+        bits |= 0x7f800000u;
+    else {
+        memcpy(&f, &bits, 4);
+        f *= 5.192296858534828e33f;
+        memcpy(&bits, &f, 4);
+    }
+    bits |= sign;
+    memcpy(&f, &bits, 4);
+    return f;
+}
+
+// *********************************************************
+// -(pack)--------------------------------------------------
+// Each format has its own loop so that the integer conversions vectorise.
+void impmap_pack(int format, const float *values, void *packed, int length,
+                 const float *low, const float *step)
+{
+    int i;
+    if (format == IMPMAP_PACK_HALF) {
+        uint16_t *h = packed;
+        for (i = 0; i < length; i++)
+            h[i] = float_to_half(values[i]);
+    }
+    else if (format == IMPMAP_PACK_INT16) {
+        uint16_t *q = packed;
+        for (i = 0; i < length; i++) {
+            float v = step[i] > 0 ? (values[i] - low[i]) / step[i] : 0;
+            v = v < 0 ? 0 : v > 65535 ? 65535 : v;
+            q[i] = (uint16_t)(v + 0.5f);
+        }
+    }
+    else if (format == IMPMAP_PACK_INT8) {
+        uint8_t *q = packed;
+        for (i = 0; i < length; i++) {
+            float v = step[i] > 0 ? (values[i] - low[i]) / step[i] : 0;
+            v = v < 0 ? 0 : v > 255 ? 255 : v;
+            q[i] = (uint8_t)(v + 0.5f);
+        }
+    }
+    else
+        memcpy(packed, values, length * sizeof(float));
+}
+
+// *********************************************************
+// -(unpack)------------------------------------------------
+void impmap_unpack(int format, const void *packed, float *values, int length,
+                   const float *low, const float *step)
+{
+    int i;
+    if (format == IMPMAP_PACK_HALF) {
+        const uint16_t *h = packed;
+        for (i = 0; i < length; i++)
+            values[i] = half_to_float(h[i]);
+    }
+    else if (format == IMPMAP_PACK_INT16) {
+        const uint16_t *q = packed;
+        for (i = 0; i < length; i++)
+            values[i] = low[i] + step[i] * q[i];
+    }
+    else if (format == IMPMAP_PACK_INT8) {
+        const uint8_t *q = packed;
+        for (i = 0; i < length; i++)
+            values[i] = low[i] + step[i] * q[i];
+    }
+    else
+        memcpy(values, packed, length * sizeof(float));
+}
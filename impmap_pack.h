@@ -0,0 +1,37 @@
+//
+// impmap_pack.h
+// compact storage formats for snapshot vectors
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#ifndef IMPMAP_PACK_H
+#define IMPMAP_PACK_H
+
+// Vectors are packed element by element into IEEE half floats, or into
+// unsigned 16- or 8-bit steps above a per-column minimum.  Half floats
+// keep about three significant digits at any scale; the integer formats
+// spread their levels evenly over each column's range, which the caller
+// chooses and keeps for every vector packed with it.
+
+typedef enum {
+    IMPMAP_PACK_FLOAT = 0,
+    IMPMAP_PACK_HALF  = 1,
+    IMPMAP_PACK_INT16 = 2,
+    IMPMAP_PACK_INT8  = 3
+} t_impmap_pack_format;
+
+int impmap_pack_find(const char *name);
+const char *impmap_pack_name(int format);
+int impmap_pack_bytes(int format);
+int impmap_pack_levels(int format);
+void impmap_pack(int format, const float *values, void *packed, int length,
+                 const float *low, const float *step);
+void impmap_unpack(int format, const void *packed, float *values, int length,
+                   const float *low, const float *step);
+
+#endif // IMPMAP_PACK_H
@@ -0,0 +1,298 @@
+//
+// impmap_rff.c
+// kernel mapping engine approximated with random Fourier features
+// http://www.idmil.org/software/libmapper
+//
+// This software was written in the Input Devices and Music Interaction
+// Laboratory at McGill University in Montreal, and is copyright those
+// found in the AUTHORS file.  It is licensed under the GNU Lesser Public
+// General License version 2.1 or later.  Please see COPYING for details.
+//
+
+#include "impmap_model.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define RFF_MAX_FEATURES 2048   // keeps the D x D covariance within 32 MB
+#define RFF_BLOCK        64     // rows whose features are accumulated together
+#define RFF_LANES        8      // partial sums per inner product
+
+// Approximates ridge regression with a Gaussian kernel by mapping each
+// (standardised) input through D features sqrt(2/D) cos(w_k . x + b_k),
+// with w_k drawn from N(0, 1/bandwidth^2) and b_k uniform on [0, 2pi), and
+// fitting a linear map from the features to the outputs.  Training is a
+// single pass that accumulates the D x D feature covariance, so it is
+// linear in the number of snapshots, and evaluation costs O(D size_in)
+// however many snapshots there were.  The standardisation is folded into
+// the frequencies and phases as they are drawn.
+
+typedef struct _rff
+{
+    int num_features;
+    float bandwidth;            // kernel width in standard deviations
+    float lambda;               // ridge penalty relative to the mean variance
+    unsigned int seed;
+    int size;                   // features drawn at the last training
+    int size_in;
+    int size_out;
+    float *freqs;               // size rows of size_in
+    float *phases;
+    float *weights;             // size rows of size_out
+    float *bias;
+} t_rff;
+
+static void *rff_new(void)
+{
+    t_rff *rff = calloc(1, sizeof(t_rff));
+    rff->num_features = 256;
+    rff->bandwidth = 1;
+    rff->lambda = 0.001f;
+    rff->seed = 1;
+    return rff;
+}
+
+static void rff_free(void *state)
+{
+    t_rff *rff = state;
+    free(rff->freqs);
+    free(rff->phases);
+    free(rff->weights);
+    free(rff->bias);
+    free(rff);
+}
+
+static int rff_set(void *state, const char *param, int argc,
+                   const float *argv)
+{
+    t_rff *rff = state;
+    if (argc != 1 || argv[0] < 0)
+        return 1;
+    if (strcmp(param, "features") == 0 && argv[0] >= 1
+        && argv[0] <= RFF_MAX_FEATURES)
+        rff->num_features = (int)argv[0];
+    else if (strcmp(param, "bandwidth") == 0 && argv[0] > 0)
+        rff->bandwidth = argv[0];
+    else if (strcmp(param, "lambda") == 0)
+        rff->lambda = argv[0];
+    else if (strcmp(param, "seed") == 0)
+        rff->seed = (unsigned int)argv[0];
+    else
+        return 1;
+    return 0;
+}
+
+// xorshift, so that a given seed draws the same features everywhere
+static double rff_uniform(unsigned int *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return (*s + 0.5) / 4294967296.0;
+}
+
+static double rff_gaussian(unsigned int *s)
+{
+    double u = rff_uniform(s), v = rff_uniform(s);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static void rff_features(const t_rff *rff, const float *in, float *z)
+{
+    int k, j, size_in = rff->size_in;
+    float norm = sqrtf(2.0f / rff->size);
+    for (k = 0; k < rff->size; k++) {
+        const float *w = rff->freqs + k * size_in;
+        float s = rff->phases[k];
+        for (j = 0; j < size_in; j++)
+            s += w[j] * in[j];
+        z[k] = norm * cosf(s);
+    }
+}
+
+static int rff_train(void *state, const float *inputs, const float *outputs,
+                     const float *weights, int num_rows, int size_in,
+                     int size_out)
+{
+    t_rff *rff = state, next = *rff;
+    int i, j, k, r, r0, d = rff->num_features, failed = 1;
+    unsigned int seed = rff->seed ? rff->seed : 1;
+    double *mean = calloc(size_in, sizeof(double));
+    double *scale = calloc(size_in, sizeof(double));
+    double *ymean = calloc(size_out, sizeof(double));
+    double *g = calloc((long)d * d, sizeof(double));
+    double *b = calloc((long)d * size_out, sizeof(double));
+    float *z = malloc(d * sizeof(float));
+    float *block = calloc((long)RFF_BLOCK * d, sizeof(float));
+    float root[RFF_BLOCK];
+    double trace = 0, total = 0;
+
+    // the new model is built aside and only replaces the old one once it
+    // has been solved, so a failure leaves the previous training in place
+    next.freqs = malloc((long)d * size_in * sizeof(float));
+    next.phases = malloc(d * sizeof(float));
+    next.weights = malloc((long)d * size_out * sizeof(float));
+    next.bias = malloc(size_out * sizeof(float));
+    next.size = d;
+    next.size_in = size_in;
+    next.size_out = size_out;
+    if (!mean || !scale || !ymean || !g || !b || !z || !block || !next.freqs
+        || !next.phases || !next.weights || !next.bias)
+        goto done;
+
+    for (r = 0; r < num_rows; r++) {
+        double w = weights ? weights[r] : 1;
+        for (j = 0; j < size_in; j++)
+            mean[j] += w * inputs[(long)r * size_in + j];
+        for (i = 0; i < size_out; i++)
+            ymean[i] += w * outputs[(long)r * size_out + i];
+        total += w;
+    }
+    for (j = 0; j < size_in; j++)
+        mean[j] /= total;
+    for (i = 0; i < size_out; i++)
+        ymean[i] /= total;
+    for (r = 0; r < num_rows; r++) {
+        double w = weights ? weights[r] : 1;
+        for (j = 0; j < size_in; j++) {
+            double dx = inputs[(long)r * size_in + j] - mean[j];
+            scale[j] += w * dx * dx;
+        }
+    }
+    for (j = 0; j < size_in; j++) {
+        scale[j] = sqrt(scale[j] / total);
+        scale[j] = scale[j] > 1e-12 ? 1 / scale[j] : 0;
+    }
+
+    // draw the features directly in raw input units
+    for (k = 0; k < d; k++) {
+        double phase = 2 * M_PI * rff_uniform(&seed);
+        for (j = 0; j < size_in; j++) {
+            double w = rff_gaussian(&seed) / rff->bandwidth * scale[j];
+            next.freqs[k * size_in + j] = (float)w;
+            phase -= w * mean[j];
+        }
+        next.phases[k] = (float)phase;
+    }
+
+    // accumulate the ridge normal equations a block of rows at a time,
+    // keeping each feature's values for the block contiguous so that the
+    // inner products run over adjacent memory; a short final block is
+    // padded with zeros.  Features are scaled by the square root of each
+    // row's weight so that their products carry the weight once.
+    for (r0 = 0; r0 < num_rows; r0 += RFF_BLOCK) {
+        int rows = num_rows - r0 < RFF_BLOCK ? num_rows - r0 : RFF_BLOCK;
+        for (r = 0; r < rows; r++) {
+            root[r] = weights ? sqrtf(weights[r0 + r]) : 1;
+            rff_features(&next, inputs + (long)(r0 + r) * size_in, z);
+            for (k = 0; k < d; k++)
+                block[k * RFF_BLOCK + r] = root[r] * z[k];
+        }
+        if (rows < RFF_BLOCK) {
+            for (k = 0; k < d; k++)
+                memset(block + k * RFF_BLOCK + rows, 0,
+                       (RFF_BLOCK - rows) * sizeof(float));
+        }
+        for (j = 0; j < d; j++) {
+            const float *zj = block + j * RFF_BLOCK;
+            for (k = 0; k <= j; k++) {
+                const float *zk = block + k * RFF_BLOCK;
+                // independent partial sums let the compiler vectorise
+                float s[RFF_LANES] = {0};
+                double sum = 0;
+                for (r = 0; r < RFF_BLOCK; r += RFF_LANES) {
+                    for (i = 0; i < RFF_LANES; i++)
+                        s[i] += zj[r + i] * zk[r + i];
+                }
+                for (i = 0; i < RFF_LANES; i++)
+                    sum += s[i];
+                g[(long)j * d + k] += sum;
+            }
+            for (r = 0; r < rows; r++) {
+                const float *y = outputs + (long)(r0 + r) * size_out;
+                float zw = root[r] * zj[r];
+                for (i = 0; i < size_out; i++)
+                    b[(long)j * size_out + i] += zw * (y[i] - ymean[i]);
+            }
+        }
+    }
+    for (j = 0; j < d; j++) {
+        for (k = 0; k < j; k++)
+            g[(long)k * d + j] = g[(long)j * d + k];
+        trace += g[(long)j * d + j];
+    }
+    for (j = 0; j < d; j++)
+        g[(long)j * d + j] += rff->lambda * trace / d + 1e-9;
+    if (impmap_cholesky(g, d))
+        goto done;
+    impmap_cholesky_solve(g, d, b, size_out);
+
+    for (j = 0; j < d * size_out; j++)
+        next.weights[j] = (float)b[j];
+    for (i = 0; i < size_out; i++)
+        next.bias[i] = (float)ymean[i];
+    free(rff->freqs);
+    free(rff->phases);
+    free(rff->weights);
+    free(rff->bias);
+    *rff = next;
+    failed = 0;
+
+done:
+    if (failed) {
+        free(next.freqs);
+        free(next.phases);
+        free(next.weights);
+        free(next.bias);
+    }
+    free(z);
+    free(block);
+    free(mean);
+    free(scale);
+    free(g);
+    free(b);
+    free(ymean);
+    return failed;
+}
+
+// Keeps the features on the stack so that batch() can share it from
+// several threads.
+static void rff_evaluate(void *state, const float *in, float *out)
+{
+    const t_rff *rff = state;
+    int i, k, size_out = rff->size_out;
+    float z[rff->size];
+
+    rff_features(rff, in, z);
+    memcpy(out, rff->bias, size_out * sizeof(float));
+    for (k = 0; k < rff->size; k++) {
+        const float *w = rff->weights + k * size_out;
+        for (i = 0; i < size_out; i++)
+            out[i] += w[i] * z[k];
+    }
+}
+
+static void rff_batch(void *state, const float *inputs, float *outputs,
+                      int num_rows)
+{
+    const t_rff *rff = state;
+    int r;
+    for (r = 0; r < num_rows; r++)
+        rff_evaluate(state, inputs + (long)r * rff->size_in,
+                     outputs + (long)r * rff->size_out);
+}
+
+const t_impmap_engine impmap_engine_rff = {
+    "rff",
+    rff_new,
+    rff_free,
+    rff_set,
+    rff_train,
+    rff_evaluate,
+    0,
+    rff_batch,
+    0,
+    0,
+    0,
+    0
+};